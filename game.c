@@ -12,16 +12,93 @@
 #include <emscripten/fetch.h>
 #else
 #include <pthread.h>
+#include <unistd.h>
 #include <curl/curl.h>
 #endif
 
+// leaf scans and the chase kernel use the widest vectors the build targets, the release build's -march=native gets AVX2
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "game.h"
 
+/**
+ * Float lanes for the qtree leaf scans and the enemy chase kernel.
+ * SCAN_LANES is left undefined on builds without SSE2 (wasm, arm), those take the scalar loops.
+ */
+#if defined(__AVX2__)
+#define SCAN_LANES 8
+typedef __m256 ScanVec;
+#define scan_load(p) _mm256_loadu_ps(p)
+#define scan_set(v) _mm256_set1_ps(v)
+#define scan_add(a, b) _mm256_add_ps(a, b)
+#define scan_sub(a, b) _mm256_sub_ps(a, b)
+#define scan_mul(a, b) _mm256_mul_ps(a, b)
+#define scan_min(a, b) _mm256_min_ps(a, b)
+#define scan_max(a, b) _mm256_max_ps(a, b)
+#define scan_le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define scan_and(a, b) _mm256_and_ps(a, b)
+#define scan_or(a, b) _mm256_or_ps(a, b)
+#define scan_mask(a) _mm256_movemask_ps(a)
+#define scan_store(p, a) _mm256_storeu_ps(p, a)
+#define scan_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define scan_rsqrt(a) _mm256_rsqrt_ps(a)
+
+// All ones in the lanes where the byte at p has none of bits set
+static inline ScanVec scan_bits_clear(const unsigned char *p, int bits) {
+    __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p));
+    v = _mm256_and_si256(v, _mm256_set1_epi32(bits));
+    return _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, _mm256_setzero_si256()));
+}
+#elif defined(__SSE2__)
+#define SCAN_LANES 4
+typedef __m128 ScanVec;
+#define scan_load(p) _mm_loadu_ps(p)
+#define scan_set(v) _mm_set1_ps(v)
+#define scan_add(a, b) _mm_add_ps(a, b)
+#define scan_sub(a, b) _mm_sub_ps(a, b)
+#define scan_mul(a, b) _mm_mul_ps(a, b)
+#define scan_min(a, b) _mm_min_ps(a, b)
+#define scan_max(a, b) _mm_max_ps(a, b)
+#define scan_le(a, b) _mm_cmple_ps(a, b)
+#define scan_and(a, b) _mm_and_ps(a, b)
+#define scan_or(a, b) _mm_or_ps(a, b)
+#define scan_mask(a) _mm_movemask_ps(a)
+#define scan_store(p, a) _mm_storeu_ps(p, a)
+#define scan_lt(a, b) _mm_cmplt_ps(a, b)
+#define scan_rsqrt(a) _mm_rsqrt_ps(a)
+
+// All ones in the lanes where the byte at p has none of bits set
+static inline ScanVec scan_bits_clear(const unsigned char *p, int bits) {
+    int packed;
+    memcpy(&packed, p, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    v = _mm_and_si128(v, _mm_set1_epi32(bits));
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(v, zero));
+}
+#endif
+
 // global state
 // most funcs assume state pointer is valid when accessed
 // init properly before use
 GameState *state = NULL;
 
+// picked once at startup and kept across restarts
+SpatialIndexType enemy_index_type = ENEMY_INDEX_TYPE;
+
+// threads of the job pool, 0 takes one per core
+int num_job_threads = 0;
+
+// off keeps the enemy index on its compile time settings, the tuner picks by wall clock time
+bool is_index_tuned = true;
+
+// spatial index counters, global since the backends count into it
+IndexStats index_stats = { 0 };
+
 // MARK: :init :malloc
 
 void gamestate_create() {
@@ -76,10 +153,12 @@ void gamestate_create() {
             .flame_ts = 0,
             .frost_wave_ts = 0,
             .orbs_ts = 0,
+            .laser_ts = 0,
 
             .qtree_update_ts = 0,
             .enemy_spawn_ts = 0,
             .enemy_spawn_interval = DEFAULT_ENEMY_SPAWN_INTERVAL_MS,
+            .enemy_clock_ts = get_current_time_millis() - ENEMY_CLOCK_KEEP_MS,
         },
         .stats = (Stats) {
             .bullet_interval = get_base_stat_value(BULLET_INTERVAL),
@@ -115,6 +194,11 @@ void gamestate_create() {
             .orbs_count = get_base_stat_value(ORBS_COUNT),
             .orbs_size = get_base_stat_value(ORBS_SIZE),
 
+            .laser_interval = get_base_stat_value(LASER_INTERVAL),
+            .laser_range = get_base_stat_value(LASER_RANGE),
+            .laser_damage = get_base_stat_value(LASER_DAMAGE),
+            .laser_penetration = get_base_stat_value(LASER_PENETRATION),
+
             .player_speed = get_base_stat_value(PLAYER_SPEED),
             .shiny_chance = get_base_stat_value(SHINY_CHANCE),
         },
@@ -125,6 +209,7 @@ void gamestate_create() {
             .flame_level = 0,
             .frost_wave_level = 0,
             .orbs_level = 0,
+            .laser_level = 0,
             .speed_level = 0,
             .shiny_level = 0,
         },
@@ -135,9 +220,11 @@ void gamestate_create() {
             .flame_level = 0,
             .frost_wave_level = 0,
             .orbs_level = 0,
+            .laser_level = 0,
             .speed_level = 0,
             .shiny_level = 0,
         },
+        .jobs = jobs_create(num_job_threads > 0 ? num_job_threads : jobs_num_cores()),
         .toasts = (Toast*) malloc(MAX_NUM_TOASTS * sizeof(Toast)),
         .toasts_count = 0,
         .wave_index = 0,
@@ -164,11 +251,17 @@ void gamestate_create() {
         .flame_particles = (Particle*) malloc(MAX_FLAME_PARTICLES * sizeof(Particle)),
         .flame_particles_count = 0,
         .frost_wave_particles = (Particle*) malloc(MAX_FROST_WAVE_PARTICLES * sizeof(Particle)),
+        .laser_start = Vector2Zero(),
+        .laser_end = Vector2Zero(),
+        .broadphase = broadphase_create(),
 
         // Enemy
-        .enemies = (Enemy*) malloc(MAX_ENEMIES * sizeof(Enemy)),
         .enemy_count = 0,
-        .enemy_qtree = qtree_create(get_visible_rect(world_center, 1.0)),
+        .enemy_index = index_create(
+            enemy_index_type,
+            get_visible_rect(world_center, 1.0),
+            MAX_ENEMIES
+        ),
         .num_enemies_per_tick = 1,
 
         // World
@@ -180,12 +273,9 @@ void gamestate_create() {
         .decorations = (Decoration*) malloc(NUM_DECORATIONS * sizeof(Decoration)),
         .pickups = (Pickup*) malloc(MAX_PICKUPS * sizeof(Pickup)),
         .pickups_count = 0,
-        .pickups_qtree = qtree_create(
-            (QRect) {
-                world_center.x, world_center.y,
-                32000, 32000
-            }
-        ),
+        .pickup_slots = (PickupSlot*) malloc(MAX_PICKUPS * sizeof(PickupSlot)),
+        .pickup_free_slot = NO_PICKUP,
+        .pickups_grid = static_grid_create(PICKUPS_CELL_SIZE, MAX_PICKUPS),
 
         // UI
         .master_volume = 1.0f,
@@ -193,10 +283,6 @@ void gamestate_create() {
         .main_menu_enemies = (Enemy*) malloc(MAX_MAIN_MENU_ENEMIES * sizeof(Enemy)),
         .main_menu_enemies_count = 0,
 
-        // Others
-        .query_points = malloc(MAX_ENEMIES * sizeof(QPoint)),
-        .num_query_points = 0,
-
         .is_show_debug_gui = false,
         .temp = (Temp) {
             .ct = 0,
@@ -204,17 +290,34 @@ void gamestate_create() {
         },
     };
 
-    if (!state->bullets || !state->enemies || !state->query_points || !state->enemy_qtree) {
+    bool is_enemies_ok = enemies_init(&state->enemies, MAX_ENEMIES);
+    if (!state->bullets || !is_enemies_ok || !state->enemy_index || !state->broadphase ||
+        !state->pickups || !state->pickup_slots || !state->pickups_grid) {
+        jobs_destroy(state->jobs);
         free(state->bullets);
-        free(state->query_points);
-        free(state->enemies);
-        qtree_destroy(state->enemy_qtree);
+        broadphase_destroy(state->broadphase);
+        enemies_destroy(&state->enemies);
+        index_destroy(state->enemy_index);
+        free(state->pickups);
+        free(state->pickup_slots);
+        static_grid_destroy(state->pickups_grid);
         free(state);
 
         printe("Error malloc game state components");
         return;
     }
 
+    if (!state->jobs) {
+        // the parallel passes just run on the main thread
+        printe("Error starting the job pool");
+    }
+    index_tuner_init(&state->enemy_index_tuner, state->enemy_index);
+    if (!neighbours_init(&state->player_neighbours, MAX_ENEMIES)) {
+        // everything just asks the index directly then
+        printe("Error malloc player neighbours");
+    }
+    pickups_init();
+
     // idk if I need this
     SetTextureFilter(state->render_texture.texture, TEXTURE_FILTER_POINT);
 
@@ -232,6 +335,7 @@ void gamestate_destroy() {
         return;
     }
 
+    jobs_destroy(state->jobs);
     free(state->toasts);
     state->toasts_count = 0;
 
@@ -246,21 +350,22 @@ void gamestate_destroy() {
     state->flame_particles_count = 0;
     free(state->frost_wave_particles);
     state->frost_wave_particles_count = 0;
+    broadphase_destroy(state->broadphase);
 
-    free(state->enemies);
+    enemies_destroy(&state->enemies);
     state->enemy_count = 0;
-    qtree_destroy(state->enemy_qtree);
+    index_destroy(state->enemy_index);
+    neighbours_destroy(&state->player_neighbours);
 
     free(state->decorations);
     free(state->pickups);
     state->pickups_count = 0;
-    qtree_destroy(state->pickups_qtree);
+    free(state->pickup_slots);
+    static_grid_destroy(state->pickups_grid);
 
     free(state->main_menu_enemies);
     state->main_menu_enemies_count = 0;
 
-    free(state->query_points);
-    state->num_query_points = 0;
 
     UnloadTexture(state->sprite_sheet);
     UnloadRenderTexture(state->render_texture);
@@ -291,9 +396,11 @@ void resume_timers() {
     state->timer.flame_ts += delta;
     state->timer.frost_wave_ts += delta;
     state->timer.orbs_ts += delta;
+    state->timer.laser_ts += delta;
 
     state->timer.qtree_update_ts += delta;
     state->timer.enemy_spawn_ts += delta;
+    state->timer.enemy_clock_ts += delta;
 }
 
 // MARK: :render :draw
@@ -374,6 +481,12 @@ void draw_game() {
                 (Vec2){ xpos, ypos }, font_size, 2, color
             );
             ypos += ypadding;
+            DrawTextEx(
+                state->custom_font,
+                TextFormat("Enemy index: %s", index_type_name(state->enemy_index->type)),
+                (Vec2){ xpos, ypos }, font_size, 2, color
+            );
+            ypos += ypadding;
             DrawTextEx(
                 state->custom_font,
                 TextFormat("#Enemies on screen: %d", state->temp.num_enemies_drawn),
@@ -422,6 +535,52 @@ void draw_game() {
                 (Vec2){ xpos, ypos }, font_size, 2, color
             );
             ypos += ypadding;
+
+            // Spatial index, its shape now and what each call site cost last frame
+            if (INDEX_STATS) {
+                xpos = 450;
+                ypos = 200;
+                IndexTreeStats tree;
+                index_tree_stats(state->enemy_index, &tree);
+                DrawTextEx(
+                    state->custom_font,
+                    TextFormat(
+                        "Index %s: far %d, nodes %d, leaves %d, depth max %d avg %.1f, %s %.0f",
+                        index_type_name(state->enemy_index->type), tree.num_far_points,
+                        tree.num_nodes, tree.num_leaves, tree.max_depth, tree.avg_depth,
+                        index_param_name(state->enemy_index->type), index_get_param(state->enemy_index)
+                    ),
+                    (Vec2){ xpos, ypos }, font_size, 2, color
+                );
+                ypos += ypadding;
+                DrawTextEx(
+                    state->custom_font,
+                    TextFormat(
+                        "Leaf pts 0:%d 1:%d 2:%d 4:%d 8:%d 16:%d 32:%d 64+:%d",
+                        tree.leaf_histogram[0], tree.leaf_histogram[1], tree.leaf_histogram[2],
+                        tree.leaf_histogram[3], tree.leaf_histogram[4], tree.leaf_histogram[5],
+                        tree.leaf_histogram[6], tree.leaf_histogram[7]
+                    ),
+                    (Vec2){ xpos, ypos }, font_size, 2, color
+                );
+                ypos += ypadding;
+
+                for (int i = 0; i < NUM_INDEX_SITES; i++) {
+                    IndexSiteStats *site = &index_stats.last_frame[i];
+                    if (site->queries == 0 && site->time == 0)
+                        continue;
+                    DrawTextEx(
+                        state->custom_font,
+                        TextFormat(
+                            "%s: q %ld, nodes %ld, pts %ld, %.2fms",
+                            index_site_name(i), site->queries,
+                            site->nodes_visited, site->points_tested, site->time * 1000
+                        ),
+                        (Vec2){ xpos, ypos }, font_size, 2, color
+                    );
+                    ypos += ypadding;
+                }
+            }
         }
 
         // show fps
@@ -454,47 +613,47 @@ void draw_player() {
 }
 
 void draw_enemies() {
-    {
-        // Draw culling for enemies
-        state->num_query_points = 0;
-        qtree_query(
-            state->enemy_qtree, 
-            state->enemy_qtree->boundary,
-            state->query_points,
-            &state->num_query_points
-        );
+    // Draw culling for enemies
+    state->temp.num_enemies_drawn = 0;
+    index_stats_begin(SITE_DRAW);
+    index_visit(
+        state->enemy_index, 
+        get_visible_rect(state->player_pos, state->camera.zoom),
+        visit_draw_enemy, NULL
+    );
+    index_stats_end();
+}
 
-        state->temp.num_enemies_drawn = state->num_query_points;
-        for (int i = 0; i < state->num_query_points; i++) {
-            QPoint pt = state->query_points[i];
-            Enemy *enemy = &state->enemies[pt.id];
-            Vec2 loc = get_enemy_sprite_pos(enemy->type, enemy->is_shiny);
-            bool is_flip_x = enemy->pos.x < state->player_pos.x;
-
-            Color flash = WHITE;
-            if (enemy->is_frozen) {
-                flash = COLOR_FLASH_FROST;
-            }
-            if (enemy->is_taking_damage) {
-                flash = COLOR_FLASH_HURT;
-            }
-
-            draw_spritev(
-                &state->sprite_sheet,
-                (Vec2) { loc.x, loc.y },
-                enemy->pos,
-                get_enemy_scale(enemy->type),
-                0,
-                is_flip_x,
-                true,
-                flash,
-                pt.id
-            );
+bool visit_draw_enemy(QPoint pt, void *ctx) {
+    state->temp.num_enemies_drawn += 1;
+    EnemyType type = state->enemies.types[pt.id];
+    Vec2 pos = enemy_pos(pt.id);
+    Vec2 loc = get_enemy_sprite_pos(type, enemy_has(pt.id, ENEMY_SHINY));
+    bool is_flip_x = pos.x < state->player_pos.x;
 
-            // this chokes when you draw for too many enemies
-            // draw_health_bar(enemy->pos, enemy->health, get_enemy_health(enemy->type, enemy->is_shiny));
-        }
+    Color flash = WHITE;
+    if (enemy_has(pt.id, ENEMY_FROZEN)) {
+        flash = COLOR_FLASH_FROST;
+    }
+    if (enemy_has(pt.id, ENEMY_DAMAGED)) {
+        flash = COLOR_FLASH_HURT;
     }
+
+    draw_spritev(
+        &state->sprite_sheet,
+        (Vec2) { loc.x, loc.y },
+        pos,
+        get_enemy_scale(type),
+        0,
+        is_flip_x,
+        true,
+        flash,
+        pt.id
+    );
+
+    // this chokes when you draw for too many enemies
+    // draw_health_bar(pos, state->enemies.healths[pt.id], get_enemy_health(type, enemy_has(pt.id, ENEMY_SHINY)));
+    return true;
 }
 
 void draw_particles() {
@@ -530,6 +689,13 @@ void draw_particles() {
 }
 
 void draw_bullets() {
+    // Laser beam
+    bool is_laser_visible = get_current_time_millis() - state->timer.laser_ts < LASER_LIFETIME_MILLIS;
+    if (state->upgrades.laser_level > 0 && is_laser_visible) {
+        DrawLineEx(state->laser_start, state->laser_end, LASER_WIDTH, COLOR_RED);
+        DrawLineEx(state->laser_start, state->laser_end, LASER_WIDTH / 2, COLOR_WHITE);
+    }
+
     // Player bullets
     for (int i = 0; i < state->bullet_count; i++) {
         float angle = atan2f(
@@ -579,32 +745,33 @@ void draw_decorations() {
 }
 
 void draw_pickups() {
-    state->num_query_points = 0;
-    qtree_query(
-        state->pickups_qtree,
+    index_stats_begin(SITE_PICKUPS);
+    static_grid_visit(
+        state->pickups_grid,
         // this will cull the off screen pickups
-        state->enemy_qtree->boundary,
-        state->query_points,
-        &state->num_query_points
+        get_visible_rect(state->player_pos, state->camera.zoom),
+        visit_draw_pickup, NULL
     );
+    index_stats_end();
+}
 
-    for (int i = 0; i < state->num_query_points; i++) {
-        QPoint pt = state->query_points[i];
-        Vec2 sprite_pos = { 1, 9 };
-        float sprite_scale = 0.4;
-        if (state->pickups[pt.id].type == MANA_SHINY) {
-            sprite_pos = (Vec2) { 2, 9 };
-        }
-        if (state->pickups[pt.id].type == HEALTH) {
-            sprite_pos = (Vec2) { 5, 9 };
-            sprite_scale = 0.5;
-        }
-
-        draw_sprite(
-            &state->sprite_sheet, sprite_pos,
-            (Vec2) { pt.x, pt.y }, sprite_scale, 0, WHITE
-        );
+bool visit_draw_pickup(QPoint pt, void *ctx) {
+    Vec2 sprite_pos = { 1, 9 };
+    float sprite_scale = 0.4;
+    Pickup *pickup = pickup_at_slot(pt.id);
+    if (pickup->type == MANA_SHINY) {
+        sprite_pos = (Vec2) { 2, 9 };
+    }
+    if (pickup->type == HEALTH) {
+        sprite_pos = (Vec2) { 5, 9 };
+        sprite_scale = 0.5;
     }
+
+    draw_sprite(
+        &state->sprite_sheet, sprite_pos,
+        (Vec2) { pt.x, pt.y }, sprite_scale, 0, WHITE
+    );
+    return true;
 }
 
 // :toast
@@ -796,6 +963,7 @@ void draw_main_menu() {
         if (is_play || IsKeyPressed(KEY_ENTER)) {
             state->screen = IN_GAME;
             state->timer.game_start_ts = get_current_time_millis();
+            state->timer.enemy_clock_ts = get_current_time_millis() - ENEMY_CLOCK_KEEP_MS;
             post_analytics_async(GAME_START);
         }
     }
@@ -1070,6 +1238,7 @@ void draw_upgrade_menu() {
         draw_upgrade_option(FLAME_UPGRADE, level->flame_level, &pos);
         draw_upgrade_option(FROST_UPGRADE, level->frost_wave_level, &pos);
         draw_upgrade_option(ORBS_UPGRADE, level->orbs_level, &pos);
+        draw_upgrade_option(LASER_UPGRADE, level->laser_level, &pos);
         draw_upgrade_option(SPEED_UPGRADE, level->speed_level, &pos);
         draw_upgrade_option(SHINY_UPGRADE, level->shiny_level, &pos);
     }
@@ -1102,6 +1271,9 @@ void draw_upgrade_option(UpgradeType type, int level, Vec2 *pos) {
         case ORBS_UPGRADE:
             label = "Orbs";
             break;
+        case LASER_UPGRADE:
+            label = "Laser";
+            break;
         case SPEED_UPGRADE:
             label = "Player Speed";
             break;
@@ -1160,12 +1332,14 @@ void update_game() {
     if (state->screen != IN_GAME) {
         return;
     }
+    index_stats_next_frame();
 
     handle_player_input();
     handle_virtual_joystick_input();
 
     update_bullets();
     update_enemies();
+    update_collisions();
     update_particles();
     update_player();
     update_pickups();
@@ -1203,50 +1377,6 @@ void update_player() {
     // Camera follow
     state->camera.target = (Vec2) { state->player_pos.x, state->player_pos.y };
 
-    // Player hurt
-    // :hurt
-    {
-        state->num_query_points = 0;
-        qtree_query(
-            state->enemy_qtree,
-            (QRect) {
-                state->player_pos.x,
-                state->player_pos.y,
-                10, 10
-            },
-            state->query_points,
-            &state->num_query_points
-        );
-        for (int i = 0; i < state->num_query_points; i++) {
-            QPoint pt = state->query_points[i];
-            float damage = get_enemy_damage(state->enemies[pt.id].type);
-            if (Vector2DistanceSqr(state->player_pos, state->enemies[pt.id].pos) <= 50) {
-                state->player_health -= damage;
-                if (get_current_time_millis() - state->timer.last_hurt_sound_ts > 400) {
-                    play_sound_modulated(&state->sound_hurt, 0.5);
-                    state->timer.last_hurt_sound_ts = get_current_time_millis();
-                }
-            }
-        }
-    }
-
-    // Player enemy bullet collisions
-    {
-        for (int i = 0; i < state->enemy_bullet_count; i++) {
-            Bullet *b = &state->enemy_bullets[i];
-            float dist = Vector2DistanceSqr(state->player_pos, b->pos);
-            if (dist < 50) {
-                state->player_health -= b->strength;
-                b->penetration = 0;
-                b->strength = 0;
-                if (get_current_time_millis() - state->timer.last_hurt_sound_ts > 400) {
-                    play_sound_modulated(&state->sound_hurt, 0.5);
-                    state->timer.last_hurt_sound_ts = get_current_time_millis();
-                }
-            }
-        }
-    }
-
     // Slow auto-heal
     {
         if (state->player_health < MAX_PLAYER_HEALTH) {
@@ -1257,47 +1387,80 @@ void update_player() {
     }
 }
 
+bool visit_player_hurt(QPoint pt, void *ctx) {
+    float damage = get_enemy_damage(state->enemies.types[pt.id]);
+    if (Vector2DistanceSqr(state->player_pos, enemy_pos(pt.id)) <= 50) {
+        state->player_health -= damage;
+        if (get_current_time_millis() - state->timer.last_hurt_sound_ts > 400) {
+            play_sound_modulated(&state->sound_hurt, 0.5);
+            state->timer.last_hurt_sound_ts = get_current_time_millis();
+        }
+    }
+    return true;
+}
+
 // :enemy
 void update_enemies() {
     int ww = get_window_width();
     int wh = get_window_height();
 
     Vec2 player_pos = state->player_pos;
-    Bullet *bullets = state->bullets;
-    Enemy *enemies = state->enemies;
-    int bullet_count = state->bullet_count;
+    EnemyArrays *enemies = &state->enemies;
     int *enemy_count = &state->enemy_count;
 
+    // the timestamps are 16 bit, keep the clock short of wrapping
+    enemy_clock_rebase();
+
     // :reset
-    // Reset the Quadtree
+    // Re-center the enemy index
+    {
+        // Enemies are moved in the index as they move, it's only rebuilt
+        // once the player wanders too far from the center of its boundary
+        // or when the tuner changed the index's leaf capacity / cell size
+        // The ones outside the boundary still get indexed, in the coarser far tier
+        bool is_retuned = index_tuner_update(&state->enemy_index_tuner, state->enemy_index, *enemy_count);
+        QRect boundary = state->enemy_index->boundary;
+        bool is_recenter = is_retuned || fabsf(player_pos.x - boundary.x) > ENEMY_INDEX_MARGIN ||
+            fabsf(player_pos.y - boundary.y) > ENEMY_INDEX_MARGIN;
+        if (is_recenter) {
+            QRect rect = get_visible_rect(player_pos, state->camera.zoom);
+            rect.w += ENEMY_INDEX_MARGIN;
+            rect.h += ENEMY_INDEX_MARGIN;
+            index_stats_begin(SITE_REBUILD);
+            index_stats_count(1, 0, 0);
+            index_reset_boundary(state->enemy_index, rect);
+
+            // the index was made with room for MAX_ENEMIES points
+            QPoint *points = state->enemy_index->build_points;
+            for (int i = 0; i < *enemy_count; i++) {
+                points[i] = (QPoint) { enemies->xs[i], enemies->ys[i], i };
+            }
+            index_build(state->enemy_index, points, *enemy_count, state->jobs);
+            index_stats_end();
+        }
+    }
+
+    // Cleanup dead enemies
     {
         int now = get_current_time_millis();
         if (now - state->timer.qtree_update_ts > QTREE_UPDATE_INTERVAL_MILLIS) {
             state->timer.qtree_update_ts = now;
-            qtree_reset_boundary(
-                state->enemy_qtree, 
-                get_visible_rect(state->player_pos, state->camera.zoom)
-            );
-            qtree_clear(state->enemy_qtree);
 
             /**
-             * Cleanup dead enemies
-             * 
-             * Dead enemies should only be cleaned up during qtree reset,
-             * This is so that the unordered enemy array shifting while deleting them
-             * doesn't cause the ids in the qtree to be invalid 
+             * Enemy ids in the index are array slots,
+             * so the enemy swapped into a deleted slot is re-keyed in the index too
              */
             for (int i = 0; i < *enemy_count; i++) {
                 // :mana :health :heart
-                bool should_drop_mana = (GetRandomValue(0, 100) > 50) || enemies[i].is_shiny;
+                bool should_drop_mana = (GetRandomValue(0, 100) > 50) || enemy_has(i, ENEMY_SHINY);
                 bool is_kill_enemy = true;
 
-                if (enemies[i].health > 0) {
+                if (enemies->healths[i] > 0) {
                     is_kill_enemy = false;
-                    int lifetime = get_current_time_millis() - enemies[i].spawn_ts;
+                    int lifetime = enemy_clock() - enemies->spawn_ts[i];
                     // if the enemy is far away cull it
                     if (lifetime > 10 * 1000) {
-                        int dist = Vector2DistanceSqr(enemies[i].pos, state->player_pos);
+                        int dist = Vector2DistanceSqr(enemy_pos(i), state->player_pos);
                         if (dist > 200 * 200) {
                             should_drop_mana = false;
                             is_kill_enemy = true;
@@ -1307,83 +1470,43 @@ void update_enemies() {
 
                 if (is_kill_enemy && should_drop_mana) {
                     // valid kill, leave mana behind
-                    if (state->pickups_count < MAX_PICKUPS) {
-                        state->pickups[state->pickups_count] = (Pickup) {
-                            .pos = (Vec2) { enemies[i].pos.x, enemies[i].pos.y },
-                            .type = get_pickup_spawn_type(enemies[i].is_shiny),
-                            .spawn_ts = get_current_time_millis(),
-                            .is_collected = false
-                        };
-
-                        qtree_insert(state->pickups_qtree, (QPoint) {
-                            .x = enemies[i].pos.x,
-                            .y = enemies[i].pos.y,
-                            .id = state->pickups_count
-                        });
-                        state->pickups_count ++;
-                    }
+                    // dropped when the floor is already full
+                    pickup_add((Pickup) {
+                        .pos = enemy_pos(i),
+                        .type = get_pickup_spawn_type(enemy_has(i, ENEMY_SHINY)),
+                        .spawn_ts = get_current_time_millis()
+                    });
                 }
 
                 if (is_kill_enemy) {
-                    enemies[i] = enemies[*enemy_count - 1];
-                    *enemy_count -= 1;
+                    int last = *enemy_count - 1;
+                    index_remove_id(state->enemy_index, i);
+                    if (i != last) {
+                        index_remove_id(state->enemy_index, last);
+                    }
+                    enemy_remove(i);
+                    if (i != last) {
+                        index_update(state->enemy_index, (QPoint) { enemies->xs[i], enemies->ys[i], i });
+                    }
                 }
             }
-
-            for (int i = 0; i < *enemy_count; i++) {
-                qtree_insert(state->enemy_qtree, (QPoint) {
-                    state->enemies[i].pos.x,
-                    state->enemies[i].pos.y,
-                    i
-                });
-            }
+            index_stats_begin(SITE_REBUILD);
+            index_sync(state->enemy_index);
+            index_stats_end();
         }
     }
 
-    // Bullet collision
-    // :collision
-    for (int i = 0; i < bullet_count; i++) {
-        if (bullets[i].strength <= 0 || bullets[i].penetration <= 0) {
-            continue;
-        }
-        int bullet_size = 5;
-
-        if (bullets[i].type == ORBS) {
-            bullet_size = state->stats.orbs_size;
-        }
-
-        state->num_query_points = 0;
-        qtree_query(
-            state->enemy_qtree,
-            (QRect) {
-                bullets[i].pos.x - 2.5f,
-                bullets[i].pos.y - 2.5f,
-                bullet_size, bullet_size
-            },
-            state->query_points,
-            &state->num_query_points
-        );
-
-        for (int j = 0; j < state->num_query_points; j++) {
-            QPoint pt = state->query_points[j];
-            float damage = fmin(bullets[i].strength, enemies[pt.id].health);
-            if (enemies[pt.id].health <= 0) {
-                continue;
-            }
-
-            enemies[pt.id].health -= damage;
-            enemies[pt.id].is_taking_damage = true;
-            enemies[pt.id].damage_ts = get_current_time_millis();
-            // bullets[i].strength -= damage;
-            bullets[i].penetration -= 1;
-
-            // idk how else to do this in a better way
-            if (enemies[pt.id].health <= 0) {
-                state->kill_count += 1;
-            }
-
-            // let one bullet hurt only one enemy
-            if (bullets[i].penetration <= 0) break;
+    // :neighbours
+    // Enemies around the player for hurt, targeting, flame and frost, the ids
+    // stay put until the next cleanup above
+    {
+        float radius = get_player_neighbours_radius();
+        if (radius > 0) {
+            index_stats_begin(SITE_NEIGHBOURS);
+            neighbours_gather(&state->player_neighbours, state->enemy_index, player_pos, radius);
+            index_stats_end();
+        } else {
+            state->player_neighbours.is_valid = false;
         }
     }
 
@@ -1393,362 +1516,170 @@ void update_enemies() {
         // Flame area damage
         if (get_current_time_millis() - state->timer.flame_ts < state->stats.flame_lifetime) {
             Vec2 flame_dir = state->player_heading_dir;
-            // range buffer to account for tringle and cone differences
+            // range buffer so the particles at the tip still burn
             float flame_range = (state->stats.flame_distance * (PARTICLE_LIFETIME / 1000.0f)) + 10;
-            Vec2 flame_dest = point_at_dist(state->player_pos, state->player_heading_dir, flame_range);
-
-            // flame triangle
-            Vec2 left_bound = Vector2Add(
-                player_pos, 
-                Vector2Scale(
-                    rotate_vector(flame_dir, -state->stats.flame_spread), 
-                    flame_range
-                )
-            );
-            Vec2 right_bound = Vector2Add(
-                player_pos, 
-                Vector2Scale(rotate_vector(flame_dir, state->stats.flame_spread), flame_range)
-            );
-
-            // query rect
-            Vec2 rect_center = get_line_center(flame_dest, state->player_pos);
-            // 20 buffer
-            float dist = Vector2Distance(flame_dest, state->player_pos) + 20;
-            QRect rect = { rect_center.x, rect_center.y, dist/2, dist/2 };
-
-            state->num_query_points = 0;
-            qtree_query(
-                state->enemy_qtree, rect,
-                state->query_points, &state->num_query_points
-            );
-
-            for (int i = 0; i < state->num_query_points; i++) {
-                QPoint pt = state->query_points[i];
-                if (enemies[pt.id].health <= 0) {
-                    continue;
-                }
 
-                // this is a cone approximation
-                // there's 2 triangles, as the spread angle grows, 
-                // we need the 2nd minor triangle to handle the other section of the cone
-                bool is_in_major_triangle = is_point_in_triangle(
-                    enemies[pt.id].pos, state->player_pos, left_bound, right_bound);
-                bool is_in_minor_triangle = is_point_in_triangle(
-                    enemies[pt.id].pos, flame_dest, left_bound, right_bound);
-
-                if (is_in_major_triangle || is_in_minor_triangle) {
-                    enemies[pt.id].health -= state->stats.flame_damage;
-                    enemies[pt.id].is_taking_damage = true;
-                    enemies[pt.id].damage_ts = get_current_time_millis();
-                    if (enemies[pt.id].health <= 0) {
-                        state->kill_count += 1;
-                    }
-                }
-            }
+            QShape cone = shape_cone(player_pos, flame_dir, flame_range, state->stats.flame_spread);
+            index_stats_begin(SITE_FLAME);
+            neighbours_visit_shape(&state->player_neighbours, state->enemy_index, &cone, visit_flame_hit, NULL);
+            index_stats_end();
         }
 
         // Frost area slowdown
         {
             if (get_current_time_millis() - state->timer.frost_wave_ts < state->stats.frost_wave_lifetime) {
                 float dist = 100;
-                QRect rect = { player_pos.x, player_pos.y, dist/2, dist/2 };
-                state->num_query_points = 0;
-                qtree_query(
-                    state->enemy_qtree, rect,
-                    state->query_points, &state->num_query_points
-                );
-
-                for (int i = 0; i < state->num_query_points; i++) {
-                    QPoint pt = state->query_points[i];
-                    bool can_frost = !enemies[pt.id].is_frozen;
-                    if (can_frost) {
-                        float cur_dist = Vector2DistanceSqr(enemies[pt.id].pos, state->player_pos);
-                        if (cur_dist <= dist/2 * dist/2) {
-                            enemies[pt.id].is_frozen = true;
-                            enemies[pt.id].speed /= 2.0f;
-                            enemies[pt.id].health -= state->stats.frost_wave_damage;
-                            enemies[pt.id].frozen_ts = get_current_time_millis();
-                        }
-                    }
-                }
+                QShape circle = shape_circle(player_pos, dist/2);
+                index_stats_begin(SITE_FROST);
+                neighbours_visit_shape(&state->player_neighbours, state->enemy_index, &circle, visit_frost_hit, NULL);
+                index_stats_end();
             }
         }
     }
 
     // Enemies update
+    // Separation, behaviour and movement each run as a batch of tasks on the job pool. Tasks are
+    // fixed size runs of enemies and anything shared goes through the main thread in task order,
+    // so a frame comes out the same on any number of threads. That needs the index tuner off
+    // (--no-tune), its picks change the order queries find enemies in and so the float sums
     {
-        for (int i = 0; i < *enemy_count; i++) {
-            Vec2 player_dir = Vector2Subtract(player_pos, enemies[i].pos);
-            player_dir = Vector2Normalize(player_dir);
-            
-            if (enemies[i].health <= 0) {
-                continue;
+        EnemyPass pass = {
+            .player_pos = player_pos,
+            .now = enemy_clock(),
+            .dt = GetFrameTime(),
+            .has_bullet_room = state->enemy_bullet_count < MAX_ENEMY_BULLETS,
+            .has_enemy_room = *enemy_count < MAX_ENEMIES,
+            .num_enemies = *enemy_count,
+            .perception_radius = 10.0f,
+            .sep_ids = enemies->sep_ids,
+            .num_sep = 0
+        };
+
+        // :seperation :separation :boid
+        // Worked out for everyone up front, against where the enemies were at the start of the frame
+        {
+            // adjust how often we want to do separation
+            int separation_threshold = 10;
+            if (state->enemy_count < 100) {
+                separation_threshold = 50;
+            } else if (state->enemy_count < 200) {
+                separation_threshold = 70;
+            } else if (state->enemy_count < 500) {
+                separation_threshold = 90;
+            } else {
+                separation_threshold = 99;
             }
 
-            // :seperation :separation :boid
-            Vec2 separation = Vector2Zero();
-            {
-                float perception_radius = 10.0f;
-                
-                // adjust how often we want to do separation
-                int separation_threshold = 10;
-                if (state->enemy_count < 100) {
-                    separation_threshold = 50;
-                } else if (state->enemy_count < 200) {
-                    separation_threshold = 70;
-                } else if (state->enemy_count < 500) {
-                    separation_threshold = 90;
-                } else {
-                    separation_threshold = 99;
-                }
+            // TODO do i not do separation at some point?
+            // maybe when the fps drops too low?
+            // this may result in the qtree crashing due to many items in a single tile
+            // if (state->enemy_count > 5000) {
+            //     // don't do any separation
+            //     separation_threshold = 101;
+            // }
 
-                // TODO do i not do separation at some point?
-                // maybe when the fps drops too low?
-                // this may result in the qtree crashing due to many items in a single tile
-                // if (state->enemy_count > 5000) {
-                //     // don't do any separation
-                //     separation_threshold = 101;
-                // }
+            for (int i = 0; i < *enemy_count; i++) {
+                enemies->sep_xs[i] = 0;
+                enemies->sep_ys[i] = 0;
+                if (enemies->healths[i] <= 0) {
+                    continue;
+                }
 
-                // separation is applied randomly
+                // separation is applied randomly, rolled here so the draws stay in order
                 if (GetRandomValue(0, 100) > separation_threshold) {
-                    state->num_query_points = 0;
-                    qtree_query(
-                        state->enemy_qtree,
-                        (QRect) {
-                            enemies[i].pos.x,
-                            enemies[i].pos.y,
-                            perception_radius * 2,
-                            perception_radius * 2
-                        },
-                        state->query_points,
-                        &state->num_query_points
-                    );
-
-                    for (int j = 0; j < state->num_query_points; j++) {
-                        QPoint pt = state->query_points[j];
-                        if (pt.id != i) {
-                            Vec2 neighbor = Vector2Subtract(enemies[pt.id].pos, enemies[i].pos);
-                            float dist = Vector2Length(neighbor);
-                            
-                            if (dist < perception_radius && dist > 0) {
-                                // repulsion force, stronger at closer distances
-                                float repulsion_strength = (1.0f - (dist / perception_radius)) * 0.5f;
-                                Vec2 repulsion = Vector2Normalize(neighbor);
-                                repulsion = Vector2Scale(repulsion, -repulsion_strength * ENEMY_SPEED);
-                                separation = Vector2Add(separation, repulsion);
-                            }
-                        }
-                    }
+                    pass.sep_ids[pass.num_sep++] = i;
                 }
             }
 
-            // Enemy pos update
-            // :behaviour
-
-            // Unique enemy updates
-            switch (enemies[i].type) {
-
-                /**
-                 * Default enemy behaviour is in the defualt case
-                 * Jump to the defualt case for all enemies
-                 */
-
-                case RAM:
-                    {
-                        // Gets close to the player and pauses
-                        // Then charges with a lot of speed for sometime
-
-                        float dist_to_player = Vector2DistanceSqr(state->player_pos, enemies[i].pos);
-                        if (dist_to_player > 50 * 50) {
-                            enemies[i].is_player_found = false;
-                            enemies[i].player_found_ts = 0;
-                        } else if (!enemies[i].is_player_found) {
-                            enemies[i].is_player_found = true;
-                            enemies[i].player_found_ts = get_current_time_millis();
-                        }
+            int num_tasks = (pass.num_sep + ENEMY_BEHAVIOUR_TASK_SIZE - 1) / ENEMY_BEHAVIOUR_TASK_SIZE;
+            index_stats_begin(SITE_SEPARATION);
+            index_stats.is_paused = true;
+            jobs_run(state->jobs, _enemies_separation_task, &pass, num_tasks);
+            index_stats.is_paused = false;
+            index_stats_count(pass.num_sep, 0, 0);
+            index_stats_end();
+        }
 
-                        if (enemies[i].is_player_found) {
-                            int time_elapsed = get_current_time_millis() - enemies[i].player_found_ts;
-                            if (time_elapsed < 500) {
-                                // wait for some time
-                                enemies[i].charge_dir = player_dir;
-                                break;
-                            } else if (time_elapsed < 1500) {
-                                // charge in last player dir for some time
-                                Vec2 velocity = Vector2Scale(enemies[i].charge_dir, enemies[i].speed * 2.5f);
-                                velocity = Vector2Add(velocity, separation);
-                                velocity = Vector2Scale(velocity, GetFrameTime());
-                                enemies[i].pos = Vector2Add(enemies[i].pos, velocity);
-                                break;
-                            } else {
-                                // reset
-                                enemies[i].is_player_found = false;
-                                enemies[i].player_found_ts = 0;
-                            }
-                        }
-                        goto default_behaviour;
+        // Enemy pos update
+        // :behaviour
+        // One pass per type with a behaviour of its own, everyone else only chases
+        {
+            int num_tasks = 0;
+            int num_bullets = 0;
+            int num_pups = 0;
+            for (int t = 0; t < NUM_COLD_TABLES; t++) {
+                pass.first_task[t] = num_tasks;
+                num_tasks += (enemies->cold[t].count + ENEMY_BEHAVIOUR_TASK_SIZE - 1) / ENEMY_BEHAVIOUR_TASK_SIZE;
+                num_bullets += enemies->cold[t].count * get_enemy_max_bullets(t);
+                num_pups += enemies->cold[t].count * get_enemy_max_pups(t);
+            }
+            pass.first_task[NUM_COLD_TABLES] = num_tasks;
+
+            // without the task buffers they keep doing what they did last frame
+            if (_enemies_reserve_tasks(enemies, num_tasks, num_bullets, num_pups)) {
+                pass.tasks = enemies->tasks;
+                // hand each task its run of the spawn buffers, in task order
+                int bullet = 0;
+                int pup = 0;
+                for (int t = 0; t < NUM_COLD_TABLES; t++) {
+                    for (int task = pass.first_task[t]; task < pass.first_task[t + 1]; task++) {
+                        int num_enemies = enemies->cold[t].count - (task - pass.first_task[t]) * ENEMY_BEHAVIOUR_TASK_SIZE;
+                        if (num_enemies > ENEMY_BEHAVIOUR_TASK_SIZE) num_enemies = ENEMY_BEHAVIOUR_TASK_SIZE;
+                        pass.tasks[task] = (EnemyTask) {
+                            .bullets = enemies->task_bullets + bullet,
+                            .num_bullets = 0,
+                            .pups = enemies->task_pups + pup,
+                            .num_pups = 0,
+                            .rng = GetRandomValue(1, 1 << 30)
+                        };
+                        bullet += num_enemies * get_enemy_max_bullets(t);
+                        pup += num_enemies * get_enemy_max_pups(t);
                     }
-                case MAGE:
-                    {
-                        // Gets close to the player
-                        // Then shoots bullets until the player is in vision
-
-                        float dist_to_player = Vector2DistanceSqr(state->player_pos, enemies[i].pos);
-                        if (dist_to_player > 75 * 75) {
-                            enemies[i].is_player_found = false;
-                            enemies[i].player_found_ts = 0;
-                        } else if (!enemies[i].is_player_found) {
-                            enemies[i].is_player_found = true;
-                            enemies[i].player_found_ts = get_current_time_millis();
-                        }
+                }
 
-                        if (enemies[i].is_player_found) {
-                            int time_elapsed = get_current_time_millis() - enemies[i].player_found_ts;
-                            if (time_elapsed > 1000 && state->enemy_bullet_count < MAX_ENEMY_BULLETS) {
-                                // fire a bullet
-                                state->enemy_bullets[state->enemy_bullet_count] = (Bullet) {
-                                    .pos = enemies[i].pos,
-                                    .direction = player_dir,
-                                    .spawnTs = get_current_time_millis(),
-                                    .strength = 10,
-                                    .penetration = 1,
-                                    .type = MAGE_BULLET,
-                                    .speed = get_attack_speed(MAGE_BULLET),
-                                    .angle = 0
-                                };
-                                state->enemy_bullet_count += 1;
-
-                                // reset time acts as a bullet interval
-                                enemies[i].player_found_ts = get_current_time_millis();
-                            }
-
-                            // don't approach the player once found
-                            break;
-                        }
-                        goto default_behaviour;
+                index_stats_begin(SITE_BEHAVIOUR);
+                jobs_run(state->jobs, _enemies_behaviour_task, &pass, num_tasks);
+                index_stats_end();
+
+                for (int t = 0; t < num_tasks; t++) {
+                    EnemyTask *task = &pass.tasks[t];
+                    for (int b = 0; b < task->num_bullets && state->enemy_bullet_count < MAX_ENEMY_BULLETS; b++) {
+                        state->enemy_bullets[state->enemy_bullet_count] = task->bullets[b];
+                        state->enemy_bullet_count += 1;
                     }
-                case DEMON:
-                    {
-                        // Gets close to the player
-                        // Spawns pup enemies and spawns many bullets
-
-                        float dist_to_player = Vector2DistanceSqr(state->player_pos, enemies[i].pos);
-                        if (dist_to_player > 90 * 90) {
-                            enemies[i].is_player_found = false;
-                            enemies[i].player_found_ts = 0;
-                        } else if (!enemies[i].is_player_found) {
-                            enemies[i].is_player_found = true;
-                            enemies[i].player_found_ts = get_current_time_millis();
-                        }
 
-                        if (enemies[i].is_player_found) {
-                            int time_elapsed = get_current_time_millis() - enemies[i].player_found_ts;
-                            if (time_elapsed > 2000) {
-
-                                // fire bullets
-                                int num_bullets = 5;
-                                float spread_angle = 60.0f;
-                                float half_angle = spread_angle / 2.0f;
-                                float angle_increment = spread_angle / (num_bullets - 1);
-
-                                for (int j = 0; j < num_bullets; j++) {
-                                    float angle = -half_angle + j * angle_increment;
-                                    Vec2 bullet_dir = rotate_vector(player_dir, angle);
-
-                                    if (state->enemy_bullet_count > MAX_ENEMY_BULLETS) break;
-
-                                    state->enemy_bullets[state->enemy_bullet_count] = (Bullet) {
-                                        .pos = enemies[i].pos,
-                                        .direction = bullet_dir,
-                                        .spawnTs = get_current_time_millis(),
-                                        .strength = 10,
-                                        .penetration = 1,
-                                        .type = DEMON_BULLET,
-                                        .speed = get_attack_speed(DEMON_BULLET),
-                                        .angle = 0
-                                    };
-                                    state->enemy_bullet_count += 1;
-                                }
-
-                                // reset time acts as a bullet interval
-                                enemies[i].player_found_ts = get_current_time_millis();
-                            }
-
-                            // don't approach the player once found
+                    for (int p = 0; p < task->num_pups; p++) {
+                        int pup = enemy_add(task->pups[p]);
+                        if (pup < 0)
                             break;
-                        }
-
-                        // Spawn pups
-                        // :pups
-                        {
-                            int num_pups_to_spawn = 5;
-                            int time_elapsed = (get_current_time_millis() - enemies[i].last_spawn_ts);
-                            float spawn_distance = 20.0f;
-                            bool can_spawn = GetRandomValue(0, 100) > 90 && state->enemy_count < MAX_ENEMIES;
-                            // bool can_spawn = state->enemy_count < MAX_ENEMIES;
-                            if (can_spawn && time_elapsed > 10000 && dist_to_player < 100 * 100) {
-                                enemies[i].last_spawn_ts = get_current_time_millis();
-                                for (int j = 0; j < num_pups_to_spawn; j++) {
-                                    float angle = (2.0f * PI / num_pups_to_spawn) * j;
-                                    Vector2 spawn_offset = (Vec2) {
-                                        .x = cosf(angle) * spawn_distance,
-                                        .y = sinf(angle) * spawn_distance
-                                    };
-
-                                    // Spawn the pup
-                                    enemies[*enemy_count] = (Enemy) {
-                                        .pos = (Vec2) {
-                                            .x = enemies[i].pos.x + spawn_offset.x,
-                                            .y = enemies[i].pos.y + spawn_offset.y
-                                        },
-                                        .health = get_enemy_health(DEMON_PUP, false),
-                                        .type = DEMON_PUP,
-                                        .speed = get_enemy_speed(DEMON_PUP),
-                                        .spawn_ts = get_current_time_millis(),
-                                        .is_shiny = false,
-                                        .is_player_found = false,
-                                        .player_found_ts = 0,
-                                        .charge_dir = Vector2Zero(),
-                                        .last_spawn_ts = 0,
-                                        .is_frozen = false,
-                                        .is_taking_damage = false,
-                                    };
-
-                                    *enemy_count += 1;
-                                }
-                            }
-                        }
-
-                        goto default_behaviour;
-                    }
-                default:
-                default_behaviour:
-                    {
-                        // default behaviour, approach player
-                        Vec2 velocity = Vector2Scale(player_dir, enemies[i].speed);
-                        velocity = Vector2Add(velocity, separation);
-                        velocity = Vector2Scale(velocity, GetFrameTime());
-                        enemies[i].pos = Vector2Add(enemies[i].pos, velocity);
-                        break;
+                        index_update(state->enemy_index, (QPoint) {
+                            enemies->xs[pup],
+                            enemies->ys[pup],
+                            pup
+                        });
+                        // chases right away, without a push this frame
+                        enemies->sep_xs[pup] = 0;
+                        enemies->sep_ys[pup] = 0;
                     }
-            }
-
-            // Extra stuff
-            if (enemies[i].is_frozen) {
-                if (get_current_time_millis() - enemies[i].frozen_ts > 2000) {
-                    enemies[i].is_frozen = false;
-                    enemies[i].frozen_ts = 0;
-                    enemies[i].speed = get_enemy_speed(enemies[i].type);
                 }
             }
+        }
 
-            if (enemies[i].is_taking_damage) {
-                if (get_current_time_millis() - enemies[i].damage_ts > 100) {
-                    enemies[i].is_taking_damage = false;
-                    enemies[i].damage_ts = 0;
-                }
+        // :chase
+        {
+            pass.num_enemies = *enemy_count;
+            int num_tasks = (pass.num_enemies + ENEMY_TASK_SIZE - 1) / ENEMY_TASK_SIZE;
+            index_stats_begin(SITE_CHASE);
+            jobs_run(state->jobs, _enemies_move_task, &pass, num_tasks);
+            index_stats_end();
+        }
+
+        // Keep the index in step with the movement, it's only updated from the main thread
+        for (int i = 0; i < *enemy_count; i++) {
+            if (enemies->healths[i] <= 0) {
+                continue;
             }
+            index_update(state->enemy_index, (QPoint) { enemies->xs[i], enemies->ys[i], i });
         }
     }
 
@@ -1769,7 +1700,7 @@ void update_enemies() {
                 int rand_enemy = get_next_enemy_spawn_type();
                 bool is_shiny = GetRandomValue(1, 100) > (100 - state->stats.shiny_chance);
                 state->timer.enemy_spawn_ts = get_current_time_millis();
-                enemies[*enemy_count] = (Enemy) {
+                int id = enemy_add((Enemy) {
                     .pos = randPos,
                     .health = get_enemy_health(rand_enemy, is_shiny),
                     .type = rand_enemy,
@@ -1782,79 +1713,459 @@ void update_enemies() {
                     .last_spawn_ts = 0,
                     .is_frozen = false,
                     .is_taking_damage = false
-                };
-
-                *enemy_count += 1;
+                });
+                index_update(state->enemy_index, (QPoint) { randPos.x, randPos.y, id });
             }
         }
     }
+
+    // grid backends only lay out the moves here
+    index_stats_begin(SITE_REBUILD);
+    index_sync(state->enemy_index);
+    index_stats_end();
 }
 
-// :particle
-void update_particles() {
-    Vec2 player_pos = state->player_pos;
+/**
+ * The behaviour passes, each takes the entries [start, end) of its type's side table.
+ * An enemy that moves itself or stands still this frame is held, the rest are left to enemies_chase.
+ * They run on the job pool, anything outside their own enemies goes into the task
+ */
 
-    // Mana pickup particles
-    {
-        int i = 0;
-        while (i < state->mana_particles_count) {
+// :ram
+// Gets close to the player and pauses, then charges with a lot of speed for some time
+void update_ram_enemies(EnemyPass *pass, int start, int end, EnemyTask *task) {
+    EnemyArrays *enemies = &state->enemies;
+    EnemyColds *rams = &enemies->cold[COLD_RAM];
+    Vec2 player_pos = pass->player_pos;
+    int now = pass->now;
+    float dt = pass->dt;
+
+    for (int c = start; c < end; c++) {
+        EnemyCold *cold = &rams->entries[c];
+        int i = cold->owner;
+        if (enemies->healths[i] <= 0) {
+            continue;
+        }
 
-            // reached player
-            float dist = Vector2DistanceSqr(player_pos, state->mana_particles[i]);
-            if (dist < 10) {
-                state->mana_particles[i] = state->mana_particles[state->mana_particles_count - 1];
-                state->mana_particles_count -= 1;
-                i++;
-                continue;
+        Vec2 pos = enemy_pos(i);
+        float dist_to_player = Vector2DistanceSqr(player_pos, pos);
+        if (dist_to_player > 50 * 50) {
+            enemy_set(i, ENEMY_PLAYER_FOUND, false);
+            cold->player_found_ts = 0;
+        } else if (!enemy_has(i, ENEMY_PLAYER_FOUND)) {
+            enemy_set(i, ENEMY_PLAYER_FOUND, true);
+            cold->player_found_ts = now;
+        }
+
+        bool is_hold = false;
+        if (enemy_has(i, ENEMY_PLAYER_FOUND)) {
+            int time_elapsed = now - cold->player_found_ts;
+            if (time_elapsed < 500) {
+                // wait for some time
+                cold->charge_dir = Vector2Normalize(Vector2Subtract(player_pos, pos));
+                is_hold = true;
+            } else if (time_elapsed < 1500) {
+                // charge in last player dir for some time
+                Vec2 separation = { enemies->sep_xs[i], enemies->sep_ys[i] };
+                Vec2 velocity = Vector2Scale(cold->charge_dir, enemies->speeds[i] * 2.5f);
+                velocity = Vector2Add(velocity, separation);
+                velocity = Vector2Scale(velocity, dt);
+                enemy_set_pos(i, Vector2Add(pos, velocity));
+                is_hold = true;
+            } else {
+                // reset
+                enemy_set(i, ENEMY_PLAYER_FOUND, false);
+                cold->player_found_ts = 0;
             }
+        }
+        enemy_set(i, ENEMY_HOLD, is_hold);
+    }
+}
 
-            // move towards player
-            Vec2 dir = Vector2Subtract(player_pos, state->mana_particles[i]);
-            dir = Vector2Normalize(dir);
-            state->mana_particles[i].x += dir.x * GetFrameTime() * 200;
-            state->mana_particles[i].y += dir.y * GetFrameTime() * 200;
+// :mage
+// Gets close to the player, then shoots bullets while the player is in range
+void update_mage_enemies(EnemyPass *pass, int start, int end, EnemyTask *task) {
+    EnemyArrays *enemies = &state->enemies;
+    EnemyColds *mages = &enemies->cold[COLD_MAGE];
+    Vec2 player_pos = pass->player_pos;
+    int now = pass->now;
+
+    for (int c = start; c < end; c++) {
+        EnemyCold *cold = &mages->entries[c];
+        int i = cold->owner;
+        if (enemies->healths[i] <= 0) {
+            continue;
+        }
 
-            i++;
+        Vec2 pos = enemy_pos(i);
+        float dist_to_player = Vector2DistanceSqr(player_pos, pos);
+        if (dist_to_player > 75 * 75) {
+            enemy_set(i, ENEMY_PLAYER_FOUND, false);
+            cold->player_found_ts = 0;
+        } else if (!enemy_has(i, ENEMY_PLAYER_FOUND)) {
+            enemy_set(i, ENEMY_PLAYER_FOUND, true);
+            cold->player_found_ts = now;
         }
-    }
 
-    // Flame particles
-    {
-        int i = 0;
-        while (i < state->flame_particles_count) {
-            Particle *p = &state->flame_particles[i];
+        // don't approach the player once found
+        bool is_hold = enemy_has(i, ENEMY_PLAYER_FOUND);
+        if (is_hold) {
+            int time_elapsed = now - cold->player_found_ts;
+            if (time_elapsed > 1000 && pass->has_bullet_room) {
+                // fire a bullet
+                task->bullets[task->num_bullets] = (Bullet) {
+                    .pos = pos,
+                    .direction = Vector2Normalize(Vector2Subtract(player_pos, pos)),
+                    .spawnTs = get_current_time_millis(),
+                    .strength = 10,
+                    .penetration = 1,
+                    .type = MAGE_BULLET,
+                    .speed = get_attack_speed(MAGE_BULLET),
+                    .angle = 0
+                };
+                task->num_bullets += 1;
 
-            int time_alive = get_current_time_millis() - p->spawn_ts;
-            if (time_alive > p->lifetime) {
-                state->flame_particles[i] = state->flame_particles[state->flame_particles_count - 1];
-                state->flame_particles_count -= 1;
-                i ++;
-                continue;
+                // reset time acts as a bullet interval
+                cold->player_found_ts = now;
             }
+        }
+        enemy_set(i, ENEMY_HOLD, is_hold);
+    }
+}
 
-            Vec2 dir = state->flame_particles[i].dir;
-            state->flame_particles[i].pos.x += dir.x * GetFrameTime() * state->stats.flame_distance;
-            state->flame_particles[i].pos.y += dir.y * GetFrameTime() * state->stats.flame_distance;
+// :demon
+// Gets close to the player, spawns pup enemies on the way and fires bullet spreads once close
+void update_demon_enemies(EnemyPass *pass, int start, int end, EnemyTask *task) {
+    EnemyArrays *enemies = &state->enemies;
+    EnemyColds *demons = &enemies->cold[COLD_DEMON];
+    Vec2 player_pos = pass->player_pos;
+    int now = pass->now;
+
+    for (int c = start; c < end; c++) {
+        EnemyCold *cold = &demons->entries[c];
+        int i = cold->owner;
+        if (enemies->healths[i] <= 0) {
+            continue;
+        }
 
-            i ++;
+        Vec2 pos = enemy_pos(i);
+        Vec2 player_dir = Vector2Normalize(Vector2Subtract(player_pos, pos));
+        float dist_to_player = Vector2DistanceSqr(player_pos, pos);
+        if (dist_to_player > 90 * 90) {
+            enemy_set(i, ENEMY_PLAYER_FOUND, false);
+            cold->player_found_ts = 0;
+        } else if (!enemy_has(i, ENEMY_PLAYER_FOUND)) {
+            enemy_set(i, ENEMY_PLAYER_FOUND, true);
+            cold->player_found_ts = now;
         }
-    }
 
-    // Frost wave particles
-    {
-        int i = 0;
-        while (i < state->frost_wave_particles_count) {
-            Particle *p = &state->frost_wave_particles[i];
+        // don't approach the player once found
+        bool is_hold = enemy_has(i, ENEMY_PLAYER_FOUND);
+        enemy_set(i, ENEMY_HOLD, is_hold);
+        if (is_hold) {
+            int time_elapsed = now - cold->player_found_ts;
+            if (time_elapsed > 2000) {
+                // fire bullets
+                int num_bullets = 5;
+                float spread_angle = 60.0f;
+                float half_angle = spread_angle / 2.0f;
+                float angle_increment = spread_angle / (num_bullets - 1);
+
+                for (int j = 0; j < num_bullets; j++) {
+                    float angle = -half_angle + j * angle_increment;
+                    Vec2 bullet_dir = rotate_vector(player_dir, angle);
+
+                    if (!pass->has_bullet_room) break;
+
+                    task->bullets[task->num_bullets] = (Bullet) {
+                        .pos = pos,
+                        .direction = bullet_dir,
+                        .spawnTs = get_current_time_millis(),
+                        .strength = 10,
+                        .penetration = 1,
+                        .type = DEMON_BULLET,
+                        .speed = get_attack_speed(DEMON_BULLET),
+                        .angle = 0
+                    };
+                    task->num_bullets += 1;
+                }
 
-            int time_alive = get_current_time_millis() - p->spawn_ts;
-            if (time_alive > p->lifetime) {
-                state->frost_wave_particles[i] = state->frost_wave_particles[state->frost_wave_particles_count - 1];
-                state->frost_wave_particles_count -= 1;
-                i ++;
-                continue;
+                // reset time acts as a bullet interval
+                cold->player_found_ts = now;
             }
+            continue;
+        }
 
-            Vec2 dir = state->frost_wave_particles[i].dir;
+        // Spawn pups
+        // :pups
+        int num_pups_to_spawn = 5;
+        int time_elapsed = now - cold->last_spawn_ts;
+        float spawn_distance = 20.0f;
+        bool can_spawn = _enemy_task_random(task, 0, 100) > 90 && pass->has_enemy_room;
+        // bool can_spawn = state->enemy_count < MAX_ENEMIES;
+        if (can_spawn && time_elapsed > 10000 && dist_to_player < 100 * 100) {
+            cold->last_spawn_ts = now;
+            for (int j = 0; j < num_pups_to_spawn; j++) {
+                float angle = (2.0f * PI / num_pups_to_spawn) * j;
+                Vector2 spawn_offset = (Vec2) {
+                    .x = cosf(angle) * spawn_distance,
+                    .y = sinf(angle) * spawn_distance
+                };
+
+                // Spawn the pup, added once the batch is done
+                task->pups[task->num_pups] = (Enemy) {
+                    .pos = (Vec2) {
+                        .x = pos.x + spawn_offset.x,
+                        .y = pos.y + spawn_offset.y
+                    },
+                    .health = get_enemy_health(DEMON_PUP, false),
+                    .type = DEMON_PUP,
+                    .speed = get_enemy_speed(DEMON_PUP),
+                    .spawn_ts = get_current_time_millis(),
+                    .is_shiny = false,
+                    .is_player_found = false,
+                    .player_found_ts = 0,
+                    .charge_dir = Vector2Zero(),
+                    .last_spawn_ts = 0,
+                    .is_frozen = false,
+                    .is_taking_damage = false,
+                };
+                task->num_pups += 1;
+            }
+        }
+    }
+}
+
+// xorshift, a task can't share raylib's generator with the other threads
+int _enemy_task_random(EnemyTask *task, int min, int max) {
+    unsigned int x = task->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    task->rng = x;
+    return min + (int) (x % (unsigned int) (max - min + 1));
+}
+
+void _enemies_separation_task(void *ctx, int task) {
+    EnemyPass *pass = ctx;
+    EnemyArrays *enemies = &state->enemies;
+    int start = task * ENEMY_BEHAVIOUR_TASK_SIZE;
+    int end = start + ENEMY_BEHAVIOUR_TASK_SIZE;
+    if (end > pass->num_sep) end = pass->num_sep;
+    float perception_radius = pass->perception_radius;
+
+    for (int k = start; k < end; k++) {
+        int i = pass->sep_ids[k];
+        Vec2 pos = enemy_pos(i);
+        SeparationQuery query = {
+            .id = i,
+            .pos = pos,
+            .perception_radius = perception_radius,
+            .force = Vector2Zero()
+        };
+        index_visit(
+            state->enemy_index,
+            (QRect) {
+                pos.x,
+                pos.y,
+                perception_radius * 2,
+                perception_radius * 2
+            },
+            visit_separation, &query
+        );
+        enemies->sep_xs[i] = query.force.x;
+        enemies->sep_ys[i] = query.force.y;
+    }
+}
+
+void _enemies_behaviour_task(void *ctx, int task) {
+    EnemyPass *pass = ctx;
+    int table = 0;
+    while (task >= pass->first_task[table + 1]) {
+        table += 1;
+    }
+
+    int start = (task - pass->first_task[table]) * ENEMY_BEHAVIOUR_TASK_SIZE;
+    int end = start + ENEMY_BEHAVIOUR_TASK_SIZE;
+    if (end > state->enemies.cold[table].count) end = state->enemies.cold[table].count;
+    switch (table) {
+        case COLD_RAM:
+            update_ram_enemies(pass, start, end, &pass->tasks[task]);
+            break;
+        case COLD_MAGE:
+            update_mage_enemies(pass, start, end, &pass->tasks[task]);
+            break;
+        case COLD_DEMON:
+            update_demon_enemies(pass, start, end, &pass->tasks[task]);
+            break;
+    }
+}
+
+// Chase and the timers running out
+void _enemies_move_task(void *ctx, int task) {
+    EnemyPass *pass = ctx;
+    EnemyArrays *enemies = &state->enemies;
+    int start = task * ENEMY_TASK_SIZE;
+    int end = start + ENEMY_TASK_SIZE;
+    if (end > pass->num_enemies) end = pass->num_enemies;
+    enemies_chase(enemies, start, end, pass->player_pos, pass->dt);
+
+    for (int i = start; i < end; i++) {
+        if (enemies->healths[i] <= 0) {
+            continue;
+        }
+
+        if (enemy_has(i, ENEMY_FROZEN)) {
+            if (pass->now - enemies->frozen_ts[i] > 2000) {
+                enemy_set(i, ENEMY_FROZEN, false);
+                enemies->frozen_ts[i] = 0;
+                enemies->speeds[i] = get_enemy_speed(enemies->types[i]);
+            }
+        }
+
+        if (enemy_has(i, ENEMY_DAMAGED)) {
+            if (pass->now - enemies->damage_ts[i] > 100) {
+                enemy_set(i, ENEMY_DAMAGED, false);
+                enemies->damage_ts[i] = 0;
+            }
+        }
+    }
+}
+
+// Stops once the bullet has used up its penetration
+bool visit_bullet_hit(QPoint pt, void *ctx) {
+    Bullet *bullet = ctx;
+    float *health = &state->enemies.healths[pt.id];
+    if (*health <= 0) {
+        return true;
+    }
+
+    float damage = fmin(bullet->strength, *health);
+    *health -= damage;
+    enemy_set(pt.id, ENEMY_DAMAGED, true);
+    state->enemies.damage_ts[pt.id] = enemy_stamp();
+    // bullet->strength -= damage;
+    bullet->penetration -= 1;
+
+    // idk how else to do this in a better way
+    if (*health <= 0) {
+        state->kill_count += 1;
+    }
+
+    // let one bullet hurt only one enemy
+    return bullet->penetration > 0;
+}
+
+bool visit_flame_hit(QPoint pt, void *ctx) {
+    float *health = &state->enemies.healths[pt.id];
+    if (*health <= 0) {
+        return true;
+    }
+
+    *health -= state->stats.flame_damage;
+    enemy_set(pt.id, ENEMY_DAMAGED, true);
+    state->enemies.damage_ts[pt.id] = enemy_stamp();
+    if (*health <= 0) {
+        state->kill_count += 1;
+    }
+    return true;
+}
+
+bool visit_frost_hit(QPoint pt, void *ctx) {
+    bool can_frost = !enemy_has(pt.id, ENEMY_FROZEN);
+    if (can_frost) {
+        enemy_set(pt.id, ENEMY_FROZEN, true);
+        state->enemies.speeds[pt.id] /= 2.0f;
+        state->enemies.healths[pt.id] -= state->stats.frost_wave_damage;
+        state->enemies.frozen_ts[pt.id] = enemy_stamp();
+    }
+    return true;
+}
+
+bool visit_separation(QPoint pt, void *ctx) {
+    SeparationQuery *query = ctx;
+    if (pt.id == query->id) {
+        return true;
+    }
+
+    Vec2 neighbor = Vector2Subtract(enemy_pos(pt.id), query->pos);
+    float dist = Vector2Length(neighbor);
+    
+    if (dist < query->perception_radius && dist > 0) {
+        // repulsion force, stronger at closer distances
+        float repulsion_strength = (1.0f - (dist / query->perception_radius)) * 0.5f;
+        Vec2 repulsion = Vector2Normalize(neighbor);
+        repulsion = Vector2Scale(repulsion, -repulsion_strength * ENEMY_SPEED);
+        query->force = Vector2Add(query->force, repulsion);
+    }
+    return true;
+}
+
+// :particle
+void update_particles() {
+    Vec2 player_pos = state->player_pos;
+
+    // Mana pickup particles
+    {
+        int i = 0;
+        while (i < state->mana_particles_count) {
+
+            // reached player
+            float dist = Vector2DistanceSqr(player_pos, state->mana_particles[i]);
+            if (dist < 10) {
+                state->mana_particles[i] = state->mana_particles[state->mana_particles_count - 1];
+                state->mana_particles_count -= 1;
+                i++;
+                continue;
+            }
+
+            // move towards player
+            Vec2 dir = Vector2Subtract(player_pos, state->mana_particles[i]);
+            dir = Vector2Normalize(dir);
+            state->mana_particles[i].x += dir.x * GetFrameTime() * 200;
+            state->mana_particles[i].y += dir.y * GetFrameTime() * 200;
+
+            i++;
+        }
+    }
+
+    // Flame particles
+    {
+        int i = 0;
+        while (i < state->flame_particles_count) {
+            Particle *p = &state->flame_particles[i];
+
+            int time_alive = get_current_time_millis() - p->spawn_ts;
+            if (time_alive > p->lifetime) {
+                state->flame_particles[i] = state->flame_particles[state->flame_particles_count - 1];
+                state->flame_particles_count -= 1;
+                i ++;
+                continue;
+            }
+
+            Vec2 dir = state->flame_particles[i].dir;
+            state->flame_particles[i].pos.x += dir.x * GetFrameTime() * state->stats.flame_distance;
+            state->flame_particles[i].pos.y += dir.y * GetFrameTime() * state->stats.flame_distance;
+
+            i ++;
+        }
+    }
+
+    // Frost wave particles
+    {
+        int i = 0;
+        while (i < state->frost_wave_particles_count) {
+            Particle *p = &state->frost_wave_particles[i];
+
+            int time_alive = get_current_time_millis() - p->spawn_ts;
+            if (time_alive > p->lifetime) {
+                state->frost_wave_particles[i] = state->frost_wave_particles[state->frost_wave_particles_count - 1];
+                state->frost_wave_particles_count -= 1;
+                i ++;
+                continue;
+            }
+
+            Vec2 dir = state->frost_wave_particles[i].dir;
             state->frost_wave_particles[i].pos.x += dir.x * GetFrameTime() * 120;
             state->frost_wave_particles[i].pos.y += dir.y * GetFrameTime() * 120;
 
@@ -1867,7 +2178,6 @@ void update_particles() {
 void update_bullets() {
     Bullet *bullets = state->bullets;
     Bullet *enemy_bullets = state->enemy_bullets;
-    Enemy *enemies = state->enemies;
 
     Vec2 player_pos = state->player_pos;
     int *bullet_count = &state->bullet_count;
@@ -1879,35 +2189,24 @@ void update_bullets() {
         // Simple Bullet
         bool is_simple_shoot = get_current_time_millis() - state->timer.bullet_ts > state->stats.bullet_interval;
         if (is_simple_shoot) {
-            float min_dist = FLT_MAX;
-            bool enemy_found = false;
-            Vec2 enemy_pos = Vector2Zero();
-
             play_sound_modulated(&state->sound_bullet_fire, 0.1);
 
-            state->num_query_points = 0;
-            qtree_query(
-                state->enemy_qtree,
-                (QRect) { player_pos.x, player_pos.y, GUN_VISION, GUN_VISION },
-                state->query_points,
-                &state->num_query_points
+            // each bullet of the volley gets its own target, nearest first
+            QPoint targets[MAX_NEAREST];
+            index_stats_begin(SITE_TARGETING);
+            int num_targets = neighbours_k_nearest(
+                &state->player_neighbours,
+                state->enemy_index,
+                player_pos,
+                GUN_VISION,
+                state->stats.bullet_count,
+                targets
             );
+            index_stats_end();
 
-            for (int i = 0; i < state->num_query_points; i++) {
-                QPoint pt = state->query_points[i];
-                float dist = Vector2DistanceSqr(player_pos, enemies[pt.id].pos);
-                if (dist < min_dist) {
-                    min_dist = dist;
-                    enemy_pos = enemies[pt.id].pos;
-                    enemy_found = true;
-                }
-            }
-
-            Vec2 dir = Vector2Subtract(enemy_pos, player_pos);
-            dir = Vector2Normalize(dir);
-
-            if (!enemy_found) {
-                dir = get_rand_unit_vec2();
+            Vec2 dir = get_rand_unit_vec2();
+            if (num_targets > 0) {
+                dir = Vector2Normalize(Vector2Subtract(enemy_pos(targets[0].id), player_pos));
             }
 
             for (int i = 0; i < state->stats.bullet_count; i++) {
@@ -1916,7 +2215,23 @@ void update_bullets() {
                     break;
                 }
 
-                // first bullet always hits the target
+                if (i < num_targets) {
+                    Vec2 target_dir = Vector2Normalize(Vector2Subtract(enemy_pos(targets[i].id), player_pos));
+                    bullets[*bullet_count] = (Bullet) {
+                        .pos = player_pos,
+                        .direction = target_dir,
+                        .spawnTs = get_current_time_millis(),
+                        .strength = state->stats.bullet_damage,
+                        .penetration = state->stats.bullet_penetration,
+                        .type = BULLET,
+                        .speed = get_attack_speed(BULLET),
+                        .angle = 0
+                    };
+                    *bullet_count += 1;
+                    continue;
+                }
+
+                // not enough targets, the rest spread around the nearest one
                 float angle_spread = 0;
                 if (i != 0) {
                     int spread = (int) state->stats.bullet_spread;
@@ -2114,6 +2429,63 @@ void update_bullets() {
         }
     }
 
+    // Laser
+    // :laser :beam
+    {
+        bool is_shoot_laser = get_current_time_millis() - state->timer.laser_ts > state->stats.laser_interval;
+        if (state->upgrades.laser_level > 0 && is_shoot_laser) {
+            float range = get_attack_range(LASER);
+
+            // aim at the nearest enemy in range, otherwise fire where the player is heading
+            Vec2 dir = state->player_heading_dir;
+            QPoint target;
+            index_stats_begin(SITE_TARGETING);
+            if (neighbours_k_nearest(&state->player_neighbours, state->enemy_index, player_pos, range, 1, &target) > 0) {
+                dir = Vector2Subtract(enemy_pos(target.id), player_pos);
+            }
+            index_stats_end();
+            if (is_vec2_zero(dir)) {
+                dir = get_rand_unit_vec2();
+            }
+            dir = Vector2Normalize(dir);
+            Vec2 end = point_at_dist(player_pos, dir, range);
+
+            // hits come back front to back, so penetration is used up by the closest enemies
+            QShape beam = shape_segment(player_pos, end, LASER_WIDTH);
+            QPoint hits[LASER_MAX_HITS];
+            index_stats_begin(SITE_LASER);
+            int num_hits = index_query_segment(state->enemy_index, &beam, hits, LASER_MAX_HITS);
+            index_stats_end();
+
+            int penetration = state->stats.laser_penetration;
+            for (int i = 0; i < num_hits && penetration > 0; i++) {
+                int id = hits[i].id;
+                float *health = &state->enemies.healths[id];
+                if (*health <= 0) {
+                    continue;
+                }
+
+                *health -= state->stats.laser_damage;
+                enemy_set(id, ENEMY_DAMAGED, true);
+                state->enemies.damage_ts[id] = enemy_stamp();
+                if (*health <= 0) {
+                    state->kill_count += 1;
+                }
+
+                penetration -= 1;
+                // an exhausted beam stops at the last enemy it hit
+                if (penetration <= 0) {
+                    end = point_at_dist(player_pos, dir, Vector2Distance(player_pos, enemy_pos(id)));
+                }
+            }
+
+            state->laser_start = player_pos;
+            state->laser_end = end;
+            state->timer.laser_ts = get_current_time_millis();
+            play_sound_modulated(&state->sound_bullet_fire, 0.2);
+        }
+    }
+
     // Enemy bullets update
     {
         int i = 0;
@@ -2145,76 +2517,105 @@ void update_pickups() {
         if (now - state->timer.pickups_cleanup_ts > PICKUPS_CLEANUP_INTERVAL) {
             state->timer.pickups_cleanup_ts = now;
 
-            for (int i = 0; i < state->pickups_count; i++) {
-                bool too_old = get_current_time_millis() - state->pickups[i].spawn_ts >= PICKUPS_LIFETIME;
-                if (too_old || state->pickups[i].is_collected) {
-                    state->pickups[i] = state->pickups[state->pickups_count - 1];
-                    state->pickups_count -= 1;
+            // backwards, the swap remove only moves pickups that were already checked
+            for (int i = state->pickups_count - 1; i >= 0; i--) {
+                bool too_old = now - state->pickups[i].spawn_ts >= PICKUPS_LIFETIME;
+                if (too_old) {
+                    pickup_remove(pickup_handle(state->pickups[i].slot));
                 }
             }
         }
     }
 
-    // Grab pickups
-    {
-        float perception_radius = 25.0f;
-        state->num_query_points = 0;
-        qtree_query(
-            state->pickups_qtree,
-            (QRect) {
-                state->player_pos.x,
-                state->player_pos.y,
-                perception_radius,
-                perception_radius
-            },
-            state->query_points,
-            &state->num_query_points
-        );
+    // Squeeze the tombstones out of a few cells, spread over frames
+    index_stats_begin(SITE_PICKUPS);
+    static_grid_compact(state->pickups_grid, PICKUPS_COMPACT_PER_FRAME);
+    index_stats_end();
+}
 
-        for (int j = 0; j < state->num_query_points; j++) {
-            QPoint pt = state->query_points[j];
-            float dist = Vector2DistanceSqr(state->player_pos, (Vec2) { pt.x, pt.y });
-            PickupType pickup_type = state->pickups[pt.id].type;
-            if (dist > perception_radius * perception_radius) {
-                continue;
+// :collision
+// Every pair the broadphase found this tick, resolved by what the two sides are
+void update_collisions() {
+    Broadphase *bp = state->broadphase;
+    broadphase_find_pairs(bp);
+
+    for (int i = 0; i < bp->num_pairs; i++) {
+        CollisionPair *pair = &bp->pairs[i];
+        switch (pair->layer_a | pair->layer_b) {
+            case LAYER_BULLET | LAYER_ENEMY: {
+                Bullet *bullet = &state->bullets[pair->a];
+                // spent bullets skip the rest of their pairs
+                if (bullet->strength <= 0 || bullet->penetration <= 0) {
+                    break;
+                }
+                visit_bullet_hit(pair->b, bullet);
+                break;
             }
-
-            // remove the pickup item
-            state->pickups[pt.id].is_collected = true;
-            qtree_remove(state->pickups_qtree, pt);
-
-            if (pickup_type == MANA || pickup_type == MANA_SHINY) {
-                int mana_value = get_mana_value();
-                state->mana_count += pickup_type == MANA_SHINY ? 7 * mana_value : mana_value;
-
-                // mana pickup particle
-                // TODO there's a bug here, sometimes particles that are far away are being attracted to the player
-                // I tried doing a (&& state->pickups[pt.id].is_collected) but it doesn't help
-                // Hence doing a distance check for now, 
-                // It doesn't fully work properly and a few pickups don't have pickup particle effect
-                float perception_range = perception_radius * perception_radius;
-                if (state->mana_particles_count < MAX_MANA_PARTICLES && dist <= perception_range) {
-                    state->mana_particles[state->mana_particles_count] = (Vec2) { pt.x, pt.y };
-                    state->mana_particles_count += 1;
+            case LAYER_PLAYER | LAYER_ENEMY:
+                visit_player_hurt(pair->b, NULL);
+                break;
+            case LAYER_PLAYER | LAYER_ENEMY_BULLET: {
+                Bullet *b = &state->enemy_bullets[pair->b.id];
+                float dist = Vector2DistanceSqr(state->player_pos, b->pos);
+                if (dist < 50) {
+                    state->player_health -= b->strength;
+                    b->penetration = 0;
+                    b->strength = 0;
+                    if (get_current_time_millis() - state->timer.last_hurt_sound_ts > 400) {
+                        play_sound_modulated(&state->sound_hurt, 0.5);
+                        state->timer.last_hurt_sound_ts = get_current_time_millis();
+                    }
                 }
+                break;
+            }
+            case LAYER_PLAYER | LAYER_PICKUP:
+                collect_pickup(pair->b);
+                break;
+            default:
+                printe("Unhandled collision pair");
+                break;
+        }
+    }
+}
+
+void collect_pickup(QPoint pt) {
+    float dist = Vector2DistanceSqr(state->player_pos, (Vec2) { pt.x, pt.y });
+    if (dist > PICKUP_GRAB_RADIUS * PICKUP_GRAB_RADIUS) {
+        return;
+    }
+    PickupType pickup_type = pickup_at_slot(pt.id)->type;
+
+    // remove the pickup item
+    pickup_remove(pickup_handle(pt.id));
+
+    if (pickup_type == MANA || pickup_type == MANA_SHINY) {
+        int mana_value = get_mana_value();
+        state->mana_count += pickup_type == MANA_SHINY ? 7 * mana_value : mana_value;
+
+        // mana pickup particle
+        // Far away particles used to get attracted to the player, the cleanup swapped pickups
+        // around without telling the index so its ids pointed at the wrong pickups.
+        // Handles fixed that
+        if (state->mana_particles_count < MAX_MANA_PARTICLES) {
+            state->mana_particles[state->mana_particles_count] = (Vec2) { pt.x, pt.y };
+            state->mana_particles_count += 1;
+        }
 
-                // :levelup
-                int level_mana_count = get_level_mana_threshold(state->player_level);
-                if (state->mana_count >= level_mana_count) {
-                    state->mana_count -= level_mana_count;
-                    state->player_level += 1;
+        // :levelup
+        int level_mana_count = get_level_mana_threshold(state->player_level);
+        if (state->mana_count >= level_mana_count) {
+            state->mana_count -= level_mana_count;
+            state->player_level += 1;
 
-                    update_available_upgrades();
-                    state->screen = UPGRADE_MENU;
-                    pause_timers();
-                }
-            } else if (pickup_type == HEALTH) {
-                play_sound_modulated(&state->sound_health_pickup, 0.9);
-                state->player_health = Clamp(state->player_health + 100, 0, MAX_PLAYER_HEALTH);
-            } else {
-                printe("Picked up an unhandled pickup");
-            }
+            update_available_upgrades();
+            state->screen = UPGRADE_MENU;
+            pause_timers();
         }
+    } else if (pickup_type == HEALTH) {
+        play_sound_modulated(&state->sound_health_pickup, 0.9);
+        state->player_health = Clamp(state->player_health + 100, 0, MAX_PLAYER_HEALTH);
+    } else {
+        printe("Picked up an unhandled pickup");
     }
 }
 
@@ -2365,62 +2766,471 @@ void update_decorations() {
     }
 }
 
-// MARK: :input
+// MARK: :enemies
+
+bool enemies_init(EnemyArrays *enemies, int capacity) {
+    *enemies = (EnemyArrays) {
+        .xs = malloc(sizeof(float) * capacity),
+        .ys = malloc(sizeof(float) * capacity),
+        .healths = malloc(sizeof(float) * capacity),
+        .speeds = malloc(sizeof(float) * capacity),
+        .types = malloc(sizeof(unsigned char) * capacity),
+        .flags = malloc(sizeof(unsigned char) * capacity),
+        .spawn_ts = malloc(sizeof(EnemyTime) * capacity),
+        .frozen_ts = malloc(sizeof(EnemyTime) * capacity),
+        .damage_ts = malloc(sizeof(EnemyTime) * capacity),
+        .colds = malloc(sizeof(unsigned short) * capacity),
+        .sep_xs = malloc(sizeof(float) * capacity),
+        .sep_ys = malloc(sizeof(float) * capacity),
+        .sep_ids = malloc(sizeof(int) * capacity),
+        // grows with the enemies that have a behaviour
+        .tasks = NULL,
+        .task_capacity = 0,
+        .task_bullets = NULL,
+        .task_bullets_capacity = 0,
+        .task_pups = NULL,
+        .task_pups_capacity = 0
+    };
+    bool is_cold_ok = true;
+    for (int t = 0; t < NUM_COLD_TABLES; t++) {
+        // grows with the RAMs, MAGEs and DEMONs alive
+        enemies->cold[t] = (EnemyColds) {
+            .entries = malloc(sizeof(EnemyCold) * ENEMY_COLD_MIN_CAPACITY),
+            .count = 0,
+            .capacity = ENEMY_COLD_MIN_CAPACITY
+        };
+        is_cold_ok = is_cold_ok && enemies->cold[t].entries;
+    }
+    if (!enemies->xs || !enemies->ys || !enemies->healths || !enemies->speeds ||
+        !enemies->types || !enemies->flags || !enemies->spawn_ts || !enemies->frozen_ts ||
+        !enemies->damage_ts || !enemies->colds || !enemies->sep_xs || !enemies->sep_ys ||
+        !enemies->sep_ids || !is_cold_ok) {
+        enemies_destroy(enemies);
+        return false;
+    }
+    return true;
+}
 
-void handle_player_input() {
-    Vec2 *player_pos = &state->player_pos;
-    bool is_dir_invalid = true;
-    Vec2 old_pos = *player_pos;
+void enemies_destroy(EnemyArrays *enemies) {
+    free(enemies->xs);
+    free(enemies->ys);
+    free(enemies->healths);
+    free(enemies->speeds);
+    free(enemies->types);
+    free(enemies->flags);
+    free(enemies->spawn_ts);
+    free(enemies->frozen_ts);
+    free(enemies->damage_ts);
+    free(enemies->colds);
+    free(enemies->sep_xs);
+    free(enemies->sep_ys);
+    for (int t = 0; t < NUM_COLD_TABLES; t++) {
+        free(enemies->cold[t].entries);
+    }
+    free(enemies->sep_ids);
+    free(enemies->tasks);
+    free(enemies->task_bullets);
+    free(enemies->task_pups);
+    *enemies = (EnemyArrays) { 0 };
+}
 
-    // wasd movement
-    {
-        Vec2 dir = Vector2Zero();
-        if (IsKeyDown(KEY_W) || IsKeyDown(KEY_UP)) { dir.y -= 1; }
-        if (IsKeyDown(KEY_S) || IsKeyDown(KEY_DOWN)) { dir.y += 1; }
-        if (IsKeyDown(KEY_A) || IsKeyDown(KEY_LEFT)) { dir.x -= 1; }
-        if (IsKeyDown(KEY_D) || IsKeyDown(KEY_RIGHT)) { dir.x += 1; }
+// Milliseconds since the epoch, stays within [ENEMY_CLOCK_KEEP_MS, ENEMY_CLOCK_REBASE_MS] in game
+int enemy_clock() {
+    return get_current_time_millis() - state->timer.enemy_clock_ts;
+}
 
-        dir = Vector2Normalize(dir);
-        is_dir_invalid = is_vec2_zero(dir);
+// Absolute millis to the enemy clock, anything from before the epoch reads as the epoch
+EnemyTime _enemy_time(int ts) {
+    int t = ts - state->timer.enemy_clock_ts;
+    if (t < 0) return 0;
+    if (t > USHRT_MAX) return USHRT_MAX;
+    return t;
+}
 
-        player_pos->x += dir.x * GetFrameTime() * state->stats.player_speed;
-        player_pos->y += dir.y * GetFrameTime() * state->stats.player_speed;
+// The clock as a stamp, clamped for when a long stalled frame lands before the next rebase
+EnemyTime enemy_stamp() {
+    return _enemy_time(get_current_time_millis());
+}
 
-        if (!is_dir_invalid) {
-            state->player_heading_dir = Vector2Normalize(
-                Vector2Subtract(*player_pos, old_pos));
+EnemyTime _enemy_time_shift(EnemyTime ts, int shift) {
+    return ts > shift ? ts - shift : 0;
+}
+
+/**
+ * Moves the epoch up so the clock is back at ENEMY_CLOCK_KEEP_MS.
+ * A stamp older than that clamps to the new epoch, which still reads as older than any enemy timer
+ */
+void enemy_clock_rebase() {
+    int clock = enemy_clock();
+    if (clock < ENEMY_CLOCK_REBASE_MS)
+        return;
+
+    EnemyArrays *enemies = &state->enemies;
+    int shift = clock - ENEMY_CLOCK_KEEP_MS;
+    state->timer.enemy_clock_ts += shift;
+    for (int i = 0; i < state->enemy_count; i++) {
+        enemies->spawn_ts[i] = _enemy_time_shift(enemies->spawn_ts[i], shift);
+        enemies->frozen_ts[i] = _enemy_time_shift(enemies->frozen_ts[i], shift);
+        enemies->damage_ts[i] = _enemy_time_shift(enemies->damage_ts[i], shift);
+    }
+    for (int t = 0; t < NUM_COLD_TABLES; t++) {
+        for (int i = 0; i < enemies->cold[t].count; i++) {
+            EnemyCold *cold = &enemies->cold[t].entries[i];
+            cold->player_found_ts = _enemy_time_shift(cold->player_found_ts, shift);
+            cold->last_spawn_ts = _enemy_time_shift(cold->last_spawn_ts, shift);
         }
     }
+}
 
-    // joystick movement
-    {
-        if (state->is_joystick_enabled && is_dir_invalid) {
-            player_pos->x += state->joystick_direction.x * GetFrameTime() * state->stats.player_speed;
-            player_pos->y += state->joystick_direction.y * GetFrameTime() * state->stats.player_speed;
-            state->player_heading_dir = Vector2Normalize(Vector2Subtract(*player_pos, old_pos));
-        }
+bool _enemies_reserve_cold(EnemyColds *colds, int n) {
+    if (n <= colds->capacity)
+        return true;
+
+    int capacity = colds->capacity * 2;
+    if (capacity < n) capacity = n;
+    EnemyCold *entries = realloc(colds->entries, sizeof(EnemyCold) * capacity);
+    if (!entries) {
+        printe("Failed to grow the enemy side table");
+        return false;
     }
+    colds->entries = entries;
+    colds->capacity = capacity;
+    return true;
 }
 
-void handle_extra_inputs() {
-    GameScreen *screen = &state->screen;
-    // pause
-    if (IsKeyPressed(KEY_SPACE)) {
-        if (*screen == PAUSE_MENU) {
-            resume_timers();
-            *screen = IN_GAME;
-        } else if (*screen == IN_GAME) {
-            pause_timers();
-            *screen = PAUSE_MENU;
+bool _enemies_reserve_tasks(EnemyArrays *enemies, int num_tasks, int num_bullets, int num_pups) {
+    if (num_tasks > enemies->task_capacity) {
+        int capacity = enemies->task_capacity * 2;
+        if (capacity < num_tasks) capacity = num_tasks;
+        EnemyTask *tasks = realloc(enemies->tasks, sizeof(EnemyTask) * capacity);
+        if (!tasks) {
+            printe("Failed to grow the enemy task buffers");
+            return false;
         }
-        return;
+        enemies->tasks = tasks;
+        enemies->task_capacity = capacity;
     }
-}
 
-void handle_debug_inputs() {
-    if (!DEBUG) return;
+    if (num_bullets > enemies->task_bullets_capacity) {
+        int capacity = enemies->task_bullets_capacity * 2;
+        if (capacity < num_bullets) capacity = num_bullets;
+        Bullet *bullets = realloc(enemies->task_bullets, sizeof(Bullet) * capacity);
+        if (!bullets) {
+            printe("Failed to grow the enemy task bullets");
+            return false;
+        }
+        enemies->task_bullets = bullets;
+        enemies->task_bullets_capacity = capacity;
+    }
 
-    GameScreen *screen = &state->screen;
+    if (num_pups > enemies->task_pups_capacity) {
+        int capacity = enemies->task_pups_capacity * 2;
+        if (capacity < num_pups) capacity = num_pups;
+        Enemy *pups = realloc(enemies->task_pups, sizeof(Enemy) * capacity);
+        if (!pups) {
+            printe("Failed to grow the enemy task pups");
+            return false;
+        }
+        enemies->task_pups = pups;
+        enemies->task_pups_capacity = capacity;
+    }
+    return true;
+}
+
+// Appends the enemy, returns its slot or -1 when full. The caller puts it in the index
+int enemy_add(Enemy enemy) {
+    if (state->enemy_count >= MAX_ENEMIES)
+        return -1;
+
+    EnemyArrays *enemies = &state->enemies;
+    int i = state->enemy_count;
+    enemies->colds[i] = NO_ENEMY_COLD;
+    int table = get_enemy_cold_table(enemy.type);
+    if (table >= 0) {
+        EnemyColds *colds = &enemies->cold[table];
+        if (!_enemies_reserve_cold(colds, colds->count + 1))
+            return -1;
+        enemies->colds[i] = colds->count;
+        colds->entries[colds->count] = (EnemyCold) {
+            .charge_dir = enemy.charge_dir,
+            .player_found_ts = _enemy_time(enemy.player_found_ts),
+            .last_spawn_ts = _enemy_time(enemy.last_spawn_ts),
+            .owner = i
+        };
+        colds->count += 1;
+    }
+
+    enemies->xs[i] = enemy.pos.x;
+    enemies->ys[i] = enemy.pos.y;
+    enemies->healths[i] = enemy.health;
+    enemies->speeds[i] = enemy.speed;
+    enemies->types[i] = enemy.type;
+    enemies->flags[i] = (enemy.is_shiny ? ENEMY_SHINY : 0) |
+                        (enemy.is_frozen ? ENEMY_FROZEN : 0) |
+                        (enemy.is_taking_damage ? ENEMY_DAMAGED : 0) |
+                        (enemy.is_player_found ? ENEMY_PLAYER_FOUND : 0);
+    enemies->spawn_ts[i] = _enemy_time(enemy.spawn_ts);
+    enemies->frozen_ts[i] = _enemy_time(enemy.frozen_ts);
+    enemies->damage_ts[i] = _enemy_time(enemy.damage_ts);
+    state->enemy_count += 1;
+    return i;
+}
+
+// Swap remove, the last enemy moves into slot i. Its index id is left to the caller
+void enemy_remove(int i) {
+    EnemyArrays *enemies = &state->enemies;
+    // the side table is kept dense the same way
+    int cold = enemies->colds[i];
+    if (cold != NO_ENEMY_COLD) {
+        EnemyColds *colds = &enemies->cold[get_enemy_cold_table(enemies->types[i])];
+        int last_cold = colds->count - 1;
+        if (cold != last_cold) {
+            colds->entries[cold] = colds->entries[last_cold];
+            enemies->colds[colds->entries[cold].owner] = cold;
+        }
+        colds->count -= 1;
+    }
+
+    int last = state->enemy_count - 1;
+    if (i != last) {
+        enemies->xs[i] = enemies->xs[last];
+        enemies->ys[i] = enemies->ys[last];
+        enemies->healths[i] = enemies->healths[last];
+        enemies->speeds[i] = enemies->speeds[last];
+        enemies->types[i] = enemies->types[last];
+        enemies->flags[i] = enemies->flags[last];
+        enemies->spawn_ts[i] = enemies->spawn_ts[last];
+        enemies->frozen_ts[i] = enemies->frozen_ts[last];
+        enemies->damage_ts[i] = enemies->damage_ts[last];
+        enemies->colds[i] = enemies->colds[last];
+        if (enemies->colds[i] != NO_ENEMY_COLD)
+            enemy_cold(i)->owner = i;
+    }
+    state->enemy_count -= 1;
+}
+
+// NULL for the types that don't have one
+EnemyCold *enemy_cold(int i) {
+    int cold = state->enemies.colds[i];
+    if (cold == NO_ENEMY_COLD)
+        return NULL;
+    return &state->enemies.cold[get_enemy_cold_table(state->enemies.types[i])].entries[cold];
+}
+
+/**
+ * Moves every live enemy in [start, end) that isn't held towards target at its speed,
+ * plus its separation force. Same as the scalar chase, except the direction comes from
+ * rsqrt with a Newton step, which is within a couple of ulps of the divide
+ */
+void enemies_chase(EnemyArrays *enemies, int start, int end, Vec2 target, float dt) {
+    int i = start;
+#ifdef SCAN_LANES
+    ScanVec zero = scan_set(0);
+    ScanVec half = scan_set(0.5f);
+    ScanVec three_halves = scan_set(1.5f);
+    // rsqrt of a denormal is inf, Vector2Normalize leaves a zero length alone anyway
+    ScanVec min_len_sqr = scan_set(FLT_MIN);
+    ScanVec target_x = scan_set(target.x);
+    ScanVec target_y = scan_set(target.y);
+    ScanVec step = scan_set(dt);
+    for (; i + SCAN_LANES <= end; i += SCAN_LANES) {
+        ScanVec x = scan_load(enemies->xs + i);
+        ScanVec y = scan_load(enemies->ys + i);
+        ScanVec dx = scan_sub(target_x, x);
+        ScanVec dy = scan_sub(target_y, y);
+        ScanVec len_sqr = scan_add(scan_mul(dx, dx), scan_mul(dy, dy));
+
+        ScanVec inv_len = scan_rsqrt(len_sqr);
+        inv_len = scan_mul(inv_len, scan_sub(three_halves, scan_mul(scan_mul(half, len_sqr), scan_mul(inv_len, inv_len))));
+        inv_len = scan_and(inv_len, scan_lt(min_len_sqr, len_sqr));
+
+        ScanVec speed = scan_mul(scan_load(enemies->speeds + i), inv_len);
+        ScanVec vx = scan_add(scan_mul(dx, speed), scan_load(enemies->sep_xs + i));
+        ScanVec vy = scan_add(scan_mul(dy, speed), scan_load(enemies->sep_ys + i));
+
+        ScanVec is_chasing = scan_and(
+            scan_lt(zero, scan_load(enemies->healths + i)),
+            scan_bits_clear(enemies->flags + i, ENEMY_HOLD)
+        );
+        scan_store(enemies->xs + i, scan_add(x, scan_and(scan_mul(vx, step), is_chasing)));
+        scan_store(enemies->ys + i, scan_add(y, scan_and(scan_mul(vy, step), is_chasing)));
+    }
+#endif
+    for (; i < end; i++) {
+        if (enemies->healths[i] <= 0 || (enemies->flags[i] & ENEMY_HOLD)) {
+            continue;
+        }
+
+        float dx = target.x - enemies->xs[i];
+        float dy = target.y - enemies->ys[i];
+        float len_sqr = dx * dx + dy * dy;
+        float speed = len_sqr > FLT_MIN ? enemies->speeds[i] / sqrtf(len_sqr) : 0;
+        enemies->xs[i] += (dx * speed + enemies->sep_xs[i]) * dt;
+        enemies->ys[i] += (dy * speed + enemies->sep_ys[i]) * dt;
+    }
+}
+
+Vec2 enemy_pos(int i) {
+    return (Vec2) { state->enemies.xs[i], state->enemies.ys[i] };
+}
+
+void enemy_set_pos(int i, Vec2 pos) {
+    state->enemies.xs[i] = pos.x;
+    state->enemies.ys[i] = pos.y;
+}
+
+bool enemy_has(int i, int flag) {
+    return (state->enemies.flags[i] & flag) != 0;
+}
+
+void enemy_set(int i, int flag, bool is_set) {
+    if (is_set)
+        state->enemies.flags[i] |= flag;
+    else
+        state->enemies.flags[i] &= ~flag;
+}
+
+// MARK: :pickups
+
+void pickups_init() {
+    // every slot starts out free, chained in order
+    for (int i = 0; i < MAX_PICKUPS; i++) {
+        state->pickup_slots[i] = (PickupSlot) {
+            .index = i + 1 < MAX_PICKUPS ? i + 1 : NO_PICKUP,
+            .generation = 0
+        };
+    }
+    state->pickup_free_slot = 0;
+    state->pickups_count = 0;
+}
+
+// Returns NO_PICKUP when every slot is taken
+PickupHandle pickup_add(Pickup pickup) {
+    int slot = state->pickup_free_slot;
+    if (slot == NO_PICKUP)
+        return NO_PICKUP;
+
+    PickupSlot *s = &state->pickup_slots[slot];
+    state->pickup_free_slot = s->index;
+    s->index = state->pickups_count;
+
+    pickup.slot = slot;
+    state->pickups[state->pickups_count] = pickup;
+    state->pickups_count += 1;
+
+    // the grid is keyed by slot, unlike the dense index it doesn't change until the pickup is gone
+    static_grid_insert(state->pickups_grid, (QPoint) { pickup.pos.x, pickup.pos.y, slot });
+    return pickup_handle(slot);
+}
+
+// O(1), the slot tells where the pickup is in both the array and the grid
+bool pickup_remove(PickupHandle handle) {
+    Pickup *pickup = pickup_get(handle);
+    if (!pickup)
+        return false;
+
+    int slot = pickup->slot;
+    PickupSlot *s = &state->pickup_slots[slot];
+    // only a tombstone, the grid compacts the cell later
+    static_grid_remove_id(state->pickups_grid, slot);
+
+    // swap remove, the last pickup moves into the hole and its slot follows it
+    int last = state->pickups_count - 1;
+    if (s->index != last) {
+        state->pickups[s->index] = state->pickups[last];
+        state->pickup_slots[state->pickups[s->index].slot].index = s->index;
+    }
+    state->pickups_count -= 1;
+
+    // bump the generation so handles to the old pickup stop resolving
+    s->generation = (s->generation + 1) & PICKUP_GENERATION_MASK;
+    s->index = state->pickup_free_slot;
+    state->pickup_free_slot = slot;
+    return true;
+}
+
+// NULL once the pickup was collected or expired
+Pickup *pickup_get(PickupHandle handle) {
+    if (handle < 0)
+        return NULL;
+
+    int slot = handle & PICKUP_SLOT_MASK;
+    int generation = handle >> PICKUP_SLOT_BITS;
+    if (slot >= MAX_PICKUPS || state->pickup_slots[slot].generation != generation)
+        return NULL;
+
+    int index = state->pickup_slots[slot].index;
+    // a free slot of the same generation holds the free list instead
+    if (index < 0 || index >= state->pickups_count || state->pickups[index].slot != slot)
+        return NULL;
+    return &state->pickups[index];
+}
+
+// Current handle of a live slot, the index hands out slots
+PickupHandle pickup_handle(int slot) {
+    return (state->pickup_slots[slot].generation << PICKUP_SLOT_BITS) | slot;
+}
+
+Pickup *pickup_at_slot(int slot) {
+    return &state->pickups[state->pickup_slots[slot].index];
+}
+
+// MARK: :input
+
+void handle_player_input() {
+    Vec2 *player_pos = &state->player_pos;
+    bool is_dir_invalid = true;
+    Vec2 old_pos = *player_pos;
+
+    // wasd movement
+    {
+        Vec2 dir = Vector2Zero();
+        if (IsKeyDown(KEY_W) || IsKeyDown(KEY_UP)) { dir.y -= 1; }
+        if (IsKeyDown(KEY_S) || IsKeyDown(KEY_DOWN)) { dir.y += 1; }
+        if (IsKeyDown(KEY_A) || IsKeyDown(KEY_LEFT)) { dir.x -= 1; }
+        if (IsKeyDown(KEY_D) || IsKeyDown(KEY_RIGHT)) { dir.x += 1; }
+
+        dir = Vector2Normalize(dir);
+        is_dir_invalid = is_vec2_zero(dir);
+
+        player_pos->x += dir.x * GetFrameTime() * state->stats.player_speed;
+        player_pos->y += dir.y * GetFrameTime() * state->stats.player_speed;
+
+        if (!is_dir_invalid) {
+            state->player_heading_dir = Vector2Normalize(
+                Vector2Subtract(*player_pos, old_pos));
+        }
+    }
+
+    // joystick movement
+    {
+        if (state->is_joystick_enabled && is_dir_invalid) {
+            player_pos->x += state->joystick_direction.x * GetFrameTime() * state->stats.player_speed;
+            player_pos->y += state->joystick_direction.y * GetFrameTime() * state->stats.player_speed;
+            state->player_heading_dir = Vector2Normalize(Vector2Subtract(*player_pos, old_pos));
+        }
+    }
+}
+
+void handle_extra_inputs() {
+    GameScreen *screen = &state->screen;
+    // pause
+    if (IsKeyPressed(KEY_SPACE)) {
+        if (*screen == PAUSE_MENU) {
+            resume_timers();
+            *screen = IN_GAME;
+        } else if (*screen == IN_GAME) {
+            pause_timers();
+            *screen = PAUSE_MENU;
+        }
+        return;
+    }
+}
+
+void handle_debug_inputs() {
+    if (!DEBUG) return;
+
+    GameScreen *screen = &state->screen;
     if (IsKeyPressed(KEY_TAB)) {
         state->is_show_debug_gui = !state->is_show_debug_gui;
     }
@@ -2437,268 +3247,4048 @@ void handle_debug_inputs() {
     if (IsKeyPressed(KEY_ENTER) || IsKeyPressedRepeat(KEY_ENTER)) {
         state->player_health = MAX_PLAYER_HEALTH;
     }
-    if (IsKeyPressed(KEY_GRAVE) && *screen == IN_GAME) {
-        toast("This is a sample Toast");
+    if (IsKeyPressed(KEY_GRAVE) && *screen == IN_GAME) {
+        toast("This is a sample Toast");
+    }
+
+    // Camera scroll
+    float mouse_diff = GetMouseWheelMove();
+    if (mouse_diff != 0 && *screen == IN_GAME) {
+        if (mouse_diff > 0) {
+            state->camera.zoom += 0.1;
+        } else {
+            state->camera.zoom -= 0.1;
+        } 
+    }
+}
+
+// :resize
+void handle_window_resize() {
+    int ww = GetScreenWidth();
+    int wh = GetScreenHeight();
+
+    float target_aspect = (float)VIRT_WIDTH / (float)VIRT_HEIGHT;
+    int scaled_width, scaled_height;
+
+    if ((float)ww / wh > target_aspect) {
+        // Window wider than target aspect ratio
+        scaled_height = wh;
+        scaled_width = (int)(scaled_height * target_aspect);
+    } else {
+        // Window taller than target aspect ratio
+        scaled_width = ww;
+        scaled_height = (int)(scaled_width / target_aspect);
+    }
+
+    state->dest_rect = (Rect) {
+        (ww - scaled_width) / 2,
+        (wh - scaled_height) / 2,
+        scaled_width, scaled_height
+    };
+}
+
+// :joystick
+void handle_virtual_joystick_input() {
+    // button 0 / touch input -> left click
+
+    if (IsMouseButtonPressed(0)) {
+        state->is_joystick_enabled = true;
+        state->touch_down_pos = GetMousePosition();
+    }
+    if (IsMouseButtonReleased(0)) {
+        state->is_joystick_enabled = false;
+        state->touch_down_pos = Vector2Zero();
+    }
+
+    if (state->is_joystick_enabled && IsMouseButtonDown(0)) {
+        state->joystick_direction = Vector2Subtract(GetMousePosition(), state->touch_down_pos);
+        state->joystick_direction = Vector2Normalize(state->joystick_direction);
+    }
+}
+
+// MARK: :broadphase
+/**
+ * One pass that finds the candidate pairs of every collision in the tick.
+ * Each interacting layer combination has its own generator, using whatever structure holds
+ * the layers involved. They all write to the same pair list, update_collisions then resolves
+ * it in order. Adding a kind of collision is a mask plus a generator.
+ */
+
+Broadphase *broadphase_create() {
+    Broadphase *bp = malloc(sizeof(Broadphase));
+    if (!bp) return NULL;
+
+    int sap_capacity = MAX_ENEMIES + MAX_BULLETS;
+    // enemies are in one band, bullets in two at most
+    int num_sap_nodes = MAX_ENEMIES + 2 * MAX_BULLETS;
+    *bp = (Broadphase) {
+        .masks = { 0 },
+        .pairs = malloc(MAX_COLLISION_PAIRS * sizeof(CollisionPair)),
+        .num_pairs = 0,
+        .limit = 0,
+        .bullet_ranges = malloc(MAX_BULLETS * sizeof(QRect)),
+        .bullet_range_ids = malloc(MAX_BULLETS * sizeof(int)),
+        .bullet_hits = malloc(MAX_BULLET_HITS * sizeof(QueryPair)),
+        .sap = malloc(sap_capacity * sizeof(SapEntry)),
+        .num_sap = 0,
+        .sap_num_enemies = 0,
+        .sap_num_bullets = 0,
+        .is_sap_coherent = false,
+        .sap_band_height = SAP_MIN_BAND_HEIGHT,
+        .sap_next = malloc(num_sap_nodes * sizeof(int)),
+        .sap_node_entry = malloc(num_sap_nodes * sizeof(int)),
+        .sap_keys = malloc(sap_capacity * sizeof(unsigned int)),
+        .sap_tmp_keys = malloc(sap_capacity * sizeof(unsigned int)),
+        .sap_order = malloc(sap_capacity * sizeof(int)),
+        .sap_tmp_order = malloc(sap_capacity * sizeof(int)),
+        .sap_tmp = malloc(sap_capacity * sizeof(SapEntry)),
+    };
+    bool is_batch_ok = query_batch_scratch_init(&bp->batch, MAX_BULLETS);
+
+    if (!bp->pairs || !bp->bullet_ranges || !bp->bullet_range_ids || !bp->bullet_hits || !is_batch_ok ||
+            !bp->sap || !bp->sap_next || !bp->sap_node_entry || !bp->sap_keys ||
+            !bp->sap_tmp_keys || !bp->sap_order || !bp->sap_tmp_order || !bp->sap_tmp) {
+        broadphase_destroy(bp);
+        return NULL;
+    }
+
+    broadphase_interact(bp, LAYER_BULLET, LAYER_ENEMY);
+    broadphase_interact(bp, LAYER_PLAYER, LAYER_ENEMY);
+    broadphase_interact(bp, LAYER_PLAYER, LAYER_ENEMY_BULLET);
+    broadphase_interact(bp, LAYER_PLAYER, LAYER_PICKUP);
+    return bp;
+}
+
+void broadphase_destroy(Broadphase *bp) {
+    if (!bp) return;
+
+    free(bp->pairs);
+    free(bp->bullet_ranges);
+    free(bp->bullet_range_ids);
+    free(bp->bullet_hits);
+    query_batch_scratch_destroy(&bp->batch);
+    free(bp->sap);
+    free(bp->sap_next);
+    free(bp->sap_node_entry);
+    free(bp->sap_keys);
+    free(bp->sap_tmp_keys);
+    free(bp->sap_order);
+    free(bp->sap_tmp_order);
+    free(bp->sap_tmp);
+    free(bp);
+}
+
+void broadphase_interact(Broadphase *bp, CollisionLayer a, CollisionLayer b) {
+    bp->masks[__builtin_ctz(a)] |= b;
+    bp->masks[__builtin_ctz(b)] |= a;
+}
+
+bool broadphase_is_pair(Broadphase *bp, CollisionLayer a, CollisionLayer b) {
+    return (bp->masks[__builtin_ctz(a)] & b) != 0;
+}
+
+int broadphase_find_pairs(Broadphase *bp) {
+    bp->num_pairs = 0;
+
+    if (broadphase_is_pair(bp, LAYER_BULLET, LAYER_ENEMY)) {
+        bp->limit = bp->num_pairs + MAX_BULLET_HITS;
+        index_stats_begin(SITE_BULLETS);
+        _broadphase_bullet_enemy(bp);
+        index_stats_end();
+    }
+    if (broadphase_is_pair(bp, LAYER_PLAYER, LAYER_ENEMY)) {
+        bp->limit = bp->num_pairs + MAX_PLAYER_CONTACTS;
+        index_stats_begin(SITE_PLAYER_HURT);
+        _broadphase_player_enemy(bp);
+        index_stats_end();
+    }
+    if (broadphase_is_pair(bp, LAYER_PLAYER, LAYER_ENEMY_BULLET)) {
+        bp->limit = bp->num_pairs + MAX_ENEMY_BULLETS;
+        _broadphase_player_enemy_bullet(bp);
+    }
+    if (broadphase_is_pair(bp, LAYER_PLAYER, LAYER_PICKUP)) {
+        // whatever doesn't fit is grabbed on the next tick
+        bp->limit = bp->num_pairs + MAX_PICKUP_GRABS;
+        index_stats_begin(SITE_PICKUPS);
+        _broadphase_player_pickup(bp);
+        index_stats_end();
+    }
+    return bp->num_pairs;
+}
+
+// false once the running generator is out of room
+bool _broadphase_push(Broadphase *bp, CollisionLayer layer_a, int a, CollisionLayer layer_b, QPoint b) {
+    if (bp->num_pairs >= bp->limit)
+        return false;
+    bp->pairs[bp->num_pairs] = (CollisionPair) { layer_a, a, layer_b, b };
+    bp->num_pairs += 1;
+    return bp->num_pairs < bp->limit;
+}
+
+bool _visit_collect_pair(QPoint pt, void *ctx) {
+    PairCollector *collector = ctx;
+    return _broadphase_push(collector->bp, collector->layer_a, collector->a, collector->layer_b, pt);
+}
+
+/**
+ * Bullets vs enemies has two generators. The batched index query descends the enemy index
+ * once per bullet, while the sweep sorts enemies and bullets along x and walks them once.
+ * The sweep costs O(enemies) however few bullets there are, so it only pays off once the
+ * splinters and orbs are a good share of the enemy count, see SAP_MIN_BULLETS.
+ */
+void _broadphase_bullet_enemy(Broadphase *bp) {
+    int num_live = 0;
+    for (int i = 0; i < state->bullet_count; i++) {
+        Bullet *bullet = &state->bullets[i];
+        if (bullet->strength > 0 && bullet->penetration > 0) {
+            num_live += 1;
+        }
+    }
+
+    if (_broadphase_use_sap(num_live, state->enemy_count)) {
+        _broadphase_sweep(bp);
+        return;
+    }
+    bp->is_sap_coherent = false;
+
+    // One batched query for all the live bullets, hits come back as (bullet range, enemy) pairs
+    int num_ranges = 0;
+    for (int i = 0; i < state->bullet_count; i++) {
+        Bullet *bullet = &state->bullets[i];
+        if (bullet->strength <= 0 || bullet->penetration <= 0) {
+            continue;
+        }
+        bp->bullet_ranges[num_ranges] = _broadphase_bullet_range(bullet);
+        bp->bullet_range_ids[num_ranges] = i;
+        num_ranges += 1;
+    }
+
+    int num_hits = index_query_batch(
+        state->enemy_index,
+        bp->bullet_ranges, num_ranges,
+        bp->bullet_hits, bp->limit - bp->num_pairs,
+        &bp->batch
+    );
+    for (int h = 0; h < num_hits; h++) {
+        QueryPair hit = bp->bullet_hits[h];
+        _broadphase_push(bp, LAYER_BULLET, bp->bullet_range_ids[hit.range], LAYER_ENEMY, hit.pt);
+    }
+}
+
+QRect _broadphase_bullet_range(Bullet *bullet) {
+    int bullet_size = 5;
+
+    if (bullet->type == ORBS) {
+        bullet_size = state->stats.orbs_size;
+    }
+
+    return (QRect) {
+        bullet->pos.x - 2.5f,
+        bullet->pos.y - 2.5f,
+        bullet_size, bullet_size
+    };
+}
+
+bool _broadphase_use_sap(int num_bullets, int num_enemies) {
+    return num_bullets >= SAP_MIN_BULLETS && num_bullets * SAP_ENEMIES_PER_BULLET >= num_enemies;
+}
+
+void _broadphase_sweep(Broadphase *bp) {
+    _broadphase_sap_order(bp);
+    _broadphase_sap_sort(bp);
+    bp->is_sap_coherent = true;
+
+    for (int band = 0; band < SAP_NUM_BANDS; band++) {
+        bp->sap_bullet_bands[band] = -1;
+        bp->sap_enemy_bands[band] = -1;
+    }
+
+    // Each pair is found once, by whichever of the two starts later along x
+    int num_nodes = 0;
+    int num_tests = 0;
+    for (int i = 0; i < bp->num_sap && bp->num_pairs < bp->limit; i++) {
+        SapEntry *entry = &bp->sap[i];
+        if (!entry->is_live) {
+            continue;
+        }
+
+        bool is_bullet = entry->ref < 0;
+        int *others = is_bullet ? bp->sap_enemy_bands : bp->sap_bullet_bands;
+        int *own = is_bullet ? bp->sap_bullet_bands : bp->sap_enemy_bands;
+        int first = (int) floorf(entry->min_y / bp->sap_band_height);
+        int last = (int) floorf(entry->max_y / bp->sap_band_height);
+        for (int band = first; band <= last; band++) {
+            int slot = band & (SAP_NUM_BANDS - 1);
+            num_tests += _broadphase_sap_band(bp, &others[slot], entry);
+
+            bp->sap_node_entry[num_nodes] = i;
+            bp->sap_next[num_nodes] = own[slot];
+            own[slot] = num_nodes;
+            num_nodes += 1;
+        }
+    }
+    index_stats_count(1, 0, num_tests);
+}
+
+// Tests the entry against one band of the other side, unlinking the ones the sweep has passed
+int _broadphase_sap_band(Broadphase *bp, int *head, SapEntry *entry) {
+    int num_tests = 0;
+    int *link = head;
+    while (*link >= 0) {
+        int node = *link;
+        SapEntry *other = &bp->sap[bp->sap_node_entry[node]];
+        if (other->max_x < entry->min_x) {
+            *link = bp->sap_next[node];
+            continue;
+        }
+
+        if (entry->ref < 0) {
+            _broadphase_sap_test(bp, entry, other);
+        } else {
+            _broadphase_sap_test(bp, other, entry);
+        }
+        num_tests += 1;
+        link = &bp->sap_next[node];
+    }
+    return num_tests;
+}
+
+// Refreshes the entries in the order of the last sweep, enemies and bullets added since go at the end
+void _broadphase_sap_order(Broadphase *bp) {
+    int num_enemies = state->enemy_count;
+    int num_bullets = state->bullet_count;
+
+    int n = 0;
+    int first_enemy = 0;
+    int first_bullet = 0;
+    if (bp->is_sap_coherent) {
+        // ids past the counts are gone, swap removes moved the last ones into the holes
+        for (int i = 0; i < bp->num_sap; i++) {
+            int ref = bp->sap[i].ref;
+            bool is_kept = ref >= 0 ? ref < num_enemies : -ref - 1 < num_bullets;
+            if (is_kept) {
+                bp->sap[n].ref = ref;
+                n++;
+            }
+        }
+        first_enemy = bp->sap_num_enemies;
+        first_bullet = bp->sap_num_bullets;
+    }
+    for (int i = first_enemy; i < num_enemies; i++) {
+        bp->sap[n].ref = i;
+        n++;
+    }
+    for (int i = first_bullet; i < num_bullets; i++) {
+        bp->sap[n].ref = -(i + 1);
+        n++;
+    }
+    bp->num_sap = n;
+    bp->sap_num_enemies = num_enemies;
+    bp->sap_num_bullets = num_bullets;
+
+    float tallest = 0;
+    for (int i = 0; i < n; i++) {
+        SapEntry *entry = &bp->sap[i];
+        if (entry->ref >= 0) {
+            Vec2 pos = enemy_pos(entry->ref);
+            entry->min_x = entry->max_x = pos.x;
+            entry->min_y = entry->max_y = pos.y;
+            entry->is_live = true;
+        } else {
+            Bullet *bullet = &state->bullets[-entry->ref - 1];
+            QRect range = _broadphase_bullet_range(bullet);
+            entry->min_x = range.x - range.w;
+            entry->max_x = range.x + range.w;
+            entry->min_y = range.y - range.h;
+            entry->max_y = range.y + range.h;
+            entry->is_live = bullet->strength > 0 && bullet->penetration > 0;
+            tallest = fmaxf(tallest, entry->max_y - entry->min_y);
+        }
+    }
+    // a little over the tallest so float rounding can't spread one over three bands
+    bp->sap_band_height = fmaxf(SAP_MIN_BAND_HEIGHT, tallest + 1);
+}
+
+/**
+ * Things only moved a little since the last sweep, so an insertion sort is close to O(n).
+ * A burst of spawns at the end or an order gone stale can't be fixed cheaply like that,
+ * past a few shifts per entry it gives up and radix sorts everything instead.
+ */
+void _broadphase_sap_sort(Broadphase *bp) {
+    SapEntry *sap = bp->sap;
+    int n = bp->num_sap;
+    long budget = 4L * n + 1024;
+    long num_shifts = 0;
+    for (int i = 1; i < n; i++) {
+        SapEntry entry = sap[i];
+        int j = i;
+        while (j > 0 && sap[j - 1].min_x > entry.min_x) {
+            sap[j] = sap[j - 1];
+            j--;
+            num_shifts++;
+            if (num_shifts > budget)
+                break;
+        }
+        sap[j] = entry;
+        if (num_shifts > budget)
+            break;
+    }
+    if (num_shifts <= budget)
+        return;
+
+    // float bits made to sort as unsigned, negatives flipped whole and positives get the sign bit
+    for (int i = 0; i < n; i++) {
+        unsigned int bits;
+        memcpy(&bits, &sap[i].min_x, sizeof(bits));
+        bp->sap_keys[i] = bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+        bp->sap_order[i] = i;
+    }
+    _index_radix_sort(bp->sap_keys, bp->sap_order, n, bp->sap_tmp_keys, bp->sap_tmp_order);
+    for (int i = 0; i < n; i++) {
+        bp->sap_tmp[i] = sap[bp->sap_order[i]];
+    }
+    bp->sap = bp->sap_tmp;
+    bp->sap_tmp = sap;
+}
+
+void _broadphase_sap_test(Broadphase *bp, SapEntry *bullet, SapEntry *enemy) {
+    if (enemy->min_y < bullet->min_y || enemy->min_y > bullet->max_y)
+        return;
+    // same bounds test as the index, an enemy on the edge counts
+    if (enemy->min_x < bullet->min_x || enemy->min_x > bullet->max_x)
+        return;
+    QPoint pt = { enemy->min_x, enemy->min_y, enemy->ref };
+    _broadphase_push(bp, LAYER_BULLET, -bullet->ref - 1, LAYER_ENEMY, pt);
+}
+
+void _broadphase_player_enemy(Broadphase *bp) {
+    PairCollector collector = { bp, LAYER_PLAYER, 0, LAYER_ENEMY };
+    neighbours_visit(
+        &state->player_neighbours,
+        state->enemy_index,
+        (QRect) {
+            state->player_pos.x,
+            state->player_pos.y,
+            10, 10
+        },
+        _visit_collect_pair, &collector
+    );
+}
+
+// There's only the one player, a scan of the enemy bullets is all it takes
+void _broadphase_player_enemy_bullet(Broadphase *bp) {
+    QRect range = { state->player_pos.x, state->player_pos.y, 10, 10 };
+    for (int i = 0; i < state->enemy_bullet_count; i++) {
+        Bullet *b = &state->enemy_bullets[i];
+        if (b->penetration <= 0) {
+            continue;
+        }
+        QPoint pt = { b->pos.x, b->pos.y, i };
+        if (!is_rect_contains_point(range, pt)) {
+            continue;
+        }
+        if (!_broadphase_push(bp, LAYER_PLAYER, 0, LAYER_ENEMY_BULLET, pt)) {
+            break;
+        }
+    }
+}
+
+void _broadphase_player_pickup(Broadphase *bp) {
+    PairCollector collector = { bp, LAYER_PLAYER, 0, LAYER_PICKUP };
+    static_grid_visit(
+        state->pickups_grid,
+        (QRect) {
+            state->player_pos.x,
+            state->player_pos.y,
+            PICKUP_GRAB_RADIUS,
+            PICKUP_GRAB_RADIUS
+        },
+        _visit_collect_pair, &collector
+    );
+}
+
+// MARK: :neighbours
+/**
+ * Hurt, targeting, flame and frost all ask the enemy index about the same few enemies
+ * around the player. They're gathered once a tick out to the largest of those radii and
+ * sorted by distance, each system then only looks at the prefix its own radius needs.
+ *
+ * Ids are only stable until the next dead enemy cleanup, so the gather runs right after it.
+ * Systems running after the enemies moved (hurt, next tick's targeting) widen their prefix
+ * by NEIGHBOUR_SLACK and re-check the current positions. Anything the cache can't answer,
+ * a range reaching past it or the player having moved too far, goes to the index as before.
+ * Enemies spawned during the tick (pups) only show up at the next gather.
+ */
+
+bool neighbours_init(NeighbourCache *cache, int capacity) {
+    *cache = (NeighbourCache) {
+        .ids = malloc(capacity * sizeof(int)),
+        .dist_sqrs = malloc(capacity * sizeof(float)),
+        .keys = malloc(capacity * sizeof(unsigned int)),
+        .tmp_keys = malloc(capacity * sizeof(unsigned int)),
+        .tmp_ids = malloc(capacity * sizeof(int)),
+        .num_enemies = 0,
+        .is_valid = false
+    };
+    if (!cache->ids || !cache->dist_sqrs || !cache->keys || !cache->tmp_keys || !cache->tmp_ids) {
+        neighbours_destroy(cache);
+        return false;
+    }
+    return true;
+}
+
+void neighbours_destroy(NeighbourCache *cache) {
+    free(cache->ids);
+    free(cache->dist_sqrs);
+    free(cache->keys);
+    free(cache->tmp_keys);
+    free(cache->tmp_ids);
+    *cache = (NeighbourCache) { 0 };
+}
+
+void neighbours_gather(NeighbourCache *cache, SpatialIndex *index, Vec2 pos, float radius) {
+    if (!cache->ids)
+        return;
+
+    cache->pos = pos;
+    cache->radius = radius;
+    cache->num_enemies = 0;
+    QShape circle = shape_circle(pos, radius);
+    index_visit_shape(index, &circle, _visit_neighbour, cache);
+
+    // squared distances are non negative, their bits sort the same as the floats
+    _index_radix_sort(cache->keys, cache->ids, cache->num_enemies, cache->tmp_keys, cache->tmp_ids);
+    for (int i = 0; i < cache->num_enemies; i++) {
+        memcpy(&cache->dist_sqrs[i], &cache->keys[i], sizeof(float));
+    }
+    cache->is_valid = true;
+}
+
+bool _visit_neighbour(QPoint pt, void *ctx) {
+    NeighbourCache *cache = ctx;
+    float dx = pt.x - cache->pos.x;
+    float dy = pt.y - cache->pos.y;
+    float dist_sqr = dx * dx + dy * dy;
+    memcpy(&cache->keys[cache->num_enemies], &dist_sqr, sizeof(float));
+    cache->ids[cache->num_enemies] = pt.id;
+    cache->num_enemies += 1;
+    return true;
+}
+
+// How many of the nearest entries can be within radius of pos by now, -1 when the cache can't tell
+int neighbours_prefix(NeighbourCache *cache, Vec2 pos, float radius) {
+    if (!cache->is_valid)
+        return -1;
+
+    float reach = radius + Vector2Distance(pos, cache->pos) + NEIGHBOUR_SLACK;
+    if (reach > cache->radius)
+        return -1;
+
+    // first entry past reach
+    float reach_sqr = reach * reach;
+    int lo = 0;
+    int hi = cache->num_enemies;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cache->dist_sqrs[mid] <= reach_sqr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    index_stats_count(1, 0, lo);
+    return lo;
+}
+
+void neighbours_visit(NeighbourCache *cache, SpatialIndex *index, QRect range, QueryVisitor visit, void *ctx) {
+    int n = neighbours_prefix(cache, (Vec2) { range.x, range.y }, sqrtf(range.w * range.w + range.h * range.h));
+    if (n < 0) {
+        index_visit(index, range, visit, ctx);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        Vec2 pos = enemy_pos(cache->ids[i]);
+        QPoint pt = { pos.x, pos.y, cache->ids[i] };
+        if (!is_rect_contains_point(range, pt))
+            continue;
+        if (!visit(pt, ctx))
+            return;
+    }
+}
+
+void neighbours_visit_shape(NeighbourCache *cache, SpatialIndex *index, QShape *shape, QueryVisitor visit, void *ctx) {
+    // circles and cones are within their radius of the center, segments within their box
+    Vec2 center = shape->center;
+    float radius = shape->radius;
+    if (shape->type == SHAPE_SEGMENT) {
+        QRect bounds = shape->bounds;
+        center = (Vec2) { bounds.x, bounds.y };
+        radius = sqrtf(bounds.w * bounds.w + bounds.h * bounds.h);
+    }
+    int n = neighbours_prefix(cache, center, radius);
+    if (n < 0) {
+        index_visit_shape(index, shape, visit, ctx);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        Vec2 pos = enemy_pos(cache->ids[i]);
+        QPoint pt = { pos.x, pos.y, cache->ids[i] };
+        if (!is_shape_contains_point(shape, pt))
+            continue;
+        if (!visit(pt, ctx))
+            return;
+    }
+}
+
+// Same results as index_k_nearest, ranked by the current positions
+int neighbours_k_nearest(NeighbourCache *cache, SpatialIndex *index, Vec2 pos, float max_dist, int k, QPoint *result) {
+    if (k > MAX_NEAREST) k = MAX_NEAREST;
+    if (k <= 0)
+        return 0;
+    int n = neighbours_prefix(cache, pos, max_dist);
+    if (n < 0)
+        return index_k_nearest(index, pos, max_dist, k, result);
+
+    float dists[MAX_NEAREST];
+    int num_points = 0;
+    for (int i = 0; i < n; i++) {
+        Vec2 other = enemy_pos(cache->ids[i]);
+        float dist = Vector2Distance(pos, other);
+        if (dist > max_dist)
+            continue;
+        QPoint pt = { other.x, other.y, cache->ids[i] };
+        _index_push_nearest(result, dists, &num_points, k, pt, dist);
+    }
+    return num_points;
+}
+
+// Largest radius of the systems that will use the cache before the next gather, plus the slack.
+// Only the active ones count. Most ticks it's just hurt, that's 0 as the gather would only
+// cost more than hurt's own query then
+float get_player_neighbours_radius() {
+    int now = get_current_time_millis();
+    // hurt is a 10x10 box
+    float radius = sqrtf(10 * 10 + 10 * 10);
+    int num_users = 1;
+    // the gun fires on the next tick
+    if (now + GetFrameTime() * 1000 - state->timer.bullet_ts > state->stats.bullet_interval) {
+        radius = fmaxf(radius, GUN_VISION);
+        num_users += 1;
+    }
+    if (now - state->timer.frost_wave_ts < state->stats.frost_wave_lifetime) {
+        radius = fmaxf(radius, 50);
+        num_users += 1;
+    }
+    if (now - state->timer.flame_ts < state->stats.flame_lifetime) {
+        float flame_range = (state->stats.flame_distance * (PARTICLE_LIFETIME / 1000.0f)) + 10;
+        radius = fmaxf(radius, flame_range);
+        num_users += 1;
+    }
+    if (num_users < 2)
+        return 0;
+    return radius + 2 * NEIGHBOUR_SLACK;
+}
+
+// MARK: :index :spatial
+/**
+ * Common interface over the spatial structures,
+ * all gameplay code goes through these so the enemy backend can be swapped at startup
+ * and all of them can be benchmarked against the same scenario.
+ */
+
+SpatialIndex *index_create(SpatialIndexType type, QRect boundary, int capacity) {
+    SpatialIndex *index = malloc(sizeof(SpatialIndex));
+    if (!index) return NULL;
+
+    *index = (SpatialIndex) {
+        .type = type,
+        .boundary = boundary,
+        .qtree = NULL,
+        .grid = NULL,
+        .linear = NULL,
+        .far = NULL,
+        .build = NULL,
+        .build_points = malloc(sizeof(QPoint) * capacity),
+        .capacity = capacity
+    };
+
+    switch (type) {
+        case INDEX_QTREE:
+            index->qtree = qtree_create(boundary, capacity);
+            index->far = grid_create(INDEX_FAR_CELL_SIZE, capacity);
+            break;
+        case INDEX_GRID:
+            // hashed, it already covers every position
+            index->grid = grid_create(GRID_CELL_SIZE, capacity);
+            break;
+        case INDEX_LINEAR:
+            index->linear = ltree_create(boundary, capacity);
+            index->far = grid_create(INDEX_FAR_CELL_SIZE, capacity);
+            break;
+    }
+
+    bool is_far_missing = type != INDEX_GRID && !index->far;
+    if ((!index->qtree && !index->grid && !index->linear) || is_far_missing || !index->build_points) {
+        index_destroy(index);
+        return NULL;
+    }
+    return index;
+}
+
+void index_destroy(SpatialIndex *index) {
+    if (!index) return;
+
+    qtree_destroy(index->qtree);
+    grid_destroy(index->grid);
+    ltree_destroy(index->linear);
+    grid_destroy(index->far);
+    qtree_build_destroy(index->build);
+    free(index->build_points);
+    free(index);
+}
+
+void index_clear(SpatialIndex *index) {
+    switch (index->type) {
+        case INDEX_QTREE:
+            qtree_clear(index->qtree);
+            break;
+        case INDEX_GRID:
+            grid_clear(index->grid);
+            break;
+        case INDEX_LINEAR:
+            ltree_clear(index->linear);
+            break;
+    }
+    if (index->far) {
+        grid_clear(index->far);
+    }
+}
+
+void index_reset_boundary(SpatialIndex *index, QRect rect) {
+    index->boundary = rect;
+
+    switch (index->type) {
+        case INDEX_QTREE:
+            qtree_reset_boundary(index->qtree, rect);
+            break;
+        case INDEX_GRID:
+            // the grid is hashed, it covers any position and has no boundary to move
+            break;
+        case INDEX_LINEAR:
+            ltree_reset_boundary(index->linear, rect);
+            break;
+    }
+}
+
+/**
+ * The trees only cover their boundary (the area around the view), every point outside it
+ * goes in the coarse far tier instead, so enemies off screen still collide and separate.
+ * Points move between the tiers as they cross the boundary, queries that reach past the
+ * boundary also walk the far tier.
+ */
+bool index_insert(SpatialIndex *index, QPoint pt) {
+    bool is_inserted = false;
+    switch (index->type) {
+        case INDEX_QTREE:
+            is_inserted = qtree_insert(index->qtree, pt);
+            break;
+        case INDEX_GRID:
+            return grid_insert(index->grid, pt);
+        case INDEX_LINEAR:
+            is_inserted = ltree_insert(index->linear, pt);
+            break;
+    }
+    return is_inserted || grid_insert(index->far, pt);
+}
+
+bool index_update(SpatialIndex *index, QPoint pt) {
+    // false once the point is outside the boundary, the tree drops it then
+    bool is_near = false;
+    switch (index->type) {
+        case INDEX_QTREE:
+            is_near = qtree_update(index->qtree, pt);
+            break;
+        case INDEX_GRID:
+            return grid_update(index->grid, pt);
+        case INDEX_LINEAR:
+            is_near = ltree_update(index->linear, pt);
+            break;
+    }
+
+    if (is_near) {
+        grid_remove_id(index->far, pt.id);
+        return true;
+    }
+    return grid_update(index->far, pt);
+}
+
+bool index_remove_id(SpatialIndex *index, int id) {
+    bool is_removed = false;
+    switch (index->type) {
+        case INDEX_QTREE:
+            is_removed = qtree_remove_id(index->qtree, id);
+            break;
+        case INDEX_GRID:
+            return grid_remove_id(index->grid, id);
+        case INDEX_LINEAR:
+            is_removed = ltree_remove_id(index->linear, id);
+            break;
+    }
+    return is_removed || grid_remove_id(index->far, id);
+}
+
+void index_sync(SpatialIndex *index) {
+    switch (index->type) {
+        case INDEX_QTREE:
+            // updates are applied in place
+            break;
+        case INDEX_GRID:
+            grid_build(index->grid);
+            break;
+        case INDEX_LINEAR:
+            ltree_build(index->linear);
+            break;
+    }
+    if (index->far) {
+        grid_build(index->far);
+    }
+}
+
+/**
+ * Empties the index and loads all the points at once.
+ * Big qtree builds are split over the job pool, the rest insert one by one and sync.
+ */
+void index_build(SpatialIndex *index, QPoint *points, int num_points, JobPool *jobs) {
+    if (index->type == INDEX_QTREE && num_points >= QTREE_BUILD_MIN_POINTS) {
+        if (!index->build) {
+            index->build = qtree_build_create();
+        }
+
+        QPoint *outside = NULL;
+        int num_outside = index->build
+            ? qtree_build(index->qtree, index->build, points, num_points, jobs, &outside)
+            : -1;
+        if (num_outside >= 0) {
+            grid_clear(index->far);
+            for (int i = 0; i < num_outside; i++) {
+                grid_insert(index->far, outside[i]);
+            }
+            index_sync(index);
+            return;
+        }
+        // out of memory for the scratch, one by one still works
+    }
+
+    index_clear(index);
+    for (int i = 0; i < num_points; i++) {
+        index_insert(index, points[i]);
+    }
+    index_sync(index);
+}
+
+// Only a range that pokes out of the boundary can find anything in the far tier
+bool _index_is_far(SpatialIndex *index, QRect range) {
+    return index->far && index->far->num_points > 0 && !is_rect_contains_rect(index->boundary, range);
+}
+
+void index_visit(SpatialIndex *index, QRect range, QueryVisitor visit, void *ctx) {
+    index_stats_count(1, 0, 0);
+    bool is_done = true;
+    switch (index->type) {
+        case INDEX_QTREE:
+            is_done = qtree_visit(index->qtree, range, visit, ctx);
+            break;
+        case INDEX_GRID:
+            grid_visit(index->grid, range, visit, ctx);
+            return;
+        case INDEX_LINEAR:
+            is_done = ltree_visit(index->linear, range, visit, ctx);
+            break;
+    }
+    if (is_done && _index_is_far(index, range)) {
+        grid_visit(index->far, range, visit, ctx);
+    }
+}
+
+void index_visit_shape(SpatialIndex *index, QShape *shape, QueryVisitor visit, void *ctx) {
+    index_stats_count(1, 0, 0);
+    bool is_done = true;
+    switch (index->type) {
+        case INDEX_QTREE:
+            is_done = qtree_visit_shape(index->qtree, shape, visit, ctx);
+            break;
+        case INDEX_GRID:
+            grid_visit_shape(index->grid, shape, visit, ctx);
+            return;
+        case INDEX_LINEAR:
+            is_done = ltree_visit_shape(index->linear, shape, visit, ctx);
+            break;
+    }
+    if (is_done && _index_is_far(index, shape->bounds)) {
+        grid_visit_shape(index->far, shape, visit, ctx);
+    }
+}
+
+// Copies up to max_points into the caller's buffer, returns how many were found
+int index_query(SpatialIndex *index, QRect range, QPoint *result, int max_points) {
+    QueryBuffer buffer = { result, 0, max_points };
+    if (max_points > 0) {
+        index_visit(index, range, _index_collect, &buffer);
+    }
+    return buffer.num_points;
+}
+
+int index_query_shape(SpatialIndex *index, QShape *shape, QPoint *result, int max_points) {
+    QueryBuffer buffer = { result, 0, max_points };
+    if (max_points > 0) {
+        index_visit_shape(index, shape, _index_collect, &buffer);
+    }
+    return buffer.num_points;
+}
+
+bool _index_collect(QPoint pt, void *ctx) {
+    QueryBuffer *buffer = ctx;
+    buffer->points[buffer->num_points] = pt;
+    buffer->num_points += 1;
+    return buffer->num_points < buffer->capacity;
+}
+
+QShape shape_circle(Vec2 center, float radius) {
+    return (QShape) {
+        .type = SHAPE_CIRCLE,
+        .bounds = { center.x, center.y, radius, radius },
+        .center = center,
+        .radius = radius,
+        .radius_sqr = radius * radius
+    };
+}
+
+// Segment with a thickness, radius is how far off the line a point can be and still hit
+QShape shape_segment(Vec2 start, Vec2 end, float radius) {
+    float length = Vector2Distance(start, end);
+    Vec2 dir = length > 0 ? Vector2Scale(Vector2Subtract(end, start), 1.0f / length) : (Vec2) { 1, 0 };
+    Vec2 center = get_line_center(start, end);
+
+    return (QShape) {
+        .type = SHAPE_SEGMENT,
+        .bounds = {
+            center.x, center.y,
+            fabsf(end.x - start.x) / 2 + radius,
+            fabsf(end.y - start.y) / 2 + radius
+        },
+        .center = start,
+        .radius = radius,
+        .radius_sqr = radius * radius,
+        .dir = dir,
+        .inv_dir = { dir.x != 0 ? 1.0f / dir.x : 0, dir.y != 0 ? 1.0f / dir.y : 0 },
+        .length = length
+    };
+}
+
+// Circular sector around dir, spread is the half angle in degrees like rotate_vector takes
+QShape shape_cone(Vec2 origin, Vec2 dir, float range, float spread) {
+    if (spread >= 180) {
+        return shape_circle(origin, range);
+    }
+
+    dir = Vector2Normalize(dir);
+    Vec2 left = rotate_vector(dir, -spread);
+    Vec2 right = rotate_vector(dir, spread);
+    // both normals point into the cone
+    Vec2 left_normal = { -left.y, left.x };
+    Vec2 right_normal = { right.y, -right.x };
+
+    QShape shape = {
+        .type = SHAPE_CONE,
+        .center = origin,
+        .radius = range,
+        .radius_sqr = range * range,
+        .left_normal = left_normal,
+        .right_normal = right_normal,
+        .left_offset = Vector2DotProduct(left_normal, origin),
+        .right_offset = Vector2DotProduct(right_normal, origin),
+        .is_wide = spread > 90
+    };
+
+    // Bounding box of the tip, the two edge ends and any axis extreme that lies on the arc
+    Vec2 corners[7] = {
+        origin,
+        point_at_dist(origin, left, range),
+        point_at_dist(origin, right, range),
+    };
+    int num_corners = 3;
+    Vec2 axes[4] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+    for (int i = 0; i < 4; i++) {
+        // tested halfway out, right on the arc rounding can put it past the radius
+        Vec2 inside = point_at_dist(origin, axes[i], range / 2);
+        if (is_shape_contains_point(&shape, (QPoint) { inside.x, inside.y, -1 })) {
+            corners[num_corners++] = point_at_dist(origin, axes[i], range);
+        }
+    }
+
+    Vec2 min = corners[0];
+    Vec2 max = corners[0];
+    for (int i = 1; i < num_corners; i++) {
+        min = (Vec2) { fminf(min.x, corners[i].x), fminf(min.y, corners[i].y) };
+        max = (Vec2) { fmaxf(max.x, corners[i].x), fmaxf(max.y, corners[i].y) };
+    }
+    shape.bounds = (QRect) {
+        (min.x + max.x) / 2, (min.y + max.y) / 2,
+        (max.x - min.x) / 2, (max.y - min.y) / 2
+    };
+    return shape;
+}
+
+bool is_shape_contains_point(QShape *shape, QPoint pt) {
+    float dx = pt.x - shape->center.x;
+    float dy = pt.y - shape->center.y;
+
+    switch (shape->type) {
+        case SHAPE_CIRCLE:
+            return dx * dx + dy * dy <= shape->radius_sqr;
+        case SHAPE_SEGMENT: {
+            // offset from the closest point on the segment
+            float t = Clamp(dx * shape->dir.x + dy * shape->dir.y, 0, shape->length);
+            float ox = dx - shape->dir.x * t;
+            float oy = dy - shape->dir.y * t;
+            return ox * ox + oy * oy <= shape->radius_sqr;
+        }
+        case SHAPE_CONE: {
+            if (dx * dx + dy * dy > shape->radius_sqr)
+                return false;
+
+            bool in_left = shape->left_normal.x * pt.x + shape->left_normal.y * pt.y >= shape->left_offset;
+            bool in_right = shape->right_normal.x * pt.x + shape->right_normal.y * pt.y >= shape->right_offset;
+            return shape->is_wide ? in_left || in_right : in_left && in_right;
+        }
+    }
+    return false;
+}
+
+// Conservative, can say yes for a rect that only touches the shape's bounding area
+bool is_shape_overlap_rect(QShape *shape, QRect rect) {
+    if (!is_rect_overlap(shape->bounds, rect))
+        return false;
+
+    if (shape->type == SHAPE_SEGMENT) {
+        float t_enter;
+        return _shape_segment_entry(shape, rect, &t_enter);
+    }
+
+    float dx = fmaxf(fabsf(shape->center.x - rect.x) - rect.w, 0);
+    float dy = fmaxf(fabsf(shape->center.y - rect.y) - rect.h, 0);
+    if (dx * dx + dy * dy > shape->radius_sqr)
+        return false;
+
+    switch (shape->type) {
+        case SHAPE_CIRCLE:
+        case SHAPE_SEGMENT:
+            return true;
+        case SHAPE_CONE: {
+            // furthest the rect reaches into each half plane
+            float left = shape->left_normal.x * rect.x + shape->left_normal.y * rect.y
+                + fabsf(shape->left_normal.x) * rect.w + fabsf(shape->left_normal.y) * rect.h;
+            float right = shape->right_normal.x * rect.x + shape->right_normal.y * rect.y
+                + fabsf(shape->right_normal.x) * rect.w + fabsf(shape->right_normal.y) * rect.h;
+            bool in_left = left >= shape->left_offset;
+            bool in_right = right >= shape->right_offset;
+            return shape->is_wide ? in_left || in_right : in_left && in_right;
+        }
+    }
+    return false;
+}
+
+/**
+ * Slab test of the segment against the rect grown by the segment radius.
+ * t_enter is how far along the segment it enters the rect, 0 when it starts inside.
+ */
+bool _shape_segment_entry(QShape *segment, QRect rect, float *t_enter) {
+    float t0 = 0;
+    float t1 = segment->length;
+    float w = rect.w + segment->radius;
+    float h = rect.h + segment->radius;
+
+    if (segment->inv_dir.x == 0) {
+        if (fabsf(segment->center.x - rect.x) > w) return false;
+    } else {
+        float a = (rect.x - w - segment->center.x) * segment->inv_dir.x;
+        float b = (rect.x + w - segment->center.x) * segment->inv_dir.x;
+        t0 = fmaxf(t0, fminf(a, b));
+        t1 = fminf(t1, fmaxf(a, b));
+    }
+
+    if (segment->inv_dir.y == 0) {
+        if (fabsf(segment->center.y - rect.y) > h) return false;
+    } else {
+        float a = (rect.y - h - segment->center.y) * segment->inv_dir.y;
+        float b = (rect.y + h - segment->center.y) * segment->inv_dir.y;
+        t0 = fmaxf(t0, fminf(a, b));
+        t1 = fminf(t1, fmaxf(a, b));
+    }
+
+    *t_enter = t0;
+    return t0 <= t1;
+}
+
+/**
+ * Points within segment->radius of the segment, ordered by how far along the segment they are.
+ * The backends only visit the nodes / cells the segment passes through and hand back the hits
+ * roughly front to back, so the final insertion sort barely moves anything
+ * and a full buffer mostly drops the far end of the segment.
+ */
+int index_query_segment(SpatialIndex *index, QShape *segment, QPoint *result, int max_points) {
+    if (max_points <= 0)
+        return 0;
+
+    index_stats_count(1, 0, 0);
+    QueryBuffer buffer = { result, 0, max_points };
+    switch (index->type) {
+        case INDEX_QTREE:
+            qtree_visit_segment(index->qtree, segment, _index_collect, &buffer);
+            break;
+        case INDEX_GRID:
+            grid_visit_segment(index->grid, segment, _index_collect, &buffer);
+            break;
+        case INDEX_LINEAR:
+            ltree_visit_segment(index->linear, segment, _index_collect, &buffer);
+            break;
+    }
+    if (buffer.num_points < max_points && _index_is_far(index, segment->bounds)) {
+        grid_visit_segment(index->far, segment, _index_collect, &buffer);
+    }
+
+    for (int i = 1; i < buffer.num_points; i++) {
+        QPoint pt = result[i];
+        float t = (pt.x - segment->center.x) * segment->dir.x + (pt.y - segment->center.y) * segment->dir.y;
+        int j = i;
+        while (j > 0) {
+            QPoint prev = result[j - 1];
+            float prev_t = (prev.x - segment->center.x) * segment->dir.x + (prev.y - segment->center.y) * segment->dir.y;
+            if (prev_t <= t)
+                break;
+            result[j] = prev;
+            j--;
+        }
+        result[j] = pt;
+    }
+    return buffer.num_points;
+}
+
+bool query_batch_scratch_init(QueryBatchScratch *scratch, int capacity) {
+    *scratch = (QueryBatchScratch) {
+        .order = malloc(capacity * (QTREE_MAX_DEPTH + 2) * sizeof(int)),
+        .codes = malloc(capacity * 2 * sizeof(unsigned int)),
+        .tmp_order = malloc(capacity * sizeof(int)),
+        .capacity = capacity
+    };
+    if (!scratch->order || !scratch->codes || !scratch->tmp_order) {
+        query_batch_scratch_destroy(scratch);
+        return false;
+    }
+    return true;
+}
+
+void query_batch_scratch_destroy(QueryBatchScratch *scratch) {
+    free(scratch->order);
+    free(scratch->codes);
+    free(scratch->tmp_order);
+    *scratch = (QueryBatchScratch) { 0 };
+}
+
+/**
+ * One query for a whole batch of ranges, the hits come back as (range, point) pairs.
+ * The ranges are put in Morton order of their centers first so neighbouring ranges are handled together.
+ * The qtree then walks down once, carrying the list of ranges that still overlap each node,
+ * instead of descending from the root for every range. The grid and the linear qtree already jump
+ * straight to the cells / runs of a range, they just run the ranges in Morton order so what they touch stays warm.
+ * Pairs past max_pairs are dropped and counted in the index stats.
+ */
+int index_query_batch(
+    SpatialIndex *index, QRect *ranges, int num_ranges, QueryPair *pairs, int max_pairs,
+    QueryBatchScratch *scratch
+) {
+    if (num_ranges <= 0 || max_pairs <= 0)
+        return 0;
+    if (num_ranges > scratch->capacity) {
+        printe("Batch query has more ranges than its scratch, the rest are skipped");
+        num_ranges = scratch->capacity;
+    }
+    index_stats_count(num_ranges, 0, 0);
+
+    int *order = scratch->order;
+    _index_morton_order(ranges, num_ranges, scratch);
+
+    QueryPairBuffer buffer = { pairs, 0, max_pairs, 0, 0 };
+    switch (index->type) {
+        case INDEX_QTREE:
+            qtree_visit_batch(index->qtree, ranges, order, num_ranges, &buffer);
+            break;
+        case INDEX_GRID:
+            for (int i = 0; i < num_ranges; i++) {
+                buffer.range = order[i];
+                grid_visit(index->grid, ranges[order[i]], _index_collect_pair, &buffer);
+            }
+            break;
+        case INDEX_LINEAR:
+            // neighbouring ranges in Morton order also hit neighbouring runs of the sorted array
+            for (int i = 0; i < num_ranges; i++) {
+                buffer.range = order[i];
+                ltree_visit(index->linear, ranges[order[i]], _index_collect_pair, &buffer);
+            }
+            break;
+    }
+
+    // the ranges near the edge of the boundary also pick up the far tier, still in Morton order
+    for (int i = 0; i < num_ranges; i++) {
+        if (!_index_is_far(index, ranges[order[i]]))
+            continue;
+        buffer.range = order[i];
+        grid_visit(index->far, ranges[order[i]], _index_collect_pair, &buffer);
+    }
+
+    if (INDEX_STATS) {
+        index_stats.num_dropped_pairs += buffer.num_dropped;
+    }
+    return buffer.num_pairs;
+}
+
+bool _index_collect_pair(QPoint pt, void *ctx) {
+    QueryPairBuffer *buffer = ctx;
+    if (buffer->num_pairs >= buffer->capacity) {
+        buffer->num_dropped += 1;
+        return true;
+    }
+    buffer->pairs[buffer->num_pairs] = (QueryPair) { buffer->range, pt };
+    buffer->num_pairs += 1;
+    return true;
+}
+
+// Fills the scratch's order with the range indices sorted by the Morton code of their centers
+void _index_morton_order(QRect *ranges, int num_ranges, QueryBatchScratch *scratch) {
+    int *order = scratch->order;
+    unsigned int *codes = scratch->codes;
+    for (int i = 0; i < num_ranges; i++) {
+        order[i] = i;
+    }
+
+    // quantize the centers to 16 bits per axis over the area the batch covers
+    float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+    for (int i = 0; i < num_ranges; i++) {
+        min_x = fminf(min_x, ranges[i].x);
+        min_y = fminf(min_y, ranges[i].y);
+        max_x = fmaxf(max_x, ranges[i].x);
+        max_y = fmaxf(max_y, ranges[i].y);
+    }
+    float scale_x = max_x > min_x ? 65535.0f / (max_x - min_x) : 0;
+    float scale_y = max_y > min_y ? 65535.0f / (max_y - min_y) : 0;
+
+    for (int i = 0; i < num_ranges; i++) {
+        unsigned int qx = (unsigned int) ((ranges[i].x - min_x) * scale_x);
+        unsigned int qy = (unsigned int) ((ranges[i].y - min_y) * scale_y);
+        codes[i] = _index_morton_code(qx, qy);
+    }
+    _index_radix_sort(codes, order, num_ranges, codes + num_ranges, scratch->tmp_order);
+}
+
+// Interleaves the low 16 bits of x and y, x in the even bits
+unsigned int _index_morton_code(unsigned int x, unsigned int y) {
+    x &= 0xFFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+
+    y &= 0xFFFF;
+    y = (y | (y << 8)) & 0x00FF00FF;
+    y = (y | (y << 4)) & 0x0F0F0F0F;
+    y = (y | (y << 2)) & 0x33333333;
+    y = (y | (y << 1)) & 0x55555555;
+
+    return x | (y << 1);
+}
+
+// LSD radix sort of the keys 8 bits at a time, values are moved along, the tmp arrays hold n items
+void _index_radix_sort(unsigned int *keys, int *values, int n, unsigned int *tmp_keys, int *tmp_values) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        int counts[256] = { 0 };
+        for (int i = 0; i < n; i++) {
+            counts[(keys[i] >> shift) & 0xFF] += 1;
+        }
+
+        int offset = 0;
+        for (int d = 0; d < 256; d++) {
+            int count = counts[d];
+            counts[d] = offset;
+            offset += count;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int dst = counts[(keys[i] >> shift) & 0xFF]++;
+            tmp_keys[dst] = keys[i];
+            tmp_values[dst] = values[i];
+        }
+
+        // swap the buffers, after 4 passes the result is back in keys / values
+        unsigned int *k = keys; keys = tmp_keys; tmp_keys = k;
+        int *v = values; values = tmp_values; tmp_values = v;
+    }
+}
+
+bool index_nearest(SpatialIndex *index, Vec2 pos, float max_dist, QPoint *result) {
+    return index_k_nearest(index, pos, max_dist, 1, result) > 0;
+}
+
+// Closest k points within max_dist of pos, sorted nearest first, returns how many were found
+int index_k_nearest(SpatialIndex *index, Vec2 pos, float max_dist, int k, QPoint *result) {
+    if (k > MAX_NEAREST) k = MAX_NEAREST;
+    if (k <= 0)
+        return 0;
+    index_stats_count(1, 0, 0);
+
+    int num_points = 0;
+    switch (index->type) {
+        case INDEX_QTREE:
+            num_points = qtree_k_nearest(index->qtree, pos, max_dist, k, result);
+            break;
+        case INDEX_GRID:
+            return grid_k_nearest(index->grid, pos, max_dist, k, result);
+        case INDEX_LINEAR:
+            num_points = ltree_k_nearest(index->linear, pos, max_dist, k, result);
+            break;
+    }
+
+    // a full result already bounds the search, no need to look past the kth distance
+    if (num_points == k) {
+        max_dist = Vector2Distance(pos, (Vec2) { result[k - 1].x, result[k - 1].y });
+    }
+    QRect range = { pos.x, pos.y, max_dist, max_dist };
+    if (!_index_is_far(index, range))
+        return num_points;
+
+    QPoint far[MAX_NEAREST];
+    int num_far = grid_k_nearest(index->far, pos, max_dist, k, far);
+    if (num_far == 0)
+        return num_points;
+
+    float dists[MAX_NEAREST];
+    for (int i = 0; i < num_points; i++) {
+        dists[i] = Vector2Distance(pos, (Vec2) { result[i].x, result[i].y });
+    }
+    for (int i = 0; i < num_far; i++) {
+        float dist = Vector2Distance(pos, (Vec2) { far[i].x, far[i].y });
+        _index_push_nearest(result, dists, &num_points, k, far[i], dist);
+    }
+    return num_points;
+}
+
+// Insertion into the sorted k best, k is small so a shift beats a heap here
+void _index_push_nearest(QPoint *result, float *dists, int *num_points, int k, QPoint pt, float dist) {
+    if (*num_points == k && dist >= dists[k - 1])
+        return;
+
+    int i = *num_points < k ? *num_points : k - 1;
+    while (i > 0 && dists[i - 1] > dist) {
+        result[i] = result[i - 1];
+        dists[i] = dists[i - 1];
+        i--;
+    }
+    result[i] = pt;
+    dists[i] = dist;
+    if (*num_points < k) {
+        *num_points += 1;
+    }
+}
+
+const char *index_type_name(SpatialIndexType type) {
+    switch (type) {
+        case INDEX_QTREE:
+            return "qtree";
+        case INDEX_GRID:
+            return "grid";
+        case INDEX_LINEAR:
+            return "linear";
+    }
+    return "Err";
+}
+
+/**
+ * Index stats, queries are charged to the site set by index_stats_begin.
+ * The backends count the nodes they visit and the points they test, the GUI shows the last
+ * full frame and index_stats_dump prints the totals on exit.
+ * Counting is paused while queries run on the job pool, those sites only get their time and query count.
+ */
+
+void index_stats_begin(IndexSite site) {
+    if (!INDEX_STATS) return;
+    index_stats.site = site;
+    index_stats.site_start = GetTime();
+}
+
+void index_stats_end() {
+    if (!INDEX_STATS) return;
+    index_stats.frame[index_stats.site].time += GetTime() - index_stats.site_start;
+    index_stats.site = SITE_OTHER;
+}
+
+void index_stats_count(int queries, int nodes, int points) {
+    if (!INDEX_STATS || index_stats.is_paused) return;
+    IndexSiteStats *stats = &index_stats.frame[index_stats.site];
+    stats->queries += queries;
+    stats->nodes_visited += nodes;
+    stats->points_tested += points;
+}
+
+void index_stats_next_frame() {
+    if (!INDEX_STATS) return;
+    for (int i = 0; i < NUM_INDEX_SITES; i++) {
+        IndexSiteStats *frame = &index_stats.frame[i];
+        IndexSiteStats *total = &index_stats.total[i];
+        total->queries += frame->queries;
+        total->nodes_visited += frame->nodes_visited;
+        total->points_tested += frame->points_tested;
+        total->time += frame->time;
+        index_stats.last_frame[i] = *frame;
+        *frame = (IndexSiteStats) { 0 };
+    }
+    index_stats.num_frames += 1;
+}
+
+void index_stats_dump(SpatialIndex *index) {
+    if (!INDEX_STATS || !index || index_stats.num_frames == 0) return;
+
+    IndexTreeStats tree;
+    index_tree_stats(index, &tree);
+    print(TextFormat(
+        "Index %s: %d points, %d far, %d nodes, %d leaves, depth max %d avg %.2f",
+        index_type_name(index->type), tree.num_points, tree.num_far_points, tree.num_nodes,
+        tree.num_leaves, tree.max_depth, tree.avg_depth
+    ));
+    print(TextFormat(
+        "Leaf points 0:%d 1:%d 2-3:%d 4-7:%d 8-15:%d 16-31:%d 32-63:%d 64+:%d",
+        tree.leaf_histogram[0], tree.leaf_histogram[1], tree.leaf_histogram[2], tree.leaf_histogram[3],
+        tree.leaf_histogram[4], tree.leaf_histogram[5], tree.leaf_histogram[6], tree.leaf_histogram[7]
+    ));
+
+    // per frame averages over the whole run
+    float frames = index_stats.num_frames;
+    print(TextFormat("Index sites over %ld frames, per frame:", index_stats.num_frames));
+    for (int i = 0; i < NUM_INDEX_SITES; i++) {
+        IndexSiteStats *total = &index_stats.total[i];
+        if (total->queries == 0 && total->time == 0)
+            continue;
+        print(TextFormat(
+            "  %-15s queries %9.1f  nodes %10.1f  points %11.1f  time %.3fms",
+            index_site_name(i), total->queries / frames, total->nodes_visited / frames,
+            total->points_tested / frames, total->time * 1000 / frames
+        ));
+    }
+    if (index_stats.num_dropped_pairs > 0) {
+        print(TextFormat("  %ld batch query pairs dropped, the pair buffer was full", index_stats.num_dropped_pairs));
+    }
+}
+
+void index_tree_stats(SpatialIndex *index, IndexTreeStats *stats) {
+    *stats = (IndexTreeStats) { 0 };
+
+    switch (index->type) {
+        case INDEX_QTREE:
+            _qtree_tree_stats(index->qtree, 0, stats);
+            break;
+        case INDEX_GRID: {
+            // every occupied bucket is a leaf, they have no depth
+            SGrid *grid = index->grid;
+            for (int b = 0; b < grid->num_buckets; b++) {
+                if (grid->bucket_count[b] == 0)
+                    continue;
+                stats->num_nodes += 1;
+                _index_tree_stats_leaf(stats, 0, grid->bucket_count[b]);
+            }
+            break;
+        }
+        case INDEX_LINEAR: {
+            LTree *ltree = index->linear;
+            _ltree_tree_stats(ltree, 0, 0, 0, ltree->num_sorted, stats);
+            break;
+        }
+    }
+    if (index->far) {
+        stats->num_far_points = index->far->num_points;
+    }
+
+    if (stats->num_leaves > 0) {
+        stats->avg_depth /= stats->num_leaves;
+    }
+}
+
+// avg_depth holds the sum until index_tree_stats divides it
+void _index_tree_stats_leaf(IndexTreeStats *stats, int depth, int num_points) {
+    int bin = 0;
+    while (num_points >> bin && bin < INDEX_HISTOGRAM_BINS - 1) {
+        bin++;
+    }
+
+    stats->num_points += num_points;
+    stats->num_leaves += 1;
+    stats->avg_depth += depth;
+    stats->max_depth = depth > stats->max_depth ? depth : stats->max_depth;
+    stats->leaf_histogram[bin] += 1;
+}
+
+const char *index_site_name(IndexSite site) {
+    switch (site) {
+        case SITE_OTHER: return "other";
+        case SITE_REBUILD: return "rebuild";
+        case SITE_BULLETS: return "bullets";
+        case SITE_SEPARATION: return "separation";
+        case SITE_FLAME: return "flame";
+        case SITE_FROST: return "frost";
+        case SITE_LASER: return "laser";
+        case SITE_TARGETING: return "targeting";
+        case SITE_PLAYER_HURT: return "player hurt";
+        case SITE_DRAW: return "draw";
+        case SITE_PICKUPS: return "pickups";
+        case SITE_NEIGHBOURS: return "neighbours";
+        case SITE_BEHAVIOUR: return "enemy behaviour";
+        case SITE_CHASE: return "enemy chase";
+        case NUM_INDEX_SITES: break;
+    }
+    return "Err";
+}
+
+// Resolution of the backend, leaf capacity for the trees and cell size for the grid.
+// The qtree and the grid only fully pick it up after a clear and re-insert.
+void index_set_param(SpatialIndex *index, float value) {
+    switch (index->type) {
+        case INDEX_QTREE: {
+            int capacity = (int) value;
+            index->qtree->leaf_capacity = capacity < 1 ? 1 : (capacity > QBUCKET_POINTS ? QBUCKET_POINTS : capacity);
+            break;
+        }
+        case INDEX_GRID:
+            // points stay in the buckets of the old size until re-inserted
+            index->grid->cell_size = value;
+            index->grid->inv_cell_size = 1.0f / value;
+            break;
+        case INDEX_LINEAR:
+            index->linear->leaf_points = (int) value < 1 ? 1 : (int) value;
+            break;
+    }
+}
+
+float index_get_param(SpatialIndex *index) {
+    switch (index->type) {
+        case INDEX_QTREE:
+            return index->qtree->leaf_capacity;
+        case INDEX_GRID:
+            return index->grid->cell_size;
+        case INDEX_LINEAR:
+            return index->linear->leaf_points;
+    }
+    return 0;
+}
+
+const char *index_param_name(SpatialIndexType type) {
+    switch (type) {
+        case INDEX_QTREE:
+            return "leaf capacity";
+        case INDEX_GRID:
+            return "cell size";
+        case INDEX_LINEAR:
+            return "leaf points";
+    }
+    return "Err";
+}
+
+/**
+ * Index tuner, each enemy count band keeps the measured cost of the settings it has tried.
+ * A setting runs for an epoch of TUNER_EPOCH_FRAMES and is charged the index time of those frames
+ * (all the enemy index sites in index_stats) per enemy, so the count drifting within the band
+ * doesn't skew it. Untried neighbours of the band's best get tried next, after that it sticks
+ * to the best and only re-checks a neighbour every TUNER_REEXPLORE_EPOCHS epochs.
+ * The cost includes the visitors, they do the same work whatever the setting so only the index part moves.
+ * Needs INDEX_STATS for the timings.
+ */
+void index_tuner_init(IndexTuner *tuner, SpatialIndex *index) {
+    *tuner = (IndexTuner) { 0 };
+
+    switch (index->type) {
+        case INDEX_QTREE: {
+            float candidates[] = { 4, 6, 8, 10, 12, 16 };
+            tuner->num_candidates = 6;
+            memcpy(tuner->candidates, candidates, sizeof(candidates));
+            break;
+        }
+        case INDEX_GRID: {
+            float candidates[] = { 16, 24, 32, 48, 64, 96 };
+            tuner->num_candidates = 6;
+            memcpy(tuner->candidates, candidates, sizeof(candidates));
+            break;
+        }
+        case INDEX_LINEAR: {
+            float candidates[] = { 8, 16, 32, 64, 128 };
+            tuner->num_candidates = 5;
+            memcpy(tuner->candidates, candidates, sizeof(candidates));
+            break;
+        }
+    }
+
+    // every band starts from the compile time default
+    float param = index_get_param(index);
+    int start = 0;
+    for (int i = 0; i < tuner->num_candidates; i++) {
+        if (tuner->candidates[i] == param) {
+            start = i;
+        }
+    }
+    for (int b = 0; b < TUNER_BANDS; b++) {
+        tuner->bands[b].best = start;
+        for (int i = 0; i < TUNER_MAX_CANDIDATES; i++) {
+            tuner->bands[b].cost[i] = -1;
+        }
+    }
+    tuner->current = start;
+
+    // pinned, index_tuner_update leaves the index alone
+    if (!is_index_tuned) {
+        tuner->num_candidates = 0;
+    }
+}
+
+// Returns true when the setting changed, the index has to be rebuilt then
+bool index_tuner_update(IndexTuner *tuner, SpatialIndex *index, int num_points) {
+    if (!INDEX_STATS || tuner->num_candidates == 0)
+        return false;
+
+    int band = _index_tuner_band(num_points);
+    if (band != tuner->band) {
+        // the epoch so far was for another density, start over on this band's best
+        tuner->band = band;
+        tuner->epoch_cost = 0;
+        tuner->epoch_frames = 0;
+        if (tuner->current != tuner->bands[band].best) {
+            tuner->current = tuner->bands[band].best;
+            tuner->skip_frames = 1;
+            index_set_param(index, tuner->candidates[tuner->current]);
+            return true;
+        }
+        return false;
+    }
+
+    if (tuner->skip_frames > 0) {
+        tuner->skip_frames -= 1;
+        return false;
+    }
+
+    // only the sites querying this index, behaviour and chase don't touch it
+    double frame_time = 0;
+    for (int i = 0; i < NUM_INDEX_SITES; i++) {
+        if (i == SITE_OTHER || i == SITE_PICKUPS || i == SITE_BEHAVIOUR || i == SITE_CHASE)
+            continue;
+        frame_time += index_stats.last_frame[i].time;
+    }
+    tuner->epoch_cost += frame_time * 1000 / (num_points > 0 ? num_points : 1);
+    tuner->epoch_frames += 1;
+    if (tuner->epoch_frames < TUNER_EPOCH_FRAMES)
+        return false;
+
+    // Epoch done, fold it into the band and pick what runs next
+    TunerBand *b = &tuner->bands[band];
+    float cost = tuner->epoch_cost / tuner->epoch_frames;
+    float *measured = &b->cost[tuner->current];
+    *measured = *measured >= 0 ? *measured * 0.7f + cost * 0.3f : cost;
+    tuner->epoch_cost = 0;
+    tuner->epoch_frames = 0;
+    tuner->num_epochs += 1;
+
+    // the best may not have been measured yet when a neighbour ran first
+    if (b->cost[b->best] < 0) {
+        b->best = tuner->current;
+    }
+    for (int i = 0; i < tuner->num_candidates; i++) {
+        if (b->cost[i] >= 0 && b->cost[i] < b->cost[b->best]) {
+            b->best = i;
+        }
+    }
+
+    int next = _index_tuner_pick(tuner, b);
+    if (next == tuner->current)
+        return false;
+
+    tuner->current = next;
+    tuner->skip_frames = 1;
+    index_set_param(index, tuner->candidates[next]);
+    return true;
+}
+
+int _index_tuner_band(int num_points) {
+    int band = 0;
+    while ((num_points >> (band + 6)) > 0 && band < TUNER_BANDS - 1) {
+        band++;
+    }
+    return band;
+}
+
+int _index_tuner_pick(IndexTuner *tuner, TunerBand *band) {
+    int lower = band->best - 1;
+    int upper = band->best + 1;
+    bool has_lower = lower >= 0;
+    bool has_upper = upper < tuner->num_candidates;
+
+    if (has_lower && band->cost[lower] < 0) return lower;
+    if (has_upper && band->cost[upper] < 0) return upper;
+
+    // settle, but keep checking the neighbours in case the costs moved
+    if (tuner->num_epochs % TUNER_REEXPLORE_EPOCHS == 0) {
+        if (has_lower && (!has_upper || (tuner->num_epochs / TUNER_REEXPLORE_EPOCHS) % 2 == 0)) return lower;
+        if (has_upper) return upper;
+    }
+    return band->best;
+}
+
+void index_tuner_dump(IndexTuner *tuner, SpatialIndex *index) {
+    if (!INDEX_STATS || !index) return;
+    if (tuner->num_candidates == 0) {
+        print(TextFormat("Index tuner off, %s kept at %.0f", index_param_name(index->type), index_get_param(index)));
+        return;
+    }
+
+    print(TextFormat("Index tuner, best %s per enemy count:", index_param_name(index->type)));
+    for (int b = 0; b < TUNER_BANDS; b++) {
+        TunerBand *band = &tuner->bands[b];
+        if (band->cost[band->best] < 0)
+            continue;
+        print(TextFormat(
+            "  %6d+ enemies: %-4.0f %.5fms per enemy",
+            b == 0 ? 0 : 32 << b, tuner->candidates[band->best], band->cost[band->best]
+        ));
+    }
+}
+
+// MARK: :quadtree :qtree
+/**
+ * This is a loose quadtree, it started out as the simple impl from
+ * https://www.youtube.com/watch?v=OJxEcs0w_kE
+ * Original code: https://editor.p5js.org/codingtrain/sketches/CDMjU0GIK
+ * 
+ * Its used to store all enemy locations around the player,
+ * When the player moves around, the boundaries of the qtree are also updated
+ *
+ * Nodes live in a single pool owned by the tree instead of being malloced one by one,
+ * children are always allocated as a block of 4 (tl, tr, bl, br) so siblings sit next to each other.
+ * A clear re-lays the pool out breadth first and drops the subtrees that were left empty,
+ * so the pool shrinks again once the enemies move away.
+ *
+ * Every point lives in exactly one leaf, picked by comparing it to the node centers.
+ * Leaves split once they hold leaf_capacity points, except at QTREE_MAX_DEPTH where
+ * they chain overflow buckets instead, so a crowd stacked on one spot can't split forever.
+ * Queries test nodes against their loose bounds (QTREE_LOOSENESS times the cell),
+ * which lets a moving point stay in its leaf until it leaves the loose bounds.
+ *
+ * The tree also remembers which leaf holds each point id (ids must be unique and below capacity),
+ * so a point can be moved with qtree_update and only gets relocated once it leaves its leaf.
+ */
+
+QTree *qtree_create(QRect boundary, int capacity) {
+    QTree *qtree = malloc(sizeof(QTree));
+    if (!qtree) return NULL;
+
+    qtree->nodes = malloc(QTREE_MIN_NODES * sizeof(QNode));
+    qtree->buckets = malloc(QTREE_MIN_NODES * sizeof(QBucket));
+    qtree->id_node = malloc(capacity * sizeof(int));
+    if (!qtree->nodes || !qtree->buckets || !qtree->id_node) {
+        free(qtree->nodes);
+        free(qtree->buckets);
+        free(qtree->id_node);
+        free(qtree);
+        return NULL;
+    }
+
+    qtree->boundary = boundary;
+    qtree->capacity = QTREE_MIN_NODES;
+    qtree->num_nodes = 1;
+    qtree->free_block = -1;
+    qtree->bucket_capacity = QTREE_MIN_NODES;
+    qtree->num_buckets = 0;
+    qtree->free_bucket = -1;
+    qtree->heap = NULL;
+    qtree->heap_capacity = 0;
+    qtree->leaf_capacity = POINTS_PER_QUAD;
+    qtree->id_capacity = capacity;
+    for (int i = 0; i < capacity; i++) {
+        qtree->id_node[i] = -1;
+    }
+    qtree->nodes[0] = (QNode) {
+        .boundary = boundary,
+        .num_points = 0,
+        .bucket = -1,
+        .children = -1,
+        .parent = -1,
+        .depth = 0
+    };
+
+    return qtree;
+}
+
+void qtree_destroy(QTree *qtree) {
+    if (!qtree) return;
+
+    free(qtree->nodes);
+    free(qtree->buckets);
+    free(qtree->id_node);
+    free(qtree->heap);
+    free(qtree);
+}
+
+void qtree_clear(QTree *qtree) {
+    if (!qtree) return;
+
+    for (int i = 0; i < qtree->id_capacity; i++) {
+        qtree->id_node[i] = -1;
+    }
+    // every bucket is handed back at once, shrink the pool if the last build used little of it
+    int bucket_capacity = qtree->bucket_capacity;
+    while (bucket_capacity / 4 >= qtree->num_buckets && bucket_capacity / 2 >= QTREE_MIN_NODES) {
+        bucket_capacity /= 2;
+    }
+    if (bucket_capacity != qtree->bucket_capacity) {
+        QBucket *buckets = realloc(qtree->buckets, bucket_capacity * sizeof(QBucket));
+        if (buckets) {
+            qtree->buckets = buckets;
+            qtree->bucket_capacity = bucket_capacity;
+        }
+    }
+    qtree->num_buckets = 0;
+    qtree->free_bucket = -1;
+
+    // Number of points held by each subtree in the last build, used to trim empty subtrees
+    int *subtree_points = malloc(qtree->num_nodes * sizeof(int));
+    // Old node index for every node in the new breadth first layout
+    int *old_idx = malloc(qtree->num_nodes * sizeof(int));
+    if (!subtree_points || !old_idx) {
+        free(subtree_points);
+        free(old_idx);
+
+        // can't re-layout, just empty the nodes in place
+        for (int i = 0; i < qtree->num_nodes; i++) {
+            qtree->nodes[i].num_points = 0;
+            qtree->nodes[i].bucket = -1;
+        }
+        return;
+    }
+    _qtree_count_points(qtree, 0, subtree_points);
+
+    // Count the nodes that survive the trim to size the new pool
+    int num_nodes = 1;
+    old_idx[0] = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        QNode *node = &qtree->nodes[old_idx[i]];
+        if (node->children >= 0 && subtree_points[old_idx[i]] > 0) {
+            for (int c = 0; c < 4; c++) {
+                old_idx[num_nodes++] = node->children + c;
+            }
+        }
+    }
+
+    int capacity = qtree->capacity;
+    while (capacity / 4 >= num_nodes && capacity / 2 >= QTREE_MIN_NODES) {
+        capacity /= 2;
+    }
+
+    QNode *nodes = malloc(capacity * sizeof(QNode));
+    if (!nodes) {
+        free(subtree_points);
+        free(old_idx);
+        for (int i = 0; i < qtree->num_nodes; i++) {
+            qtree->nodes[i].num_points = 0;
+            qtree->nodes[i].bucket = -1;
+        }
+        return;
+    }
+
+    // Breadth first copy, the 4 children of a node always land in the next free block
+    int next_block = 1;
+    nodes[0].parent = -1;
+    for (int i = 0; i < num_nodes; i++) {
+        QNode *old = &qtree->nodes[old_idx[i]];
+        bool keep_children = old->children >= 0 && subtree_points[old_idx[i]] > 0;
+
+        nodes[i] = (QNode) {
+            .boundary = old->boundary,
+            .num_points = 0,
+            .bucket = -1,
+            .children = keep_children ? next_block : -1,
+            .parent = nodes[i].parent,
+            .depth = old->depth
+        };
+        if (keep_children) {
+            for (int c = 0; c < 4; c++) {
+                nodes[next_block + c].parent = i;
+            }
+            next_block += 4;
+        }
+    }
+
+    free(qtree->nodes);
+    free(subtree_points);
+    free(old_idx);
+
+    qtree->nodes = nodes;
+    qtree->capacity = capacity;
+    qtree->num_nodes = num_nodes;
+    qtree->free_block = -1;
+}
+
+void qtree_reset_boundary(QTree *qtree, QRect rect) {
+    // points keep their leaves, re-insert them after moving the boundary
+    qtree->boundary = rect;
+    _qtree_reset_node_boundary(qtree, 0, rect);
+}
+
+void _qtree_reset_node_boundary(QTree *qtree, int node, QRect rect) {
+    qtree->nodes[node].boundary = rect;
+
+    int children = qtree->nodes[node].children;
+    if (children >= 0) {
+        float w = rect.w/2;
+        float h = rect.h/2;
+
+        _qtree_reset_node_boundary(qtree, children + 0, (QRect) { rect.x - w, rect.y - h, w, h });
+        _qtree_reset_node_boundary(qtree, children + 1, (QRect) { rect.x + w, rect.y - h, w, h });
+        _qtree_reset_node_boundary(qtree, children + 2, (QRect) { rect.x - w, rect.y + h, w, h });
+        _qtree_reset_node_boundary(qtree, children + 3, (QRect) { rect.x + w, rect.y + h, w, h });
+    }
+}
+
+bool qtree_insert(QTree *tree, QPoint pt) {
+    if (!tree)
+        return false;
+    return _qtree_insert(tree, 0, pt);
+}
+
+bool _qtree_insert(QTree *tree, int node, QPoint pt) {
+    // Climb to the first node whose cell holds the point
+    while (!is_rect_contains_point(tree->nodes[node].boundary, pt)) {
+        node = tree->nodes[node].parent;
+        if (node < 0)
+            return false;
+    }
+
+    return _qtree_insert_down(tree, node, pt);
+}
+
+// Down to the leaf of the point's quadrant, the point goes there even if rounding puts it
+// a hair outside the cell
+bool _qtree_insert_down(QTree *tree, int node, QPoint pt) {
+    while (tree->nodes[node].children >= 0) {
+        node = tree->nodes[node].children + _qtree_quadrant(tree->nodes[node].boundary, pt);
+    }
+
+    QNode *leaf = &tree->nodes[node];
+    if (leaf->num_points >= tree->leaf_capacity && leaf->depth < QTREE_MAX_DEPTH) {
+        // the pool may move while subdividing, so only hold on to indices here
+        if (_qtree_subdivide(tree, node)) {
+            return _qtree_insert_down(tree, node, pt);
+        }
+    }
+
+    return _qtree_push_point(tree, node, pt);
+}
+
+/**
+ * Rebuilds the tree from scratch with all the points at once, split over the job pool.
+ * Slices of the points are binned by the nodes QTREE_BUILD_DEPTH down, then each of those cells gets
+ * its subtree built in a private tree and copied in after the others. The subtrees come out
+ * the same as inserting the points one by one would make them.
+ * Points outside the boundary are left out, *outside is set to them. Returns how many,
+ * or -1 when it ran out of memory, the tree is empty then.
+ */
+int qtree_build(QTree *qtree, QTreeBuild *build, QPoint *points, int num_points, JobPool *jobs, QPoint **outside) {
+    if (!_qtree_build_reserve(build, num_points))
+        return -1;
+
+    _qtree_reset(qtree, qtree->boundary, 0);
+    for (int i = 0; i < qtree->id_capacity; i++) {
+        qtree->id_node[i] = -1;
+    }
+    // the levels above the cells always exist, subdivided in order they're laid out breadth first
+    // and the cells are the last QTREE_BUILD_CELLS nodes
+    int num_above = (QTREE_BUILD_CELLS - 1) / 3;
+    for (int node = 0; node < num_above; node++) {
+        if (!_qtree_subdivide(qtree, node))
+            return -1;
+    }
+    for (int cell = 0; cell < QTREE_BUILD_CELLS; cell++) {
+        build->cell_nodes[cell] = num_above + cell;
+    }
+
+    build->qtree = qtree;
+    build->points = points;
+    build->num_points = num_points;
+    build->num_slices = jobs_num_threads(jobs);
+    jobs_run(jobs, _qtree_build_bin, build, build->num_slices);
+
+    // slice s writes its points of a cell after the earlier slices' ones, the order stays the same
+    int start = 0;
+    for (int cell = 0; cell <= QTREE_BUILD_CELLS; cell++) {
+        build->cell_start[cell] = start;
+        for (int s = 0; s < build->num_slices; s++) {
+            int count = build->counts[s][cell];
+            build->counts[s][cell] = start;
+            start += count;
+        }
+    }
+    build->cell_start[QTREE_BUILD_CELLS + 1] = start;
+    jobs_run(jobs, _qtree_build_scatter, build, build->num_slices);
+    jobs_run(jobs, _qtree_build_cell, build, QTREE_BUILD_CELLS);
+
+    // a subtree's root is the cell's node, the rest of it goes at the end of the pools
+    int num_nodes = qtree->num_nodes;
+    int num_buckets = qtree->num_buckets;
+    for (int cell = 0; cell < QTREE_BUILD_CELLS; cell++) {
+        if (build->is_failed[cell])
+            return -1;
+        build->node_offsets[cell] = num_nodes;
+        build->bucket_offsets[cell] = num_buckets;
+        num_nodes += build->subtrees[cell]->num_nodes - 1;
+        num_buckets += build->subtrees[cell]->num_buckets;
+    }
+    if (!_qtree_reserve(qtree, num_nodes, num_buckets))
+        return -1;
+    qtree->num_nodes = num_nodes;
+    qtree->num_buckets = num_buckets;
+    jobs_run(jobs, _qtree_build_link, build, QTREE_BUILD_CELLS);
+
+    // buckets the subtrees freed while splitting go on the tree's free list
+    for (int cell = 0; cell < QTREE_BUILD_CELLS; cell++) {
+        int b = build->subtrees[cell]->free_bucket;
+        while (b >= 0) {
+            int next = build->subtrees[cell]->buckets[b].next;
+            int freed = build->bucket_offsets[cell] + b;
+            qtree->buckets[freed].next = qtree->free_bucket;
+            qtree->free_bucket = freed;
+            b = next;
+        }
+    }
+
+    *outside = build->binned + build->cell_start[QTREE_BUILD_CELLS];
+    return num_points - build->cell_start[QTREE_BUILD_CELLS];
+}
+
+QTreeBuild *qtree_build_create() {
+    QTreeBuild *build = malloc(sizeof(QTreeBuild));
+    if (!build) return NULL;
+
+    *build = (QTreeBuild) {
+        .cells = NULL,
+        .binned = NULL,
+        .capacity = 0
+    };
+    for (int cell = 0; cell < QTREE_BUILD_CELLS; cell++) {
+        build->subtrees[cell] = qtree_create((QRect) { 0, 0, 1, 1 }, 1);
+        if (!build->subtrees[cell]) {
+            qtree_build_destroy(build);
+            return NULL;
+        }
+        // ids are only looked up in the real tree, they're set there when linking
+        build->subtrees[cell]->id_capacity = 0;
+    }
+    return build;
+}
+
+void qtree_build_destroy(QTreeBuild *build) {
+    if (!build) return;
+
+    for (int cell = 0; cell < QTREE_BUILD_CELLS; cell++) {
+        qtree_destroy(build->subtrees[cell]);
+    }
+    free(build->cells);
+    free(build->binned);
+    free(build);
+}
+
+bool _qtree_build_reserve(QTreeBuild *build, int num_points) {
+    if (num_points <= build->capacity)
+        return true;
+
+    unsigned char *cells = realloc(build->cells, num_points * sizeof(unsigned char));
+    if (!cells) {
+        printe("Error growing qtree build scratch");
+        return false;
+    }
+    build->cells = cells;
+
+    QPoint *binned = realloc(build->binned, num_points * sizeof(QPoint));
+    if (!binned) {
+        printe("Error growing qtree build scratch");
+        return false;
+    }
+    build->binned = binned;
+    build->capacity = num_points;
+    return true;
+}
+
+void _qtree_build_bin(void *ctx, int slice) {
+    QTreeBuild *build = ctx;
+    QTree *qtree = build->qtree;
+    int *counts = build->counts[slice];
+    for (int cell = 0; cell <= QTREE_BUILD_CELLS; cell++) {
+        counts[cell] = 0;
+    }
+
+    int start, end;
+    jobs_slice(build->num_points, build->num_slices, slice, &start, &end);
+    int num_above = (QTREE_BUILD_CELLS - 1) / 3;
+    for (int i = start; i < end; i++) {
+        QPoint pt = build->points[i];
+        int cell = QTREE_BUILD_CELLS;
+        if (is_rect_contains_point(qtree->nodes[0].boundary, pt)) {
+            int node = 0;
+            for (int depth = 0; depth < QTREE_BUILD_DEPTH; depth++) {
+                node = qtree->nodes[node].children + _qtree_quadrant(qtree->nodes[node].boundary, pt);
+            }
+            cell = node - num_above;
+        }
+        build->cells[i] = cell;
+        counts[cell] += 1;
+    }
+}
+
+void _qtree_build_scatter(void *ctx, int slice) {
+    QTreeBuild *build = ctx;
+    int *next = build->counts[slice];
+
+    int start, end;
+    jobs_slice(build->num_points, build->num_slices, slice, &start, &end);
+    for (int i = start; i < end; i++) {
+        build->binned[next[build->cells[i]]] = build->points[i];
+        next[build->cells[i]] += 1;
+    }
+}
+
+void _qtree_build_cell(void *ctx, int cell) {
+    QTreeBuild *build = ctx;
+    QTree *subtree = build->subtrees[cell];
+    QNode *node = &build->qtree->nodes[build->cell_nodes[cell]];
+
+    _qtree_reset(subtree, node->boundary, node->depth);
+    subtree->leaf_capacity = build->qtree->leaf_capacity;
+    build->is_failed[cell] = false;
+    for (int i = build->cell_start[cell]; i < build->cell_start[cell + 1]; i++) {
+        // the cell was picked by quadrant, keep going by quadrant
+        if (!_qtree_insert_down(subtree, 0, build->binned[i])) {
+            build->is_failed[cell] = true;
+            return;
+        }
+    }
+}
+
+void _qtree_build_link(void *ctx, int cell) {
+    QTreeBuild *build = ctx;
+    QTree *qtree = build->qtree;
+    QTree *subtree = build->subtrees[cell];
+    int cell_node = build->cell_nodes[cell];
+    // subtree node i > 0 lands at node_offset + i
+    int node_offset = build->node_offsets[cell] - 1;
+    int bucket_offset = build->bucket_offsets[cell];
+
+    for (int b = 0; b < subtree->num_buckets; b++) {
+        QBucket *bucket = &qtree->buckets[bucket_offset + b];
+        *bucket = subtree->buckets[b];
+        if (bucket->next >= 0) {
+            bucket->next += bucket_offset;
+        }
+    }
+
+    for (int i = 0; i < subtree->num_nodes; i++) {
+        QNode node = subtree->nodes[i];
+        int at = i == 0 ? cell_node : node_offset + i;
+        if (i == 0) {
+            node.parent = qtree->nodes[cell_node].parent;
+        } else {
+            node.parent = node.parent == 0 ? cell_node : node_offset + node.parent;
+        }
+        if (node.children >= 0) {
+            node.children += node_offset;
+        }
+        if (node.bucket >= 0) {
+            node.bucket += bucket_offset;
+        }
+        qtree->nodes[at] = node;
+
+        for (int b = node.bucket; b >= 0; b = qtree->buckets[b].next) {
+            QBucket *bucket = &qtree->buckets[b];
+            for (int p = 0; p < bucket->num_points; p++) {
+                int id = bucket->ids[p];
+                if (id >= 0 && id < qtree->id_capacity) {
+                    qtree->id_node[id] = at;
+                }
+            }
+        }
+    }
+}
+
+// Drops every node and bucket, the root is an empty leaf again. The ids are left alone
+void _qtree_reset(QTree *qtree, QRect rect, int depth) {
+    qtree->boundary = rect;
+    qtree->num_nodes = 1;
+    qtree->free_block = -1;
+    qtree->num_buckets = 0;
+    qtree->free_bucket = -1;
+    qtree->nodes[0] = (QNode) {
+        .boundary = rect,
+        .num_points = 0,
+        .bucket = -1,
+        .children = -1,
+        .parent = -1,
+        .depth = depth
+    };
+}
+
+bool _qtree_reserve(QTree *qtree, int num_nodes, int num_buckets) {
+    int capacity = qtree->capacity;
+    while (capacity < num_nodes) {
+        capacity *= 2;
+    }
+    if (capacity != qtree->capacity) {
+        QNode *nodes = realloc(qtree->nodes, capacity * sizeof(QNode));
+        if (!nodes) {
+            printe("Error growing qtree node pool");
+            return false;
+        }
+        qtree->nodes = nodes;
+        qtree->capacity = capacity;
+    }
+
+    int bucket_capacity = qtree->bucket_capacity;
+    while (bucket_capacity < num_buckets) {
+        bucket_capacity *= 2;
+    }
+    if (bucket_capacity != qtree->bucket_capacity) {
+        QBucket *buckets = realloc(qtree->buckets, bucket_capacity * sizeof(QBucket));
+        if (!buckets) {
+            printe("Error growing qtree bucket pool");
+            return false;
+        }
+        qtree->buckets = buckets;
+        qtree->bucket_capacity = bucket_capacity;
+    }
+    return true;
+}
+
+bool qtree_update(QTree *qtree, QPoint pt) {
+    if (!qtree || pt.id < 0 || pt.id >= qtree->id_capacity)
+        return false;
+
+    int node = qtree->id_node[pt.id];
+    if (node < 0) {
+        // not in the tree yet or it was outside the boundary
+        return _qtree_insert(qtree, 0, pt);
+    }
+
+    // Still inside the loose bounds of its leaf, only the coordinates change. Points past the
+    // boundary have to go, a subdivide couldn't place them again and would drop them
+    QRect loose = _qtree_loose_bounds(qtree->nodes[node].boundary);
+    if (is_rect_contains_point(loose, pt) && is_rect_contains_point(qtree->boundary, pt)) {
+        for (int b = qtree->nodes[node].bucket; b >= 0; b = qtree->buckets[b].next) {
+            QBucket *bucket = &qtree->buckets[b];
+            for (int i = 0; i < bucket->num_points; i++) {
+                if (bucket->ids[i] == pt.id) {
+                    bucket->xs[i] = pt.x;
+                    bucket->ys[i] = pt.y;
+                    return true;
+                }
+            }
+        }
+    }
+
+    // Left its leaf, re-insert from there so only the nearest ancestors are walked.
+    // The leaf is only collapsed after, the insert still starts from it
+    _qtree_remove_from_node(qtree, node, pt.id);
+    bool is_inserted = _qtree_insert(qtree, node, pt);
+    _qtree_collapse(qtree, node);
+    return is_inserted;
+}
+
+bool qtree_remove_id(QTree *qtree, int id) {
+    if (!qtree || id < 0 || id >= qtree->id_capacity)
+        return false;
+
+    int node = qtree->id_node[id];
+    if (node < 0)
+        return false;
+    bool is_removed = _qtree_remove_from_node(qtree, node, id);
+    _qtree_collapse(qtree, node);
+    return is_removed;
+}
+
+bool _qtree_remove_from_node(QTree *qtree, int node, int id) {
+    for (int b = qtree->nodes[node].bucket; b >= 0; b = qtree->buckets[b].next) {
+        QBucket *bucket = &qtree->buckets[b];
+        for (int i = 0; i < bucket->num_points; i++) {
+            if (bucket->ids[i] == id) {
+                _qtree_remove_at(qtree, node, b, i);
+                qtree->id_node[id] = -1;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Hands the children of the node's parent back to the pool once they're all empty leaves,
+ * then does the same a level up. The crowd moving on would otherwise leave every area it
+ * passed through subdivided until the next rebuild
+ */
+void _qtree_collapse(QTree *qtree, int node) {
+    while (node > 0) {
+        QNode *n = &qtree->nodes[node];
+        if (n->num_points > 0 || n->children >= 0)
+            return;
+
+        int parent = n->parent;
+        int children = qtree->nodes[parent].children;
+        for (int c = 0; c < 4; c++) {
+            QNode *child = &qtree->nodes[children + c];
+            if (child->num_points > 0 || child->children >= 0)
+                return;
+        }
+        _qtree_free_block(qtree, children);
+        qtree->nodes[parent].children = -1;
+        node = parent;
+    }
+}
+
+bool qtree_visit(QTree *qtree, QRect range, QueryVisitor visit, void *ctx) {
+    if (!qtree || !visit)
+        return false;
+    return _qtree_visit(qtree, 0, range, visit, ctx);
+}
+
+// Returns false once the visitor asked to stop
+bool _qtree_visit(QTree *qtree, int node, QRect range, QueryVisitor visit, void *ctx) {
+    QNode *n = &qtree->nodes[node];
+    QRect loose = _qtree_loose_bounds(n->boundary);
+    if (!is_rect_overlap(loose, range))
+        return true;
+
+    // Whole subtree is inside, like most of the tree for the on screen query, nothing to test
+    if (is_rect_contains_rect(range, loose))
+        return _qtree_visit_all(qtree, node, visit, ctx);
+    index_stats_count(0, 1, n->num_points);
+
+    int hits[QBUCKET_POINTS];
+    for (int b = n->bucket; b >= 0; b = qtree->buckets[b].next) {
+        QBucket *bucket = &qtree->buckets[b];
+        int num_hits = _qtree_scan_rect(bucket, range, hits);
+        for (int i = 0; i < num_hits; i++) {
+            if (!visit(_qtree_bucket_point(bucket, hits[i]), ctx))
+                return false;
+        }
+    }
+
+    if (n->children >= 0) {
+        for (int c = 0; c < 4; c++) {
+            if (!_qtree_visit(qtree, n->children + c, range, visit, ctx))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool _qtree_visit_all(QTree *qtree, int node, QueryVisitor visit, void *ctx) {
+    QNode *n = &qtree->nodes[node];
+    // nothing is tested but they're walked all the same
+    index_stats_count(0, 1, n->num_points);
+    for (int b = n->bucket; b >= 0; b = qtree->buckets[b].next) {
+        QBucket *bucket = &qtree->buckets[b];
+        for (int i = 0; i < bucket->num_points; i++) {
+            if (!visit(_qtree_bucket_point(bucket, i), ctx))
+                return false;
+        }
+    }
+
+    if (n->children >= 0) {
+        for (int c = 0; c < 4; c++) {
+            if (!_qtree_visit_all(qtree, n->children + c, visit, ctx))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool qtree_visit_segment(QTree *qtree, QShape *segment, QueryVisitor visit, void *ctx) {
+    if (!qtree || !segment || !visit)
+        return false;
+
+    float t_enter;
+    if (!_shape_segment_entry(segment, _qtree_loose_bounds(qtree->nodes[0].boundary), &t_enter))
+        return true;
+    return _qtree_visit_segment(qtree, 0, segment, visit, ctx);
+}
+
+// Descends only into the children the segment enters, nearest entry first
+bool _qtree_visit_segment(QTree *qtree, int node, QShape *segment, QueryVisitor visit, void *ctx) {
+    QNode *n = &qtree->nodes[node];
+    index_stats_count(0, 1, n->num_points);
+    int hits[QBUCKET_POINTS];
+    for (int b = n->bucket; b >= 0; b = qtree->buckets[b].next) {
+        QBucket *bucket = &qtree->buckets[b];
+        int num_hits = _qtree_scan_shape(bucket, segment, hits);
+        for (int i = 0; i < num_hits; i++) {
+            if (!visit(_qtree_bucket_point(bucket, hits[i]), ctx))
+                return false;
+        }
+    }
+
+    if (n->children < 0)
+        return true;
+
+    int order[4];
+    float entry[4];
+    int num_hit = 0;
+    for (int c = 0; c < 4; c++) {
+        float t;
+        if (!_shape_segment_entry(segment, _qtree_loose_bounds(qtree->nodes[n->children + c].boundary), &t))
+            continue;
+
+        int j = num_hit;
+        while (j > 0 && entry[j - 1] > t) {
+            order[j] = order[j - 1];
+            entry[j] = entry[j - 1];
+            j--;
+        }
+        order[j] = n->children + c;
+        entry[j] = t;
+        num_hit++;
+    }
+
+    for (int i = 0; i < num_hit; i++) {
+        if (!_qtree_visit_segment(qtree, order[i], segment, visit, ctx))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Batched walk, active holds the ranges overlapping this node in Morton order
+ * and the space right after it is used to build the list for each child.
+ * The lists shrink on the way down so there's room for QTREE_MAX_DEPTH + 1 of them.
+ */
+bool qtree_visit_batch(QTree *qtree, QRect *ranges, int *active, int num_active, QueryPairBuffer *buffer) {
+    if (!qtree || !ranges || !active || !buffer)
+        return false;
+    return _qtree_visit_batch(qtree, 0, ranges, active, num_active, buffer);
+}
+
+bool _qtree_visit_batch(QTree *qtree, int node, QRect *ranges, int *active, int num_active, QueryPairBuffer *buffer) {
+    QNode *n = &qtree->nodes[node];
+    QRect loose = _qtree_loose_bounds(n->boundary);
+
+    int *overlap = active + num_active;
+    int num_overlap = 0;
+    for (int i = 0; i < num_active; i++) {
+        if (is_rect_overlap(loose, ranges[active[i]])) {
+            overlap[num_overlap++] = active[i];
+        }
+    }
+    if (num_overlap == 0)
+        return true;
+    index_stats_count(0, 1, n->num_points * num_overlap);
+
+    int hits[QBUCKET_POINTS];
+    for (int b = n->bucket; b >= 0; b = qtree->buckets[b].next) {
+        QBucket *bucket = &qtree->buckets[b];
+        for (int r = 0; r < num_overlap; r++) {
+            int num_hits = _qtree_scan_rect(bucket, ranges[overlap[r]], hits);
+            buffer->range = overlap[r];
+            for (int i = 0; i < num_hits; i++) {
+                if (!_index_collect_pair(_qtree_bucket_point(bucket, hits[i]), buffer))
+                    return false;
+            }
+        }
+    }
+
+    if (n->children >= 0) {
+        for (int c = 0; c < 4; c++) {
+            if (!_qtree_visit_batch(qtree, n->children + c, ranges, overlap, num_overlap, buffer))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool qtree_nearest(QTree *qtree, Vec2 pos, float max_dist, QPoint *result) {
+    return qtree_k_nearest(qtree, pos, max_dist, 1, result) > 0;
+}
+
+/**
+ * Best first search, nodes are popped closest first from a min heap keyed on the
+ * distance to their loose bounds. Once the closest remaining node is further than
+ * the k-th best point found so far nothing else can get in, so the crowd around
+ * the player is never copied out like a rect query would.
+ */
+int qtree_k_nearest(QTree *qtree, Vec2 pos, float max_dist, int k, QPoint *result) {
+    if (!qtree || !result || k <= 0)
+        return 0;
+    if (k > MAX_NEAREST) k = MAX_NEAREST;
+
+    // every node is pushed at most once
+    if (qtree->heap_capacity < qtree->num_nodes) {
+        QNodeDist *heap = realloc(qtree->heap, qtree->capacity * sizeof(QNodeDist));
+        if (!heap)
+            return 0;
+        qtree->heap = heap;
+        qtree->heap_capacity = qtree->capacity;
+    }
+
+    float dists[MAX_NEAREST];
+    int num_points = 0;
+    float bound = max_dist * max_dist;
+
+    int heap_size = 0;
+    float root_dist = _qtree_node_dist(qtree, 0, pos);
+    if (root_dist <= bound) {
+        _qtree_heap_push(qtree, &heap_size, (QNodeDist) { 0, root_dist });
+    }
+
+    while (heap_size > 0) {
+        QNodeDist item = _qtree_heap_pop(qtree, &heap_size);
+        if (item.dist > bound)
+            break;
+
+        QNode *n = &qtree->nodes[item.node];
+        index_stats_count(0, 1, n->num_points);
+        for (int b = n->bucket; b >= 0; b = qtree->buckets[b].next) {
+            QBucket *bucket = &qtree->buckets[b];
+            for (int i = 0; i < bucket->num_points; i++) {
+                float dx = bucket->xs[i] - pos.x;
+                float dy = bucket->ys[i] - pos.y;
+                float dist = dx * dx + dy * dy;
+                if (dist > bound)
+                    continue;
+
+                _index_push_nearest(result, dists, &num_points, k, _qtree_bucket_point(bucket, i), dist);
+                // with k points in hand only closer ones matter
+                if (num_points == k) {
+                    bound = dists[k - 1];
+                }
+            }
+        }
+
+        if (n->children >= 0) {
+            for (int c = 0; c < 4; c++) {
+                float dist = _qtree_node_dist(qtree, n->children + c, pos);
+                if (dist <= bound) {
+                    _qtree_heap_push(qtree, &heap_size, (QNodeDist) { n->children + c, dist });
+                }
+            }
+        }
+    }
+
+    return num_points;
+}
+
+void _qtree_heap_push(QTree *qtree, int *heap_size, QNodeDist item) {
+    QNodeDist *heap = qtree->heap;
+    int i = *heap_size;
+    *heap_size += 1;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent].dist <= item.dist)
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = item;
+}
+
+QNodeDist _qtree_heap_pop(QTree *qtree, int *heap_size) {
+    QNodeDist *heap = qtree->heap;
+    QNodeDist top = heap[0];
+    *heap_size -= 1;
+
+    QNodeDist last = heap[*heap_size];
+    int i = 0;
+    while (true) {
+        int child = i * 2 + 1;
+        if (child >= *heap_size)
+            break;
+        if (child + 1 < *heap_size && heap[child + 1].dist < heap[child].dist)
+            child += 1;
+        if (last.dist <= heap[child].dist)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+float _qtree_node_dist(QTree *qtree, int node, Vec2 pos) {
+    QRect loose = _qtree_loose_bounds(qtree->nodes[node].boundary);
+    float dx = fmaxf(fabsf(pos.x - loose.x) - loose.w, 0);
+    float dy = fmaxf(fabsf(pos.y - loose.y) - loose.h, 0);
+    return dx * dx + dy * dy;
+}
+
+bool qtree_visit_shape(QTree *qtree, QShape *shape, QueryVisitor visit, void *ctx) {
+    if (!qtree || !shape || !visit)
+        return false;
+    return _qtree_visit_shape(qtree, 0, shape, visit, ctx);
+}
+
+bool _qtree_visit_shape(QTree *qtree, int node, QShape *shape, QueryVisitor visit, void *ctx) {
+    QNode *n = &qtree->nodes[node];
+    if (!is_shape_overlap_rect(shape, _qtree_loose_bounds(n->boundary)))
+        return true;
+    index_stats_count(0, 1, n->num_points);
+
+    int hits[QBUCKET_POINTS];
+    for (int b = n->bucket; b >= 0; b = qtree->buckets[b].next) {
+        QBucket *bucket = &qtree->buckets[b];
+        int num_hits = _qtree_scan_shape(bucket, shape, hits);
+        for (int i = 0; i < num_hits; i++) {
+            if (!visit(_qtree_bucket_point(bucket, hits[i]), ctx))
+                return false;
+        }
+    }
+
+    if (n->children >= 0) {
+        for (int c = 0; c < 4; c++) {
+            if (!_qtree_visit_shape(qtree, n->children + c, shape, visit, ctx))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool _qtree_subdivide(QTree *qtree, int node) {
+    int children = _qtree_alloc_block(qtree);
+    if (children < 0)
+        return false;
+
+    float x = qtree->nodes[node].boundary.x;
+    float y = qtree->nodes[node].boundary.y;
+    float w = qtree->nodes[node].boundary.w;
+    float h = qtree->nodes[node].boundary.h;
+    int depth = qtree->nodes[node].depth + 1;
+
+    QRect tl = (QRect) { x - w/2, y - h/2, w/2, h/2 };
+    QRect tr = (QRect) { x + w/2, y - h/2, w/2, h/2 };
+    QRect bl = (QRect) { x - w/2, y + h/2, w/2, h/2 };
+    QRect br = (QRect) { x + w/2, y + h/2, w/2, h/2 };
+
+    qtree->nodes[children + 0] = (QNode) { tl, 0, -1, -1, node, depth };
+    qtree->nodes[children + 1] = (QNode) { tr, 0, -1, -1, node, depth };
+    qtree->nodes[children + 2] = (QNode) { bl, 0, -1, -1, node, depth };
+    qtree->nodes[children + 3] = (QNode) { br, 0, -1, -1, node, depth };
+
+    // Move the points down, a node below QTREE_MAX_DEPTH never holds more than one bucket
+    QPoint moved[QBUCKET_POINTS];
+    int num_moved = 0;
+    int b = qtree->nodes[node].bucket;
+    if (b >= 0) {
+        num_moved = qtree->buckets[b].num_points;
+        for (int i = 0; i < num_moved; i++) {
+            moved[i] = _qtree_bucket_point(&qtree->buckets[b], i);
+        }
+        _qtree_free_bucket(qtree, b);
+    }
+    qtree->nodes[node].bucket = -1;
+    qtree->nodes[node].num_points = 0;
+    qtree->nodes[node].children = children;
+
+    for (int i = 0; i < num_moved; i++) {
+        // one the climb can't place (rounding at the root's edge) stays under this node
+        if (!_qtree_insert(qtree, node, moved[i])) {
+            _qtree_insert_down(qtree, node, moved[i]);
+        }
+    }
+
+    return true;
+}
+
+bool _qtree_push_point(QTree *qtree, int node, QPoint pt) {
+    // Only the head bucket of a leaf can have room, the ones behind it are full
+    int head = qtree->nodes[node].bucket;
+    if (head < 0 || qtree->buckets[head].num_points >= QBUCKET_POINTS) {
+        int b = _qtree_alloc_bucket(qtree);
+        if (b < 0)
+            return false;
+        qtree->buckets[b].num_points = 0;
+        qtree->buckets[b].next = head;
+        qtree->nodes[node].bucket = b;
+        head = b;
+    }
+
+    QBucket *bucket = &qtree->buckets[head];
+    bucket->xs[bucket->num_points] = pt.x;
+    bucket->ys[bucket->num_points] = pt.y;
+    bucket->ids[bucket->num_points] = pt.id;
+    bucket->num_points += 1;
+    qtree->nodes[node].num_points += 1;
+    if (pt.id >= 0 && pt.id < qtree->id_capacity) {
+        qtree->id_node[pt.id] = node;
+    }
+    return true;
+}
+
+void _qtree_remove_at(QTree *qtree, int node, int b, int i) {
+    // Fill the hole with the last point of the head bucket so the others stay full
+    int head = qtree->nodes[node].bucket;
+    QBucket *head_bucket = &qtree->buckets[head];
+    int last = head_bucket->num_points - 1;
+    qtree->buckets[b].xs[i] = head_bucket->xs[last];
+    qtree->buckets[b].ys[i] = head_bucket->ys[last];
+    qtree->buckets[b].ids[i] = head_bucket->ids[last];
+    head_bucket->num_points -= 1;
+    qtree->nodes[node].num_points -= 1;
+
+    if (head_bucket->num_points == 0) {
+        qtree->nodes[node].bucket = head_bucket->next;
+        _qtree_free_bucket(qtree, head);
+    }
+}
+
+int _qtree_quadrant(QRect boundary, QPoint pt) {
+    // tl, tr, bl, br, same order as the children
+    return (pt.x >= boundary.x ? 1 : 0) + (pt.y >= boundary.y ? 2 : 0);
+}
+
+QRect _qtree_loose_bounds(QRect boundary) {
+    return (QRect) {
+        boundary.x, boundary.y,
+        boundary.w * QTREE_LOOSENESS, boundary.h * QTREE_LOOSENESS
+    };
+}
+
+int _qtree_alloc_block(QTree *qtree) {
+    // Reuse a block handed back by a remove
+    if (qtree->free_block >= 0) {
+        int block = qtree->free_block;
+        qtree->free_block = qtree->nodes[block].children;
+        return block;
+    }
+
+    if (qtree->num_nodes + 4 > qtree->capacity) {
+        int capacity = qtree->capacity * 2;
+        QNode *nodes = realloc(qtree->nodes, capacity * sizeof(QNode));
+        if (!nodes) {
+            printe("Error growing qtree node pool");
+            return -1;
+        }
+        qtree->nodes = nodes;
+        qtree->capacity = capacity;
+    }
+
+    int block = qtree->num_nodes;
+    qtree->num_nodes += 4;
+    return block;
+}
+
+void _qtree_free_block(QTree *qtree, int block) {
+    for (int c = 0; c < 4; c++) {
+        QNode *child = &qtree->nodes[block + c];
+        if (child->children >= 0) {
+            _qtree_free_block(qtree, child->children);
+        }
+        while (child->bucket >= 0) {
+            int next = qtree->buckets[child->bucket].next;
+            _qtree_free_bucket(qtree, child->bucket);
+            child->bucket = next;
+        }
+        child->num_points = 0;
+    }
+
+    // the free list is chained through the first node of each block
+    qtree->nodes[block].children = qtree->free_block;
+    qtree->free_block = block;
+}
+
+int _qtree_alloc_bucket(QTree *qtree) {
+    if (qtree->free_bucket >= 0) {
+        int b = qtree->free_bucket;
+        qtree->free_bucket = qtree->buckets[b].next;
+        return b;
+    }
+
+    if (qtree->num_buckets >= qtree->bucket_capacity) {
+        int capacity = qtree->bucket_capacity * 2;
+        QBucket *buckets = realloc(qtree->buckets, capacity * sizeof(QBucket));
+        if (!buckets) {
+            printe("Error growing qtree bucket pool");
+            return -1;
+        }
+        qtree->buckets = buckets;
+        qtree->bucket_capacity = capacity;
+    }
+
+    int b = qtree->num_buckets;
+    qtree->num_buckets += 1;
+    return b;
+}
+
+void _qtree_free_bucket(QTree *qtree, int b) {
+    qtree->buckets[b].num_points = 0;
+    qtree->buckets[b].next = qtree->free_bucket;
+    qtree->free_bucket = b;
+}
+
+int _qtree_count_points(QTree *qtree, int node, int *subtree_points) {
+    int count = qtree->nodes[node].num_points;
+    int children = qtree->nodes[node].children;
+    if (children >= 0) {
+        for (int c = 0; c < 4; c++) {
+            count += _qtree_count_points(qtree, children + c, subtree_points);
+        }
+    }
+    subtree_points[node] = count;
+    return count;
+}
+
+void _qtree_tree_stats(QTree *qtree, int node, IndexTreeStats *stats) {
+    QNode *n = &qtree->nodes[node];
+    stats->num_nodes += 1;
+    if (n->children < 0) {
+        _index_tree_stats_leaf(stats, n->depth, n->num_points);
+        return;
+    }
+    for (int c = 0; c < 4; c++) {
+        _qtree_tree_stats(qtree, n->children + c, stats);
+    }
+}
+
+QPoint _qtree_bucket_point(QBucket *bucket, int i) {
+    return (QPoint) { bucket->xs[i], bucket->ys[i], bucket->ids[i] };
+}
+
+/**
+ * Leaf scans, test a whole bucket a vector at a time and write the slots that matched into hits.
+ * The tests are the same math as is_rect_contains_point / is_shape_contains_point,
+ * points sitting right on an edge can still land differently if the compiler fuses the scalar one.
+ * Builds without SSE2 (wasm, arm) take the scalar loop.
+ */
+#ifdef SCAN_LANES
+// Compress store, appends the slot of every set lane that's below count
+static inline int _scan_compress(int mask, int base, int count, int *hits, int num_hits) {
+    if (count - base < SCAN_LANES) {
+        mask &= (1 << (count - base)) - 1;
+    }
+    while (mask) {
+        hits[num_hits++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return num_hits;
+}
+#endif
+
+int _qtree_scan_rect(QBucket *bucket, QRect range, int *hits) {
+    int num_hits = 0;
+#ifdef SCAN_LANES
+    ScanVec min_x = scan_set(range.x - range.w);
+    ScanVec max_x = scan_set(range.x + range.w);
+    ScanVec min_y = scan_set(range.y - range.h);
+    ScanVec max_y = scan_set(range.y + range.h);
+    for (int i = 0; i < bucket->num_points; i += SCAN_LANES) {
+        ScanVec x = scan_load(bucket->xs + i);
+        ScanVec y = scan_load(bucket->ys + i);
+        ScanVec in = scan_and(
+            scan_and(scan_le(min_x, x), scan_le(x, max_x)),
+            scan_and(scan_le(min_y, y), scan_le(y, max_y))
+        );
+        num_hits = _scan_compress(scan_mask(in), i, bucket->num_points, hits, num_hits);
+    }
+#else
+    for (int i = 0; i < bucket->num_points; i++) {
+        if (is_rect_contains_point(range, _qtree_bucket_point(bucket, i))) {
+            hits[num_hits++] = i;
+        }
+    }
+#endif
+    return num_hits;
+}
+
+int _qtree_scan_shape(QBucket *bucket, QShape *shape, int *hits) {
+    int num_hits = 0;
+#ifdef SCAN_LANES
+    ScanVec zero = scan_set(0);
+    ScanVec center_x = scan_set(shape->center.x);
+    ScanVec center_y = scan_set(shape->center.y);
+    ScanVec radius_sqr = scan_set(shape->radius_sqr);
+    ScanVec dir_x = scan_set(shape->dir.x);
+    ScanVec dir_y = scan_set(shape->dir.y);
+    ScanVec length = scan_set(shape->length);
+    ScanVec left_x = scan_set(shape->left_normal.x);
+    ScanVec left_y = scan_set(shape->left_normal.y);
+    ScanVec left_offset = scan_set(shape->left_offset);
+    ScanVec right_x = scan_set(shape->right_normal.x);
+    ScanVec right_y = scan_set(shape->right_normal.y);
+    ScanVec right_offset = scan_set(shape->right_offset);
+
+    for (int i = 0; i < bucket->num_points; i += SCAN_LANES) {
+        ScanVec x = scan_load(bucket->xs + i);
+        ScanVec y = scan_load(bucket->ys + i);
+        ScanVec dx = scan_sub(x, center_x);
+        ScanVec dy = scan_sub(y, center_y);
+
+        ScanVec in = zero;
+        switch (shape->type) {
+            case SHAPE_CIRCLE:
+                in = scan_le(scan_add(scan_mul(dx, dx), scan_mul(dy, dy)), radius_sqr);
+                break;
+            case SHAPE_SEGMENT: {
+                ScanVec t = scan_add(scan_mul(dx, dir_x), scan_mul(dy, dir_y));
+                t = scan_min(scan_max(t, zero), length);
+                ScanVec ox = scan_sub(dx, scan_mul(dir_x, t));
+                ScanVec oy = scan_sub(dy, scan_mul(dir_y, t));
+                in = scan_le(scan_add(scan_mul(ox, ox), scan_mul(oy, oy)), radius_sqr);
+                break;
+            }
+            case SHAPE_CONE: {
+                ScanVec in_radius = scan_le(scan_add(scan_mul(dx, dx), scan_mul(dy, dy)), radius_sqr);
+                ScanVec in_left = scan_le(left_offset, scan_add(scan_mul(left_x, x), scan_mul(left_y, y)));
+                ScanVec in_right = scan_le(right_offset, scan_add(scan_mul(right_x, x), scan_mul(right_y, y)));
+                ScanVec in_sides = shape->is_wide ? scan_or(in_left, in_right) : scan_and(in_left, in_right);
+                in = scan_and(in_radius, in_sides);
+                break;
+            }
+        }
+        num_hits = _scan_compress(scan_mask(in), i, bucket->num_points, hits, num_hits);
+    }
+#else
+    for (int i = 0; i < bucket->num_points; i++) {
+        if (is_shape_contains_point(shape, _qtree_bucket_point(bucket, i))) {
+            hits[num_hits++] = i;
+        }
+    }
+#endif
+    return num_hits;
+}
+
+// MARK: :grid
+/**
+ * Uniform grid hashed into a fixed number of buckets, so it covers the whole world without bounds.
+ * 
+ * Inserts and updates are staged and laid out bucket by bucket with a counting sort on grid_build,
+ * queries only walk the buckets of the cells their range overlaps and see the layout of the last build.
+ * Different cells can share a bucket, points are only accepted for the cell being visited
+ * so nothing is reported twice.
+ *
+ * Point ids must be unique and below capacity, they key updates and removals.
+ */
+
+SGrid *grid_create(float cell_size, int capacity) {
+    SGrid *grid = malloc(sizeof(SGrid));
+    if (!grid) return NULL;
+
+    int num_buckets = 64;
+    while (num_buckets < capacity * 2) {
+        num_buckets *= 2;
+    }
+
+    *grid = (SGrid) {
+        .cell_size = cell_size,
+        .inv_cell_size = 1.0f / cell_size,
+        .num_buckets = num_buckets,
+        .bucket_start = malloc((num_buckets + 1) * sizeof(int)),
+        .bucket_count = malloc(num_buckets * sizeof(int)),
+        .points = malloc(capacity * sizeof(QPoint)),
+        .staged = malloc(capacity * sizeof(QPoint)),
+        .point_bucket = malloc(capacity * sizeof(int)),
+        .id_bucket = malloc(capacity * sizeof(int)),
+        .id_staged = malloc(capacity * sizeof(int)),
+        .num_points = 0,
+        .num_staged = 0,
+        .capacity = capacity,
+    };
+
+    if (!grid->bucket_start || !grid->bucket_count || !grid->points || !grid->staged || 
+            !grid->point_bucket || !grid->id_bucket || !grid->id_staged) {
+        grid_destroy(grid);
+        return NULL;
+    }
+
+    memset(grid->bucket_start, 0, (num_buckets + 1) * sizeof(int));
+    grid_clear(grid);
+    return grid;
+}
+
+void grid_destroy(SGrid *grid) {
+    if (!grid) return;
+
+    free(grid->bucket_start);
+    free(grid->bucket_count);
+    free(grid->points);
+    free(grid->staged);
+    free(grid->point_bucket);
+    free(grid->id_bucket);
+    free(grid->id_staged);
+    free(grid);
+}
+
+void grid_clear(SGrid *grid) {
+    memset(grid->bucket_count, 0, grid->num_buckets * sizeof(int));
+    for (int i = 0; i < grid->capacity; i++) {
+        grid->id_bucket[i] = -1;
+        grid->id_staged[i] = -1;
+    }
+    grid->num_points = 0;
+    grid->num_staged = 0;
+}
+
+bool grid_insert(SGrid *grid, QPoint pt) {
+    return grid_update(grid, pt);
+}
+
+bool grid_update(SGrid *grid, QPoint pt) {
+    if (pt.id < 0 || pt.id >= grid->capacity)
+        return false;
+
+    int staged = grid->id_staged[pt.id];
+    if (staged >= 0) {
+        grid->staged[staged] = pt;
+        return true;
+    }
+
+    grid->staged[grid->num_staged] = pt;
+    grid->id_staged[pt.id] = grid->num_staged;
+    grid->num_staged += 1;
+    return true;
+}
+
+bool grid_remove_id(SGrid *grid, int id) {
+    if (id < 0 || id >= grid->capacity)
+        return false;
+
+    bool is_removed = false;
+    if (grid->id_staged[id] >= 0) {
+        is_removed = _grid_unstage(grid, grid->id_staged[id]);
+    }
+
+    int bucket = grid->id_bucket[id];
+    if (bucket >= 0) {
+        int start = grid->bucket_start[bucket];
+        int count = grid->bucket_count[bucket];
+        for (int i = start; i < start + count; i++) {
+            if (grid->points[i].id == id) {
+                is_removed = _grid_remove_at(grid, bucket, i);
+                break;
+            }
+        }
+    }
+    return is_removed;
+}
+
+bool grid_visit(SGrid *grid, QRect range, QueryVisitor visit, void *ctx) {
+    if (!grid || !visit)
+        return false;
+
+    int cx0 = _grid_cell(grid, range.x - range.w);
+    int cx1 = _grid_cell(grid, range.x + range.w);
+    int cy0 = _grid_cell(grid, range.y - range.h);
+    int cy1 = _grid_cell(grid, range.y + range.h);
+
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            int bucket = _grid_bucket(grid, cx, cy);
+            int start = grid->bucket_start[bucket];
+            int end = start + grid->bucket_count[bucket];
+            index_stats_count(0, 1, end - start);
+
+            for (int i = start; i < end; i++) {
+                QPoint pt = grid->points[i];
+                if (!is_rect_contains_point(range, pt))
+                    continue;
+                // the bucket can be shared with other cells
+                if (_grid_cell(grid, pt.x) != cx || _grid_cell(grid, pt.y) != cy)
+                    continue;
+                if (!visit(pt, ctx))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool grid_visit_shape(SGrid *grid, QShape *shape, QueryVisitor visit, void *ctx) {
+    if (!grid || !shape || !visit)
+        return false;
+
+    QRect range = shape->bounds;
+    int cx0 = _grid_cell(grid, range.x - range.w);
+    int cx1 = _grid_cell(grid, range.x + range.w);
+    int cy0 = _grid_cell(grid, range.y - range.h);
+    int cy1 = _grid_cell(grid, range.y + range.h);
+    float half = grid->cell_size / 2;
+
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            // skip the cells of the bounding box the shape doesn't reach
+            QRect cell = { cx * grid->cell_size + half, cy * grid->cell_size + half, half, half };
+            if (!is_shape_overlap_rect(shape, cell))
+                continue;
+
+            int bucket = _grid_bucket(grid, cx, cy);
+            int start = grid->bucket_start[bucket];
+            int end = start + grid->bucket_count[bucket];
+            index_stats_count(0, 1, end - start);
+
+            for (int i = start; i < end; i++) {
+                QPoint pt = grid->points[i];
+                if (!is_shape_contains_point(shape, pt))
+                    continue;
+                // the bucket can be shared with other cells
+                if (_grid_cell(grid, pt.x) != cx || _grid_cell(grid, pt.y) != cy)
+                    continue;
+                if (!visit(pt, ctx))
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * DDA walk over the cells the segment passes through (Amanatides & Woo).
+ * A thick segment also needs the cells within its radius, those are the square block of
+ * `reach` cells around each walked cell. The walk only moves forward on each axis so the steps
+ * that cover a given cell are consecutive, a cell the previous block already covered is skipped.
+ */
+bool grid_visit_segment(SGrid *grid, QShape *segment, QueryVisitor visit, void *ctx) {
+    if (!grid || !segment || !visit)
+        return false;
+
+    Vec2 start = segment->center;
+    Vec2 end = point_at_dist(start, segment->dir, segment->length);
+    int cx = _grid_cell(grid, start.x);
+    int cy = _grid_cell(grid, start.y);
+    int num_steps = abs(_grid_cell(grid, end.x) - cx) + abs(_grid_cell(grid, end.y) - cy);
+    int reach = (int) ceilf(segment->radius * grid->inv_cell_size);
+
+    int step_x = segment->dir.x > 0 ? 1 : -1;
+    int step_y = segment->dir.y > 0 ? 1 : -1;
+    float cs = grid->cell_size;
+    // distance along the segment to the next cell border on each axis, and between borders
+    float t_max_x = segment->inv_dir.x != 0 ? ((cx + (step_x > 0)) * cs - start.x) * segment->inv_dir.x : FLT_MAX;
+    float t_max_y = segment->inv_dir.y != 0 ? ((cy + (step_y > 0)) * cs - start.y) * segment->inv_dir.y : FLT_MAX;
+    float t_delta_x = segment->inv_dir.x != 0 ? cs * fabsf(segment->inv_dir.x) : FLT_MAX;
+    float t_delta_y = segment->inv_dir.y != 0 ? cs * fabsf(segment->inv_dir.y) : FLT_MAX;
+
+    int prev_cx = 0;
+    int prev_cy = 0;
+    for (int s = 0; s <= num_steps; s++) {
+        for (int ny = cy - reach; ny <= cy + reach; ny++) {
+            for (int nx = cx - reach; nx <= cx + reach; nx++) {
+                if (s > 0 && abs(nx - prev_cx) <= reach && abs(ny - prev_cy) <= reach)
+                    continue;
+
+                int bucket = _grid_bucket(grid, nx, ny);
+                int bucket_start = grid->bucket_start[bucket];
+                int bucket_end = bucket_start + grid->bucket_count[bucket];
+                index_stats_count(0, 1, bucket_end - bucket_start);
+
+                for (int i = bucket_start; i < bucket_end; i++) {
+                    QPoint pt = grid->points[i];
+                    if (!is_shape_contains_point(segment, pt))
+                        continue;
+                    // the bucket can be shared with other cells
+                    if (_grid_cell(grid, pt.x) != nx || _grid_cell(grid, pt.y) != ny)
+                        continue;
+                    if (!visit(pt, ctx))
+                        return false;
+                }
+            }
+        }
+
+        prev_cx = cx;
+        prev_cy = cy;
+        if (t_max_x < t_max_y) {
+            cx += step_x;
+            t_max_x += t_delta_x;
+        } else {
+            cy += step_y;
+            t_max_y += t_delta_y;
+        }
+    }
+    return true;
+}
+
+/**
+ * Walks square rings of cells outwards from the cell holding pos.
+ * After a ring is done every unvisited point is at least as far as the edge of the
+ * block walked so far, so the search stops once the k-th best is closer than that.
+ */
+int grid_k_nearest(SGrid *grid, Vec2 pos, float max_dist, int k, QPoint *result) {
+    if (!grid || !result || k <= 0)
+        return 0;
+    if (k > MAX_NEAREST) k = MAX_NEAREST;
+
+    float dists[MAX_NEAREST];
+    int num_points = 0;
+    float bound = max_dist * max_dist;
+
+    int pcx = _grid_cell(grid, pos.x);
+    int pcy = _grid_cell(grid, pos.y);
+    int max_ring = (int) ceilf(max_dist * grid->inv_cell_size) + 1;
+
+    for (int r = 0; r <= max_ring; r++) {
+        for (int cy = pcy - r; cy <= pcy + r; cy++) {
+            // inner rows only have the two side cells on this ring
+            int step = (cy == pcy - r || cy == pcy + r) ? 1 : 2 * r;
+            for (int cx = pcx - r; cx <= pcx + r; cx += step) {
+                int bucket = _grid_bucket(grid, cx, cy);
+                int start = grid->bucket_start[bucket];
+                int end = start + grid->bucket_count[bucket];
+                index_stats_count(0, 1, end - start);
+
+                for (int i = start; i < end; i++) {
+                    QPoint pt = grid->points[i];
+                    float dx = pt.x - pos.x;
+                    float dy = pt.y - pos.y;
+                    float dist = dx * dx + dy * dy;
+                    if (dist > bound)
+                        continue;
+                    // the bucket can be shared with other cells
+                    if (_grid_cell(grid, pt.x) != cx || _grid_cell(grid, pt.y) != cy)
+                        continue;
+
+                    _index_push_nearest(result, dists, &num_points, k, pt, dist);
+                    if (num_points == k) {
+                        bound = dists[k - 1];
+                    }
+                }
+            }
+        }
+
+        // distance from pos to the outside of the block of rings visited so far
+        float cs = grid->cell_size;
+        float edge = fminf(
+            fminf(pos.x - (pcx - r) * cs, (pcx + r + 1) * cs - pos.x),
+            fminf(pos.y - (pcy - r) * cs, (pcy + r + 1) * cs - pos.y)
+        );
+        if (edge * edge >= bound)
+            break;
+    }
+
+    return num_points;
+}
+
+void grid_build(SGrid *grid) {
+    if (grid->num_staged == 0)
+        return;
+
+    // Gather the points already in the buckets that weren't moved since the last build
+    int n = grid->num_staged;
+    for (int b = 0; b < grid->num_buckets; b++) {
+        int start = grid->bucket_start[b];
+        for (int i = start; i < start + grid->bucket_count[b]; i++) {
+            QPoint pt = grid->points[i];
+            if (grid->id_staged[pt.id] < 0) {
+                grid->staged[n] = pt;
+                n++;
+            }
+        }
+    }
+
+    // Counting sort by bucket
+    memset(grid->bucket_count, 0, grid->num_buckets * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        QPoint pt = grid->staged[i];
+        int bucket = _grid_bucket(grid, _grid_cell(grid, pt.x), _grid_cell(grid, pt.y));
+        grid->point_bucket[i] = bucket;
+        grid->bucket_count[bucket] += 1;
+    }
+
+    int offset = 0;
+    for (int b = 0; b < grid->num_buckets; b++) {
+        grid->bucket_start[b] = offset;
+        offset += grid->bucket_count[b];
+    }
+    grid->bucket_start[grid->num_buckets] = offset;
+
+    // bucket_count doubles as the write cursor and ends up as the count again
+    memset(grid->bucket_count, 0, grid->num_buckets * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        int bucket = grid->point_bucket[i];
+        QPoint pt = grid->staged[i];
+        grid->points[grid->bucket_start[bucket] + grid->bucket_count[bucket]] = pt;
+        grid->bucket_count[bucket] += 1;
+        grid->id_bucket[pt.id] = bucket;
+    }
+
+    for (int i = 0; i < grid->num_staged; i++) {
+        grid->id_staged[grid->staged[i].id] = -1;
+    }
+    grid->num_points = n;
+    grid->num_staged = 0;
+}
+
+bool _grid_unstage(SGrid *grid, int staged) {
+    grid->id_staged[grid->staged[staged].id] = -1;
+    grid->staged[staged] = grid->staged[grid->num_staged - 1];
+    grid->num_staged -= 1;
+    if (staged < grid->num_staged) {
+        grid->id_staged[grid->staged[staged].id] = staged;
+    }
+    return true;
+}
+
+bool _grid_remove_at(SGrid *grid, int bucket, int i) {
+    // Unordered remove within the bucket, the bucket keeps its slot range until the next build
+    int last = grid->bucket_start[bucket] + grid->bucket_count[bucket] - 1;
+    grid->id_bucket[grid->points[i].id] = -1;
+    grid->points[i] = grid->points[last];
+    grid->bucket_count[bucket] -= 1;
+    grid->num_points -= 1;
+    return true;
+}
+
+int _grid_cell(SGrid *grid, float v) {
+    return (int) floorf(v * grid->inv_cell_size);
+}
+
+int _grid_bucket(SGrid *grid, int cx, int cy) {
+    unsigned int h = ((unsigned int) cx * 73856093u) ^ ((unsigned int) cy * 19349663u);
+    return (int) (h & (unsigned int) (grid->num_buckets - 1));
+}
+
+// MARK: :linear :ltree
+/**
+ * Linear quadtree, the tree is never stored.
+ * Every point gets a 32 bit Morton key (16 bits per axis over the boundary square) and the
+ * points are kept sorted by key, so the points of any quadtree node are one contiguous run:
+ * a node at level L is a 2L bit key prefix and its run is found with a binary search.
+ *
+ * Inserts, updates and removals only touch the unsorted live array, ltree_build re-keys
+ * everything and radix sorts it in O(n) with no allocation. Queries see the last build,
+ * same as the grid.
+ *
+ * Point ids must be unique and below capacity, points outside the boundary are rejected.
+ */
+
+LTree *ltree_create(QRect boundary, int capacity) {
+    LTree *ltree = malloc(sizeof(LTree));
+    if (!ltree) return NULL;
+
+    *ltree = (LTree) {
+        .points = malloc(capacity * sizeof(QPoint)),
+        .id_slot = malloc(capacity * sizeof(int)),
+        .num_points = 0,
+        .capacity = capacity,
+        .keys = malloc(capacity * sizeof(unsigned int)),
+        .sorted = malloc(capacity * sizeof(QPoint)),
+        .num_sorted = 0,
+        .leaf_points = LTREE_LEAF_POINTS,
+        .tmp_keys = malloc(capacity * sizeof(unsigned int)),
+        .order = malloc(capacity * sizeof(int)),
+        .tmp_order = malloc(capacity * sizeof(int)),
+        .is_dirty = false
+    };
+
+    if (!ltree->points || !ltree->id_slot || !ltree->keys || !ltree->sorted ||
+            !ltree->tmp_keys || !ltree->order || !ltree->tmp_order) {
+        ltree_destroy(ltree);
+        return NULL;
+    }
+
+    ltree_reset_boundary(ltree, boundary);
+    ltree_clear(ltree);
+    return ltree;
+}
+
+void ltree_destroy(LTree *ltree) {
+    if (!ltree) return;
+
+    free(ltree->points);
+    free(ltree->id_slot);
+    free(ltree->keys);
+    free(ltree->sorted);
+    free(ltree->tmp_keys);
+    free(ltree->order);
+    free(ltree->tmp_order);
+    free(ltree);
+}
+
+void ltree_clear(LTree *ltree) {
+    for (int i = 0; i < ltree->capacity; i++) {
+        ltree->id_slot[i] = -1;
+    }
+    ltree->num_points = 0;
+    ltree->num_sorted = 0;
+    ltree->is_dirty = false;
+}
+
+void ltree_reset_boundary(LTree *ltree, QRect rect) {
+    // keys are quantized over a square so both axes get the same precision
+    float half = fmaxf(rect.w, rect.h);
+    ltree->boundary = rect;
+    ltree->min_x = rect.x - half;
+    ltree->min_y = rect.y - half;
+    ltree->size = half * 2;
+    ltree->is_dirty = true;
+}
+
+bool ltree_insert(LTree *ltree, QPoint pt) {
+    return ltree_update(ltree, pt);
+}
+
+bool ltree_update(LTree *ltree, QPoint pt) {
+    if (!ltree || pt.id < 0 || pt.id >= ltree->capacity)
+        return false;
+
+    // moved out of the boundary, it drops out like it would from the qtree
+    if (!is_rect_contains_point(ltree->boundary, pt)) {
+        ltree_remove_id(ltree, pt.id);
+        return false;
+    }
+
+    int slot = ltree->id_slot[pt.id];
+    if (slot < 0) {
+        slot = ltree->num_points;
+        ltree->id_slot[pt.id] = slot;
+        ltree->num_points += 1;
+    }
+    ltree->points[slot] = pt;
+    ltree->is_dirty = true;
+    return true;
+}
+
+bool ltree_remove_id(LTree *ltree, int id) {
+    if (!ltree || id < 0 || id >= ltree->capacity)
+        return false;
+
+    int slot = ltree->id_slot[id];
+    if (slot < 0)
+        return false;
+
+    // Unordered remove, the last point takes the slot
+    ltree->num_points -= 1;
+    ltree->points[slot] = ltree->points[ltree->num_points];
+    ltree->id_slot[ltree->points[slot].id] = slot;
+    ltree->id_slot[id] = -1;
+    ltree->is_dirty = true;
+    return true;
+}
+
+void ltree_build(LTree *ltree) {
+    if (!ltree->is_dirty)
+        return;
+
+    int n = ltree->num_points;
+    for (int i = 0; i < n; i++) {
+        ltree->keys[i] = _ltree_key(ltree, ltree->points[i].x, ltree->points[i].y);
+        ltree->order[i] = i;
+    }
+    _index_radix_sort(ltree->keys, ltree->order, n, ltree->tmp_keys, ltree->tmp_order);
+
+    for (int i = 0; i < n; i++) {
+        ltree->sorted[i] = ltree->points[ltree->order[i]];
+    }
+    ltree->num_sorted = n;
+    ltree->is_dirty = false;
+}
+
+bool ltree_visit(LTree *ltree, QRect range, QueryVisitor visit, void *ctx) {
+    if (!ltree || !visit)
+        return false;
+    return _ltree_visit(ltree, 0, 0, _ltree_root(ltree), 0, ltree->num_sorted, range, visit, ctx);
+}
+
+/**
+ * Walks the implicit tree, [lo, hi) is the run of sorted points under the node.
+ * Small runs are scanned directly so the walk never goes deeper than it has to.
+ */
+bool _ltree_visit(LTree *ltree, unsigned int prefix, int level, QRect cell, int lo, int hi, QRect range, QueryVisitor visit, void *ctx) {
+    if (lo >= hi || !is_rect_overlap(_ltree_loose(ltree, cell), range))
+        return true;
+
+    bool is_leaf = hi - lo <= ltree->leaf_points || level == LTREE_MAX_LEVEL;
+    index_stats_count(0, 1, is_leaf ? hi - lo : 0);
+
+    if (is_leaf) {
+        for (int i = lo; i < hi; i++) {
+            if (is_rect_contains_point(range, ltree->sorted[i])) {
+                if (!visit(ltree->sorted[i], ctx))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    int bounds[5];
+    _ltree_split(ltree, prefix, level, lo, hi, bounds);
+    for (int c = 0; c < 4; c++) {
+        if (!_ltree_visit(ltree, prefix * 4 + c, level + 1, _ltree_child_rect(cell, c), bounds[c], bounds[c + 1], range, visit, ctx))
+            return false;
+    }
+    return true;
+}
+
+bool ltree_visit_shape(LTree *ltree, QShape *shape, QueryVisitor visit, void *ctx) {
+    if (!ltree || !shape || !visit)
+        return false;
+    return _ltree_visit_shape(ltree, 0, 0, _ltree_root(ltree), 0, ltree->num_sorted, shape, visit, ctx);
+}
+
+bool _ltree_visit_shape(LTree *ltree, unsigned int prefix, int level, QRect cell, int lo, int hi, QShape *shape, QueryVisitor visit, void *ctx) {
+    if (lo >= hi || !is_shape_overlap_rect(shape, _ltree_loose(ltree, cell)))
+        return true;
+
+    bool is_leaf = hi - lo <= ltree->leaf_points || level == LTREE_MAX_LEVEL;
+    index_stats_count(0, 1, is_leaf ? hi - lo : 0);
+
+    if (is_leaf) {
+        for (int i = lo; i < hi; i++) {
+            if (is_shape_contains_point(shape, ltree->sorted[i])) {
+                if (!visit(ltree->sorted[i], ctx))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    int bounds[5];
+    _ltree_split(ltree, prefix, level, lo, hi, bounds);
+    for (int c = 0; c < 4; c++) {
+        if (!_ltree_visit_shape(ltree, prefix * 4 + c, level + 1, _ltree_child_rect(cell, c), bounds[c], bounds[c + 1], shape, visit, ctx))
+            return false;
+    }
+    return true;
+}
+
+bool ltree_visit_segment(LTree *ltree, QShape *segment, QueryVisitor visit, void *ctx) {
+    if (!ltree || !segment || !visit)
+        return false;
+    return _ltree_visit_segment(ltree, 0, 0, _ltree_root(ltree), 0, ltree->num_sorted, segment, visit, ctx);
+}
+
+// Same as _ltree_visit but children are walked in the order the segment enters them
+bool _ltree_visit_segment(LTree *ltree, unsigned int prefix, int level, QRect cell, int lo, int hi, QShape *segment, QueryVisitor visit, void *ctx) {
+    if (lo >= hi)
+        return true;
+
+    float t_enter;
+    if (!_shape_segment_entry(segment, _ltree_loose(ltree, cell), &t_enter))
+        return true;
+
+    bool is_leaf = hi - lo <= ltree->leaf_points || level == LTREE_MAX_LEVEL;
+    index_stats_count(0, 1, is_leaf ? hi - lo : 0);
+
+    if (is_leaf) {
+        for (int i = lo; i < hi; i++) {
+            if (!is_shape_contains_point(segment, ltree->sorted[i]))
+                continue;
+            if (!visit(ltree->sorted[i], ctx))
+                return false;
+        }
+        return true;
+    }
+
+    int bounds[5];
+    int order[4];
+    float entry[4];
+    int num_hit = 0;
+    _ltree_split(ltree, prefix, level, lo, hi, bounds);
+    for (int c = 0; c < 4; c++) {
+        float t;
+        if (bounds[c] >= bounds[c + 1] || !_shape_segment_entry(segment, _ltree_loose(ltree, _ltree_child_rect(cell, c)), &t))
+            continue;
+
+        int j = num_hit;
+        while (j > 0 && entry[j - 1] > t) {
+            order[j] = order[j - 1];
+            entry[j] = entry[j - 1];
+            j--;
+        }
+        order[j] = c;
+        entry[j] = t;
+        num_hit++;
+    }
+
+    for (int i = 0; i < num_hit; i++) {
+        int c = order[i];
+        if (!_ltree_visit_segment(ltree, prefix * 4 + c, level + 1, _ltree_child_rect(cell, c), bounds[c], bounds[c + 1], segment, visit, ctx))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Depth first branch and bound, children are walked nearest first and skipped once
+ * they're further than the k-th best point. Needs no heap so it's safe to call from anywhere.
+ */
+int ltree_k_nearest(LTree *ltree, Vec2 pos, float max_dist, int k, QPoint *result) {
+    if (!ltree || !result || k <= 0)
+        return 0;
+    if (k > MAX_NEAREST) k = MAX_NEAREST;
+
+    float dists[MAX_NEAREST];
+    int num_points = 0;
+    float bound = max_dist * max_dist;
+    _ltree_k_nearest(ltree, 0, 0, _ltree_root(ltree), 0, ltree->num_sorted, pos, k, result, dists, &num_points, &bound);
+    return num_points;
+}
+
+void _ltree_k_nearest(LTree *ltree, unsigned int prefix, int level, QRect cell, int lo, int hi, Vec2 pos, int k,
+        QPoint *result, float *dists, int *num_points, float *bound) {
+    if (lo >= hi)
+        return;
+
+    bool is_leaf = hi - lo <= ltree->leaf_points || level == LTREE_MAX_LEVEL;
+    index_stats_count(0, 1, is_leaf ? hi - lo : 0);
+
+    if (is_leaf) {
+        for (int i = lo; i < hi; i++) {
+            float dx = ltree->sorted[i].x - pos.x;
+            float dy = ltree->sorted[i].y - pos.y;
+            float dist = dx * dx + dy * dy;
+            if (dist > *bound)
+                continue;
+
+            _index_push_nearest(result, dists, num_points, k, ltree->sorted[i], dist);
+            if (*num_points == k) {
+                *bound = dists[k - 1];
+            }
+        }
+        return;
+    }
+
+    int bounds[5];
+    int order[4];
+    float child_dist[4];
+    int num_children = 0;
+    _ltree_split(ltree, prefix, level, lo, hi, bounds);
+    for (int c = 0; c < 4; c++) {
+        if (bounds[c] >= bounds[c + 1])
+            continue;
+
+        QRect rect = _ltree_loose(ltree, _ltree_child_rect(cell, c));
+        float dx = fmaxf(fabsf(pos.x - rect.x) - rect.w, 0);
+        float dy = fmaxf(fabsf(pos.y - rect.y) - rect.h, 0);
+        float dist = dx * dx + dy * dy;
+
+        int j = num_children;
+        while (j > 0 && child_dist[j - 1] > dist) {
+            order[j] = order[j - 1];
+            child_dist[j] = child_dist[j - 1];
+            j--;
+        }
+        order[j] = c;
+        child_dist[j] = dist;
+        num_children++;
     }
 
-    // Camera scroll
-    float mouse_diff = GetMouseWheelMove();
-    if (mouse_diff != 0 && *screen == IN_GAME) {
-        if (mouse_diff > 0) {
-            state->camera.zoom += 0.1;
-        } else {
-            state->camera.zoom -= 0.1;
-        } 
+    for (int i = 0; i < num_children; i++) {
+        // the bound only shrinks, the rest are even further
+        if (child_dist[i] > *bound)
+            break;
+        int c = order[i];
+        _ltree_k_nearest(ltree, prefix * 4 + c, level + 1, _ltree_child_rect(cell, c), bounds[c], bounds[c + 1], pos, k, result, dists, num_points, bound);
     }
 }
 
-// :resize
-void handle_window_resize() {
-    int ww = GetScreenWidth();
-    int wh = GetScreenHeight();
-
-    float target_aspect = (float)VIRT_WIDTH / (float)VIRT_HEIGHT;
-    int scaled_width, scaled_height;
+unsigned int _ltree_key(LTree *ltree, float x, float y) {
+    float scale = 65536.0f / ltree->size;
+    int qx = (int) ((x - ltree->min_x) * scale);
+    int qy = (int) ((y - ltree->min_y) * scale);
+    qx = qx < 0 ? 0 : (qx > 0xFFFF ? 0xFFFF : qx);
+    qy = qy < 0 ? 0 : (qy > 0xFFFF ? 0xFFFF : qy);
+    return _index_morton_code(qx, qy);
+}
 
-    if ((float)ww / wh > target_aspect) {
-        // Window wider than target aspect ratio
-        scaled_height = wh;
-        scaled_width = (int)(scaled_height * target_aspect);
-    } else {
-        // Window taller than target aspect ratio
-        scaled_width = ww;
-        scaled_height = (int)(scaled_width / target_aspect);
+// Leaves are the runs the queries scan, same rule as _ltree_visit
+void _ltree_tree_stats(LTree *ltree, unsigned int prefix, int level, int lo, int hi, IndexTreeStats *stats) {
+    stats->num_nodes += 1;
+    if (hi - lo <= ltree->leaf_points || level == LTREE_MAX_LEVEL) {
+        _index_tree_stats_leaf(stats, level, hi - lo);
+        return;
     }
 
-    state->dest_rect = (Rect) {
-        (ww - scaled_width) / 2,
-        (wh - scaled_height) / 2,
-        scaled_width, scaled_height
-    };
+    int bounds[5];
+    _ltree_split(ltree, prefix, level, lo, hi, bounds);
+    for (int c = 0; c < 4; c++) {
+        _ltree_tree_stats(ltree, prefix * 4 + c, level + 1, bounds[c], bounds[c + 1], stats);
+    }
 }
 
-// :joystick
-void handle_virtual_joystick_input() {
-    // button 0 / touch input -> left click
+// First key under the node, prefix is the node's top 2 * level bits
+unsigned int _ltree_prefix_start(unsigned int prefix, int level) {
+    // 64 bit so the root's shift by 32 is defined
+    return (unsigned int) ((unsigned long long) prefix << (32 - 2 * level));
+}
 
-    if (IsMouseButtonPressed(0)) {
-        state->is_joystick_enabled = true;
-        state->touch_down_pos = GetMousePosition();
-    }
-    if (IsMouseButtonReleased(0)) {
-        state->is_joystick_enabled = false;
-        state->touch_down_pos = Vector2Zero();
+// Splits the run of a node into the runs of its 4 children, child c is [bounds[c], bounds[c + 1])
+void _ltree_split(LTree *ltree, unsigned int prefix, int level, int lo, int hi, int *bounds) {
+    bounds[0] = lo;
+    for (int c = 1; c < 4; c++) {
+        bounds[c] = _ltree_lower_bound(ltree, bounds[c - 1], hi, _ltree_prefix_start(prefix * 4 + c, level + 1));
     }
+    bounds[4] = hi;
+}
 
-    if (state->is_joystick_enabled && IsMouseButtonDown(0)) {
-        state->joystick_direction = Vector2Subtract(GetMousePosition(), state->touch_down_pos);
-        state->joystick_direction = Vector2Normalize(state->joystick_direction);
+// First index in [lo, hi) whose key is >= key
+int _ltree_lower_bound(LTree *ltree, int lo, int hi, unsigned int key) {
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ltree->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    return lo;
 }
 
-// MARK: :quadtree :qtree
-/**
- * This is a simple quadtree impl following
- * https://www.youtube.com/watch?v=OJxEcs0w_kE
- * Original code: https://editor.p5js.org/codingtrain/sketches/CDMjU0GIK
- * 
- * Its used to store all enemy locations that are currently visible on the screen,
- * When the player moves around, the boundaries of the qtree are also updated
- * TODO might have to actually free the quadtree after certain clears/boundary-resets?
- */
+QRect _ltree_root(LTree *ltree) {
+    float half = ltree->size / 2;
+    return (QRect) { ltree->min_x + half, ltree->min_y + half, half, half };
+}
 
-QTree *qtree_create(QRect boundary) {
-    QTree *qtree = malloc(sizeof(QTree));
-    if (!qtree) return NULL;
-    
-    qtree->points = malloc(POINTS_PER_QUAD * sizeof(QPoint));
-    qtree->boundary = boundary;
-    qtree->is_divided = false;
-    qtree->num_points = 0;
-    qtree->tl = qtree->tr = qtree->bl = qtree->br = NULL;
-    
-    return qtree;
+// Child c of a cell, bit 0 of c is the x half and bit 1 the y half, same as the key bits
+QRect _ltree_child_rect(QRect cell, int c) {
+    float w = cell.w / 2;
+    float h = cell.h / 2;
+    return (QRect) {
+        cell.x + (c & 1 ? w : -w),
+        cell.y + (c & 2 ? h : -h),
+        w, h
+    };
 }
 
-void qtree_destroy(QTree *qtree) {
-    if (!qtree) return;
+// Padded a hair so float rounding in _ltree_key can't leave a point just outside its cell
+QRect _ltree_loose(LTree *ltree, QRect cell) {
+    float pad = ltree->size * LTREE_PAD;
+    return (QRect) { cell.x, cell.y, cell.w + pad, cell.h + pad };
+}
+
+// MARK: :static
+/**
+ * Grid for things that never move once placed, like pickups.
+ *
+ * Each cell is its own array and new points are appended to the cell they land in. Removing
+ * leaves a tombstone behind, so ids stay where they are and removals are O(1). Cells with
+ * too many tombstones are queued and static_grid_compact squeezes a few of them per call,
+ * instead of the whole grid at once.
+ * Cells are hashed by their coordinates and chained per bucket, so it covers any distance.
+ * A cell that ends up empty is unlinked and its slot reused, so the cells only add up to the
+ * area that holds something right now, not everywhere the player has been.
+ *
+ * Point ids must be unique and below capacity.
+ */
+
+StaticGrid *static_grid_create(float cell_size, int capacity) {
+    StaticGrid *grid = malloc(sizeof(StaticGrid));
+    if (!grid) return NULL;
+
+    int num_buckets = 64;
+    *grid = (StaticGrid) {
+        .cell_size = cell_size,
+        .inv_cell_size = 1.0f / cell_size,
+        .cells = malloc(num_buckets * sizeof(SCell)),
+        .num_cells = 0,
+        .cells_capacity = num_buckets,
+        .free_cell = -1,
+        .num_free_cells = 0,
+        .buckets = malloc(num_buckets * sizeof(int)),
+        .num_buckets = num_buckets,
+        .id_cell = malloc(capacity * sizeof(int)),
+        .id_slot = malloc(capacity * sizeof(int)),
+        .capacity = capacity,
+        .compact_queue = malloc(num_buckets * sizeof(int)),
+        .num_queued = 0,
+    };
 
-    if (qtree->is_divided) {
-        qtree_destroy(qtree->tl);
-        qtree_destroy(qtree->tr);
-        qtree_destroy(qtree->bl);
-        qtree_destroy(qtree->br);
+    if (!grid->cells || !grid->buckets || !grid->id_cell || !grid->id_slot || !grid->compact_queue) {
+        static_grid_destroy(grid);
+        return NULL;
     }
 
-    free(qtree->points);
-    free(qtree);
+    static_grid_clear(grid);
+    return grid;
 }
 
-void qtree_clear(QTree *qtree) {
-    if (!qtree) return;
-    
-    qtree->num_points = 0;
-    if (qtree->is_divided) {
-        qtree_clear(qtree->tl);
-        qtree_clear(qtree->tr);
-        qtree_clear(qtree->bl);
-        qtree_clear(qtree->br);
+void static_grid_destroy(StaticGrid *grid) {
+    if (!grid) return;
+
+    if (grid->cells) {
+        for (int c = 0; c < grid->num_cells; c++) {
+            free(grid->cells[c].points);
+        }
     }
+    free(grid->cells);
+    free(grid->buckets);
+    free(grid->id_cell);
+    free(grid->id_slot);
+    free(grid->compact_queue);
+    free(grid);
 }
 
-void qtree_reset_boundary(QTree *qtree, QRect rect) {
-    qtree->boundary.x = rect.x;
-    qtree->boundary.y = rect.y;
-    qtree->boundary.w = rect.w;
-    qtree->boundary.h = rect.h;
-    
-    if (qtree->is_divided) {
-        float w = rect.w/2;
-        float h = rect.h/2;
-        
-        qtree->tl->boundary.x = rect.x - w/2;
-        qtree->tl->boundary.y = rect.y - h/2;
-        qtree->tl->boundary.w = w;
-        qtree->tl->boundary.h = h;
-        qtree_reset_boundary(
-            qtree->tl, 
-            (QRect) { qtree->tl->boundary.x, qtree->tl->boundary.y, w, h }
-        );
-        
-        qtree->tr->boundary.x = rect.x + w/2;
-        qtree->tr->boundary.y = rect.y - h/2;
-        qtree->tr->boundary.w = w;
-        qtree->tr->boundary.h = h;
-        qtree_reset_boundary(
-            qtree->tr, 
-            (QRect) { qtree->tr->boundary.x, qtree->tr->boundary.y, w, h }
-        );
-        
-        qtree->bl->boundary.x = rect.x - w/2;
-        qtree->bl->boundary.y = rect.y + h/2;
-        qtree->bl->boundary.w = w;
-        qtree->bl->boundary.h = h;
-        qtree_reset_boundary(
-            qtree->bl, 
-            (QRect) { qtree->bl->boundary.x, qtree->bl->boundary.y, w, h }
-        );
-        
-        qtree->br->boundary.x = rect.x + w/2;
-        qtree->br->boundary.y = rect.y + h/2;
-        qtree->br->boundary.w = w;
-        qtree->br->boundary.h = h;
-        qtree_reset_boundary(
-            qtree->br, 
-            (QRect) { qtree->br->boundary.x, qtree->br->boundary.y, w, h }
-        );
+// Empties every cell but keeps them and their arrays around for the next points
+void static_grid_clear(StaticGrid *grid) {
+    for (int c = 0; c < grid->num_cells; c++) {
+        grid->cells[c].num_points = 0;
+        grid->cells[c].num_dead = 0;
+        grid->cells[c].is_queued = false;
+    }
+    for (int i = 0; i < grid->capacity; i++) {
+        grid->id_cell[i] = -1;
+        grid->id_slot[i] = -1;
+    }
+    if (grid->num_cells == 0) {
+        for (int b = 0; b < grid->num_buckets; b++) {
+            grid->buckets[b] = -1;
+        }
     }
+    grid->num_queued = 0;
+    grid->num_points = 0;
+    grid->num_dead = 0;
 }
 
-bool qtree_insert(QTree *tree, QPoint pt) {
-    if (!tree)
-        return false;
-    if (!is_rect_contains_point(tree->boundary, pt))
+bool static_grid_insert(StaticGrid *grid, QPoint pt) {
+    if (pt.id < 0 || pt.id >= grid->capacity || grid->id_cell[pt.id] >= 0)
         return false;
 
-    if (tree->num_points < POINTS_PER_QUAD) {
-        tree->points[tree->num_points] = pt;
-        tree->num_points += 1;
-        return true;
+    int cx = (int) floorf(pt.x * grid->inv_cell_size);
+    int cy = (int) floorf(pt.y * grid->inv_cell_size);
+    int c = _static_grid_find(grid, cx, cy);
+    if (c < 0) {
+        c = _static_grid_add_cell(grid, cx, cy);
+        if (c < 0)
+            return false;
     }
 
-    if (!tree->is_divided) {
-        _qtree_subdivide(tree);
-        for (int i = 0; i < tree->num_points; i++) {
-            qtree_insert(tree->tl, tree->points[i]);
-            qtree_insert(tree->tr, tree->points[i]);
-            qtree_insert(tree->bl, tree->points[i]);
-            qtree_insert(tree->br, tree->points[i]);
+    SCell *cell = &grid->cells[c];
+    // a full cell with tombstones makes room in place before growing
+    if (cell->num_points == cell->capacity && cell->num_dead > 0) {
+        _static_grid_compact_cell(grid, c);
+    }
+    if (cell->num_points == cell->capacity) {
+        int capacity = cell->capacity ? cell->capacity * 2 : 8;
+        QPoint *points = realloc(cell->points, capacity * sizeof(QPoint));
+        if (!points) {
+            printe("Error realloc static grid cell");
+            return false;
         }
-        tree->num_points = 0;
+        cell->points = points;
+        cell->capacity = capacity;
     }
 
-    return qtree_insert(tree->tl, pt) || 
-        qtree_insert(tree->tr, pt) || 
-        qtree_insert(tree->bl, pt) || 
-        qtree_insert(tree->br, pt);
+    grid->id_cell[pt.id] = c;
+    grid->id_slot[pt.id] = cell->num_points;
+    cell->points[cell->num_points] = pt;
+    cell->num_points += 1;
+    grid->num_points += 1;
+    return true;
 }
 
-bool qtree_remove(QTree *qtree, QPoint pt) {
-    if (!qtree || !is_rect_contains_point(qtree->boundary, pt))
+bool static_grid_remove_id(StaticGrid *grid, int id) {
+    if (id < 0 || id >= grid->capacity || grid->id_cell[id] < 0)
         return false;
-        
-    for (int i = 0; i < qtree->num_points; i++) {
 
-        // we don't do the id check here since the id of the items aren't valid
-        // ie when you remove a pickup item, the id of other pickups may change
-        if (qtree->points[i].x != pt.x && qtree->points[i].y != pt.y) {
-            continue;
-        }
+    int c = grid->id_cell[id];
+    SCell *cell = &grid->cells[c];
+    cell->points[grid->id_slot[id]].id = -1;
+    cell->num_dead += 1;
+    grid->id_cell[id] = -1;
+    grid->id_slot[id] = -1;
+    grid->num_points -= 1;
+    grid->num_dead += 1;
+
+    // the queue can't overflow, a cell is only in it once. An all dead cell always goes,
+    // it's handed back once compacted
+    bool is_over = cell->num_dead >= STATIC_GRID_MIN_DEAD && cell->num_dead * 2 >= cell->num_points;
+    if ((is_over || cell->num_dead == cell->num_points) && !cell->is_queued) {
+        cell->is_queued = true;
+        grid->compact_queue[grid->num_queued] = c;
+        grid->num_queued += 1;
+    }
+    return true;
+}
+
+bool static_grid_visit(StaticGrid *grid, QRect range, QueryVisitor visit, void *ctx) {
+    if (!grid || !visit)
+        return false;
 
-        // Don't do an unordered remove here since the id values in the qtree are hardcoded
-        qtree->points[i] = qtree->points[qtree->num_points - 1];
-        qtree->num_points--;
+    index_stats_count(1, 0, 0);
+    int cx0 = (int) floorf((range.x - range.w) * grid->inv_cell_size);
+    int cx1 = (int) floorf((range.x + range.w) * grid->inv_cell_size);
+    int cy0 = (int) floorf((range.y - range.h) * grid->inv_cell_size);
+    int cy1 = (int) floorf((range.y + range.h) * grid->inv_cell_size);
+
+    // Huge ranges cover more cells than exist, walk the cells themselves then
+    float num_covered = (float) (cx1 - cx0 + 1) * (float) (cy1 - cy0 + 1);
+    if (num_covered > grid->num_cells - grid->num_free_cells) {
+        for (int c = 0; c < grid->num_cells; c++) {
+            SCell *cell = &grid->cells[c];
+            if (cell->is_free || cell->cx < cx0 || cell->cx > cx1 || cell->cy < cy0 || cell->cy > cy1)
+                continue;
+            if (!_static_grid_visit_cell(grid, cell, range, visit, ctx))
+                return false;
+        }
         return true;
     }
-    
-    if (qtree->is_divided) {
-        return qtree_remove(qtree->tl, pt) ||
-               qtree_remove(qtree->tr, pt) ||
-               qtree_remove(qtree->bl, pt) ||
-               qtree_remove(qtree->br, pt);
+
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            int c = _static_grid_find(grid, cx, cy);
+            if (c < 0)
+                continue;
+            if (!_static_grid_visit_cell(grid, &grid->cells[c], range, visit, ctx))
+                return false;
+        }
     }
-    return false;
+    return true;
 }
 
-void qtree_query(QTree *qtree, QRect range, QPoint *result, int *num_points) {
-    if (!qtree || !result || !num_points) 
-        return;
-    if (*num_points >= MAX_ENEMIES)
-        return;
-    if (!is_rect_overlap(qtree->boundary, range))
-        return;
+bool _static_grid_visit_cell(StaticGrid *grid, SCell *cell, QRect range, QueryVisitor visit, void *ctx) {
+    index_stats_count(0, 1, cell->num_points);
+    for (int i = 0; i < cell->num_points; i++) {
+        QPoint pt = cell->points[i];
+        if (pt.id < 0 || !is_rect_contains_point(range, pt))
+            continue;
+        if (!visit(pt, ctx))
+            return false;
+    }
+    return true;
+}
+
+int static_grid_query(StaticGrid *grid, QRect range, QPoint *result, int max_points) {
+    if (max_points <= 0)
+        return 0;
+
+    QueryBuffer buffer = { result, 0, max_points };
+    static_grid_visit(grid, range, _index_collect, &buffer);
+    return buffer.num_points;
+}
 
-    for (int i = 0; i < qtree->num_points; i ++) {
-        if (is_rect_contains_point(range, qtree->points[i])) {
-            result[*num_points] = qtree->points[i];
-            *num_points += 1;
+// Compacts up to max_cells of the queued cells, call it once a frame. Returns how many are left
+int static_grid_compact(StaticGrid *grid, int max_cells) {
+    while (max_cells > 0 && grid->num_queued > 0) {
+        grid->num_queued -= 1;
+        int c = grid->compact_queue[grid->num_queued];
+        grid->cells[c].is_queued = false;
+        _static_grid_compact_cell(grid, c);
+        if (grid->cells[c].num_points == 0) {
+            _static_grid_free_cell(grid, c);
         }
+        max_cells--;
     }
+    return grid->num_queued;
+}
 
-    if (qtree->is_divided) {
-        qtree_query(qtree->tl, range, result, num_points);
-        qtree_query(qtree->tr, range, result, num_points);
-        qtree_query(qtree->bl, range, result, num_points);
-        qtree_query(qtree->br, range, result, num_points);
+void _static_grid_compact_cell(StaticGrid *grid, int c) {
+    SCell *cell = &grid->cells[c];
+    int n = 0;
+    for (int i = 0; i < cell->num_points; i++) {
+        QPoint pt = cell->points[i];
+        if (pt.id < 0)
+            continue;
+        cell->points[n] = pt;
+        grid->id_slot[pt.id] = n;
+        n++;
     }
+    grid->num_dead -= cell->num_dead;
+    cell->num_points = n;
+    cell->num_dead = 0;
 }
 
-void _qtree_subdivide(QTree *qtree) {
-    float x = qtree->boundary.x;
-    float y = qtree->boundary.y;
-    float w = qtree->boundary.w;
-    float h = qtree->boundary.h;
+// Unlinks an empty cell and hands back its memory, cells the player left behind don't keep it forever
+void _static_grid_free_cell(StaticGrid *grid, int c) {
+    SCell *cell = &grid->cells[c];
+    int *link = &grid->buckets[_static_grid_bucket(grid, cell->cx, cell->cy)];
+    while (*link != c) {
+        link = &grid->cells[*link].next;
+    }
+    *link = cell->next;
+
+    free(cell->points);
+    cell->points = NULL;
+    cell->capacity = 0;
+    cell->is_free = true;
+    cell->next = grid->free_cell;
+    grid->free_cell = c;
+    grid->num_free_cells += 1;
+}
 
-    QRect tl = (QRect) { x - w/2, y - h/2, w/2, h/2 };
-    QRect tr = (QRect) { x + w/2, y - h/2, w/2, h/2 };
-    QRect bl = (QRect) { x - w/2, y + h/2, w/2, h/2 };
-    QRect br = (QRect) { x + w/2, y + h/2, w/2, h/2 };
+int _static_grid_find(StaticGrid *grid, int cx, int cy) {
+    for (int c = grid->buckets[_static_grid_bucket(grid, cx, cy)]; c >= 0; c = grid->cells[c].next) {
+        if (grid->cells[c].cx == cx && grid->cells[c].cy == cy)
+            return c;
+    }
+    return -1;
+}
 
-    qtree->tl = qtree_create(tl);
-    qtree->tr = qtree_create(tr);
-    qtree->bl = qtree_create(bl);
-    qtree->br = qtree_create(br);
-
-    if (!qtree->tl || !qtree->tr || !qtree->bl || !qtree->br) {
-        free(qtree->tl);
-        free(qtree->tr);
-        free(qtree->bl);
-        free(qtree->br);
-        qtree->tl = qtree->tr = qtree->bl = qtree->br = NULL;
-        return;
+int _static_grid_add_cell(StaticGrid *grid, int cx, int cy) {
+    if (grid->free_cell < 0 && grid->num_cells == grid->cells_capacity) {
+        int capacity = grid->cells_capacity * 2;
+        SCell *cells = realloc(grid->cells, capacity * sizeof(SCell));
+        if (!cells) {
+            printe("Error realloc static grid cells");
+            return -1;
+        }
+        grid->cells = cells;
+        int *queue = realloc(grid->compact_queue, capacity * sizeof(int));
+        if (!queue) {
+            printe("Error realloc static grid compact queue");
+            return -1;
+        }
+        grid->compact_queue = queue;
+        grid->cells_capacity = capacity;
+    }
+
+    // Keep the chains short, rehash every cell once they outnumber the buckets
+    if (grid->num_cells - grid->num_free_cells >= grid->num_buckets) {
+        int *buckets = realloc(grid->buckets, grid->num_buckets * 2 * sizeof(int));
+        if (!buckets) {
+            printe("Error realloc static grid buckets");
+            return -1;
+        }
+        grid->buckets = buckets;
+        grid->num_buckets *= 2;
+        for (int b = 0; b < grid->num_buckets; b++) {
+            grid->buckets[b] = -1;
+        }
+        for (int i = 0; i < grid->num_cells; i++) {
+            if (grid->cells[i].is_free)
+                continue;
+            int b = _static_grid_bucket(grid, grid->cells[i].cx, grid->cells[i].cy);
+            grid->cells[i].next = grid->buckets[b];
+            grid->buckets[b] = i;
+        }
+    }
+
+    int c = grid->num_cells;
+    if (grid->free_cell >= 0) {
+        c = grid->free_cell;
+        grid->free_cell = grid->cells[c].next;
+        grid->num_free_cells -= 1;
+    } else {
+        grid->num_cells += 1;
     }
 
-    qtree->is_divided = true;
+    int b = _static_grid_bucket(grid, cx, cy);
+    grid->cells[c] = (SCell) {
+        .cx = cx,
+        .cy = cy,
+        .points = NULL,
+        .num_points = 0,
+        .num_dead = 0,
+        .capacity = 0,
+        .is_queued = false,
+        .is_free = false,
+        .next = grid->buckets[b]
+    };
+    grid->buckets[b] = c;
+    return c;
+}
+
+int _static_grid_bucket(StaticGrid *grid, int cx, int cy) {
+    unsigned int h = ((unsigned int) cx * 73856093u) ^ ((unsigned int) cy * 19349663u);
+    return (int) (h & (unsigned int) (grid->num_buckets - 1));
 }
 
 // MARK: :data :switch
@@ -2794,6 +7384,42 @@ float get_enemy_damage(EnemyType type) {
     }
 }
 
+// The side table for the type, -1 when it has no state of its own
+int get_enemy_cold_table(EnemyType type) {
+    switch (type) {
+        case RAM:
+            return COLD_RAM;
+        case MAGE:
+            return COLD_MAGE;
+        case DEMON:
+            return COLD_DEMON;
+        default:
+            return -1;
+    }
+}
+
+// Most bullets one enemy of the table fires in a frame, the behaviour tasks get room for this many
+int get_enemy_max_bullets(EnemyColdTable table) {
+    switch (table) {
+        case COLD_MAGE:
+            return 1;
+        case COLD_DEMON:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+// Most pups one enemy of the table spawns in a frame
+int get_enemy_max_pups(EnemyColdTable table) {
+    switch (table) {
+        case COLD_DEMON:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
 Vec2 get_attack_sprite(AttackType type) {
     switch (type) {
         case BULLET:
@@ -2822,6 +7448,8 @@ int get_attack_range(AttackType type) {
             return state->stats.bullet_range;
         case SPLINTER:
             return state->stats.splinter_range;
+        case LASER:
+            return state->stats.laser_range;
         case SPIKE:
             return INT_MAX;
         case ORBS:
@@ -2893,6 +7521,11 @@ float get_base_stat_value(ShopUpgradeType type) {
         case ORBS_COUNT: return 2;
         case ORBS_SIZE: return 5;
 
+        case LASER_INTERVAL: return GOD ? 200 : 2500;
+        case LASER_RANGE: return 150;
+        case LASER_DAMAGE: return 20;
+        case LASER_PENETRATION: return 3;
+
         case PLAYER_SPEED: return 40;
         case SHINY_CHANCE: return 1;
 
@@ -2937,6 +7570,11 @@ float get_stat_increment(ShopUpgradeType type) {
         case ORBS_COUNT: return 1;
         case ORBS_SIZE: return 1;
 
+        case LASER_INTERVAL: return -40;
+        case LASER_RANGE: return 10;
+        case LASER_DAMAGE: return 5;
+        case LASER_PENETRATION: return 1;
+
         case PLAYER_SPEED: return 1;
         case SHINY_CHANCE: return 1;
 
@@ -3056,6 +7694,7 @@ void update_available_upgrades() {
     state->available_upgrades.flame_level = 0;
     state->available_upgrades.frost_wave_level = 0;
     state->available_upgrades.orbs_level = 0;
+    state->available_upgrades.laser_level = 0;
     state->available_upgrades.speed_level = 0;
     state->available_upgrades.shiny_level = 0;
 
@@ -3067,6 +7706,7 @@ void update_available_upgrades() {
         &upgrades->flame_level,
         &upgrades->frost_wave_level,
         &upgrades->orbs_level,
+        &upgrades->laser_level,
         &upgrades->speed_level,
         &upgrades->shiny_level,
     };
@@ -3162,6 +7802,18 @@ void upgrade_stat(UpgradeType type) {
                 : toast("Orbs upgraded");
             break;
         }
+        case LASER_UPGRADE: {
+            if (rand_val > 50) state->stats.laser_interval += get_stat_increment(LASER_INTERVAL);
+            state->stats.laser_range += get_stat_increment(LASER_RANGE);
+            state->stats.laser_damage += get_stat_increment(LASER_DAMAGE);
+            if (rand_val > 50) state->stats.laser_penetration += get_stat_increment(LASER_PENETRATION);
+            state->upgrades.laser_level += 1;
+
+            (state->upgrades.laser_level <= 1)
+                ? toast("Laser unlocked!")
+                : toast("Laser upgraded");
+            break;
+        }
         case SPEED_UPGRADE: {
             state->stats.player_speed += get_stat_increment(PLAYER_SPEED);
             state->upgrades.speed_level += 1;
@@ -3374,6 +8026,11 @@ bool is_rect_contains_point(QRect rect, QPoint pt) {
            (pt.y >= rect.y - rect.h && pt.y <= rect.y + rect.h);
 }
 
+bool is_rect_contains_rect(QRect outer, QRect inner) {
+    return (inner.x - inner.w >= outer.x - outer.w && inner.x + inner.w <= outer.x + outer.w) &&
+           (inner.y - inner.h >= outer.y - outer.h && inner.y + inner.h <= outer.y + outer.h);
+}
+
 bool is_rect_overlap(QRect first, QRect second) {
     return !(
         first.x - first.w > second.x + second.w || 
@@ -3426,6 +8083,173 @@ void printe(const char *text) {
     TraceLog(LOG_ERROR, text);
 }
 
+// MARK: :jobs
+
+/**
+ * A pool of worker threads started once, parked on a condition variable between batches.
+ * jobs_run hands the batch's tasks out one at a time and the calling thread works on them too,
+ * it returns once they're all done. Tasks can run in any order on any thread, so each one
+ * should only write what it owns. The wasm build has no threads, batches run on the caller.
+ */
+JobPool *jobs_create(int num_threads) {
+    JobPool *pool = malloc(sizeof(JobPool));
+    if (!pool) return NULL;
+
+    *pool = (JobPool) {
+        .num_workers = 0,
+        .func = NULL,
+        .ctx = NULL,
+        .num_tasks = 0,
+        .next_task = 0,
+        .num_done = 0,
+        .batch = 0,
+        .is_quit = false
+    };
+
+    #ifndef WASM
+    {
+        if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+            free(pool);
+            return NULL;
+        }
+        if (pthread_cond_init(&pool->batch_ready, NULL) != 0) {
+            pthread_mutex_destroy(&pool->lock);
+            free(pool);
+            return NULL;
+        }
+        if (pthread_cond_init(&pool->batch_done, NULL) != 0) {
+            pthread_cond_destroy(&pool->batch_ready);
+            pthread_mutex_destroy(&pool->lock);
+            free(pool);
+            return NULL;
+        }
+
+        // the thread calling jobs_run is one of them
+        for (int i = 0; i < num_threads - 1 && i < MAX_JOB_THREADS - 1; i++) {
+            if (pthread_create(&pool->threads[i], NULL, _jobs_worker, pool) != 0) {
+                printe("failed to create job thread");
+                break;
+            }
+            pool->num_workers += 1;
+        }
+    }
+    #endif
+
+    return pool;
+}
+
+void jobs_destroy(JobPool *pool) {
+    if (!pool) return;
+
+    #ifndef WASM
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->is_quit = true;
+        pthread_cond_broadcast(&pool->batch_ready);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (int i = 0; i < pool->num_workers; i++) {
+            pthread_join(pool->threads[i], NULL);
+        }
+        pthread_cond_destroy(&pool->batch_done);
+        pthread_cond_destroy(&pool->batch_ready);
+        pthread_mutex_destroy(&pool->lock);
+    }
+    #endif
+
+    free(pool);
+}
+
+void jobs_run(JobPool *pool, JobFunc func, void *ctx, int num_tasks) {
+    if (!pool || pool->num_workers == 0 || num_tasks <= 1) {
+        for (int task = 0; task < num_tasks; task++) {
+            func(ctx, task);
+        }
+        return;
+    }
+
+    #ifndef WASM
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->func = func;
+        pool->ctx = ctx;
+        pool->num_tasks = num_tasks;
+        pool->next_task = 0;
+        pool->num_done = 0;
+        pool->batch += 1;
+        pthread_cond_broadcast(&pool->batch_ready);
+
+        _jobs_drain(pool);
+        while (pool->num_done < pool->num_tasks) {
+            pthread_cond_wait(&pool->batch_done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    #endif
+}
+
+// Threads a batch can use, the caller included
+int jobs_num_threads(JobPool *pool) {
+    return pool ? pool->num_workers + 1 : 1;
+}
+
+int jobs_num_cores() {
+    #ifndef WASM
+    {
+        long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_cores < 1) return 1;
+        return num_cores < MAX_JOB_THREADS ? num_cores : MAX_JOB_THREADS;
+    }
+    #else
+    {
+        return 1;
+    }
+    #endif
+}
+
+// Even split of n items, slice gets [start, end)
+void jobs_slice(int n, int num_slices, int slice, int *start, int *end) {
+    *start = (int) ((long long) n * slice / num_slices);
+    *end = (int) ((long long) n * (slice + 1) / num_slices);
+}
+
+#ifndef WASM
+void *_jobs_worker(void *arg) {
+    JobPool *pool = arg;
+    int seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->is_quit && pool->batch == seen) {
+            pthread_cond_wait(&pool->batch_ready, &pool->lock);
+        }
+        if (pool->is_quit)
+            break;
+        seen = pool->batch;
+        _jobs_drain(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Runs tasks until the batch has none left, called and returns with the lock held
+void _jobs_drain(JobPool *pool) {
+    while (pool->next_task < pool->num_tasks) {
+        int task = pool->next_task;
+        pool->next_task += 1;
+
+        pthread_mutex_unlock(&pool->lock);
+        pool->func(pool->ctx, task);
+        pthread_mutex_lock(&pool->lock);
+
+        pool->num_done += 1;
+        if (pool->num_done == pool->num_tasks) {
+            pthread_cond_broadcast(&pool->batch_done);
+        }
+    }
+}
+#endif
+
 // MARK: :ana
 
 void* post_analytics_thread(void* arg) {
@@ -3538,7 +8362,24 @@ void game_update() {
 }
 
 #ifndef WASM
-int main(void) {
+int main(int argc, char **argv) {
+    // Enemy index backend, used to benchmark them on the same run
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--index=qtree") == 0) {
+            enemy_index_type = INDEX_QTREE;
+        } else if (strcmp(argv[i], "--index=grid") == 0) {
+            enemy_index_type = INDEX_GRID;
+        } else if (strcmp(argv[i], "--index=linear") == 0) {
+            enemy_index_type = INDEX_LINEAR;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            // --threads=1 keeps the job pool on the main thread, to compare against
+            num_job_threads = atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--no-tune") == 0) {
+            // same seed, same game, whatever the thread count
+            is_index_tuned = false;
+        }
+    }
+
     // Init Window
     // use FLAG_VSYNC_HINT for vsync
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
@@ -3559,6 +8400,8 @@ int main(void) {
         game_update();
     }
 
+    index_stats_dump(state->enemy_index);
+    index_tuner_dump(&state->enemy_index_tuner, state->enemy_index);
     gamestate_destroy();
     CloseWindow();
     return 0;
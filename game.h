@@ -6,6 +6,8 @@
 #define IS_MOBILE false
 #define DEBUG true
 #define GOD false
+// count the spatial index work per call site, shown in the TAB debug gui and dumped on exit
+#define INDEX_STATS true
 
 // MARK: :configs
 
@@ -44,8 +46,17 @@
 #define TOTAL_NUM_DECORATIONS 14
 
 #define MAX_PICKUPS 50000
+// a pickup handle is its slot in the low bits and the slot's generation above it
+#define PICKUP_SLOT_BITS 16
+#define PICKUP_SLOT_MASK ((1 << PICKUP_SLOT_BITS) - 1)
+#define PICKUP_GENERATION_MASK 0x7fff
+#define NO_PICKUP -1
+#define PICKUPS_CELL_SIZE 64
+// cells the pickups grid compacts per frame
+#define PICKUPS_COMPACT_PER_FRAME 4
 #define PICKUPS_CLEANUP_INTERVAL 1000 * 5
 #define PICKUPS_LIFETIME 1000 * 60 * 1
+#define MAX_PICKUP_GRABS 256
 
 #define PARTICLE_SPEED 200
 #define PARTICLE_LIFETIME 400
@@ -59,14 +70,76 @@
 #define WAVE_DURATION_MILLIS 1000 * 15
 #define WAVE_DURATION_INCREMENT_MILLIS 1000 * 3
 #define QTREE_UPDATE_INTERVAL_MILLIS 100
+#define ENEMY_INDEX_MARGIN 64
 #define DEFAULT_ENEMY_SPAWN_INTERVAL_MS 1000
 
 #define MAX_BULLETS 10000
 #define MAX_ENEMY_BULLETS 5000
+#define MAX_BULLET_HITS MAX_BULLETS * 4
+// enemies touching the player that get to hurt them in one tick
+#define MAX_PLAYER_CONTACTS 1024
+#define MAX_COLLISION_PAIRS (MAX_BULLET_HITS + MAX_PLAYER_CONTACTS + MAX_ENEMY_BULLETS + MAX_PICKUP_GRABS)
+#define PICKUP_GRAB_RADIUS 25.0f
+// bullet vs enemy goes through the sweep instead of the batched index query once there are
+// this many live bullets and they're at least 1/SAP_ENEMIES_PER_BULLET of the enemies.
+// Measured, the sweep is about even with the qtree at 4 enemies a bullet and wins below
+#define SAP_MIN_BULLETS 256
+#define SAP_ENEMIES_PER_BULLET 4
+// power of 2, bands past it wrap around and share lists
+#define SAP_NUM_BANDS 64
+#define SAP_MIN_BAND_HEIGHT 8
 #define GUN_VISION 70
 #define SPIKE_RADIUS 30
+#define LASER_WIDTH 4
+#define LASER_LIFETIME_MILLIS 120
+#define LASER_MAX_HITS 256
 
+// default qtree leaf capacity, the tuner moves it at runtime
 #define POINTS_PER_QUAD 10
+// slots per qtree bucket and the most a leaf can take before splitting, whole AVX2 vectors
+#define QBUCKET_POINTS 16
+#define QTREE_MIN_NODES 64
+#define QTREE_MAX_DEPTH 8
+#define QTREE_LOOSENESS 1.5f
+// qtree rebuilds with this many points are split over the job pool, one task per node at
+// QTREE_BUILD_DEPTH. Enemies crowd around the player in the middle, 16 cells leave 4 doing most of it
+#define QTREE_BUILD_MIN_POINTS 4096
+#define QTREE_BUILD_DEPTH 3
+#define QTREE_BUILD_CELLS 64
+// the job pool takes a thread per core up to this, the main thread included, --threads=N overrides it
+#define MAX_JOB_THREADS 16
+// enemies per task of the enemy update, fixed so a frame comes out the same on any thread count
+#define ENEMY_TASK_SIZE 2048
+// separation and behaviour tasks do a lot more per enemy
+#define ENEMY_BEHAVIOUR_TASK_SIZE 64
+// default grid cell size, the tuner moves it at runtime
+#define GRID_CELL_SIZE 32
+// cells of the coarse tier holding the points outside a tree index's boundary
+#define INDEX_FAR_CELL_SIZE 128
+// a static grid cell is queued for compaction once this many of its points are tombstones
+// and they're at least half of it, or once they're all tombstones
+#define STATIC_GRID_MIN_DEAD 8
+// levels of the linear qtree, 16 bits of Morton key per axis
+#define LTREE_MAX_LEVEL 16
+// default for runs short enough to be scanned instead of split, they're contiguous so scanning is cheap
+#define LTREE_LEAF_POINTS 32
+// enemy count bands the tuner keeps a best setting for, log2 sized, the first one is under 64 enemies
+#define TUNER_BANDS 12
+#define TUNER_MAX_CANDIDATES 8
+// frames each setting is measured for
+#define TUNER_EPOCH_FRAMES 60
+// epochs on the band's best before a neighbour setting is tried again
+#define TUNER_REEXPLORE_EPOCHS 10
+#define LTREE_PAD 1e-5f
+// most points a k nearest query can return
+#define MAX_NEAREST 32
+// how far enemies can move between the neighbour gather and the last system using it,
+// the gather reaches this much further, twice, to cover the player moving too
+#define NEIGHBOUR_SLACK 16
+// leaves by point count, bin b holds 2^(b-1) to 2^b - 1 points, the last bin the rest
+#define INDEX_HISTOGRAM_BINS 8
+// backend used for the enemy index, can be overridden with --index=qtree|grid|linear
+#define ENEMY_INDEX_TYPE INDEX_QTREE
 
 #define TOAST_LIEFTIME_MS 1500
 #define MAX_NUM_TOASTS 15
@@ -130,6 +203,9 @@ typedef enum {
     METEOR,
     GARLIC,
 
+    // Beams
+    LASER,
+
     // Enemy Attacks
     MAGE_BULLET,
     DEMON_BULLET,
@@ -170,6 +246,11 @@ typedef enum {
     ORBS_COUNT,
     ORBS_SIZE,
 
+    LASER_INTERVAL,
+    LASER_RANGE,
+    LASER_DAMAGE,
+    LASER_PENETRATION,
+
     PLAYER_SPEED,
     SHINY_CHANCE
 } ShopUpgradeType;
@@ -196,10 +277,43 @@ typedef enum {
     FLAME_UPGRADE,
     FROST_UPGRADE,
     ORBS_UPGRADE,
+    LASER_UPGRADE,
     SPEED_UPGRADE,
     SHINY_UPGRADE,
 } UpgradeType;
 
+typedef enum {
+    INDEX_QTREE,
+    INDEX_GRID,
+    INDEX_LINEAR,
+} SpatialIndexType;
+
+// Where a spatial index query comes from, its cost is charged there
+typedef enum {
+    SITE_OTHER,
+    SITE_REBUILD,
+    SITE_BULLETS,
+    SITE_SEPARATION,
+    SITE_FLAME,
+    SITE_FROST,
+    SITE_LASER,
+    SITE_TARGETING,
+    SITE_PLAYER_HURT,
+    SITE_DRAW,
+    SITE_PICKUPS,
+    SITE_NEIGHBOURS,
+    // not queries, the enemy update passes on the job pool, timed next to the rest
+    SITE_BEHAVIOUR,
+    SITE_CHASE,
+    NUM_INDEX_SITES
+} IndexSite;
+
+typedef enum {
+    SHAPE_CIRCLE,
+    SHAPE_CONE,
+    SHAPE_SEGMENT,
+} QShapeType;
+
 typedef enum {
     GAME_OPEN,
     GAME_START,
@@ -217,18 +331,423 @@ typedef struct {
     int id;
 } QPoint;
 
-typedef struct QTree_ {
-    bool is_divided;
+// Query area, everything needed to test a point is precomputed by the shape_* constructors
+typedef struct {
+    QShapeType type;
+    // tight bounding box, backends only walk what overlaps it
+    QRect bounds;
+    // circle / cone origin, start of a segment
+    Vec2 center;
+    float radius;
+    float radius_sqr;
+    // segment direction as a unit vector, inv_dir is 0 on an axis the segment doesn't move along
+    Vec2 dir;
+    Vec2 inv_dir;
+    float length;
+    // cone sides as half planes, a point p is on the inner side when dot(normal, p) >= offset
+    Vec2 left_normal;
+    Vec2 right_normal;
+    float left_offset;
+    float right_offset;
+    // spread over 90 degrees, the cone is the union of the half planes instead of the intersection
+    bool is_wide;
+} QShape;
+
+// Leaf points split by field so a bucket is scanned a whole vector at a time
+typedef struct {
+    float xs[QBUCKET_POINTS];
+    float ys[QBUCKET_POINTS];
+    int ids[QBUCKET_POINTS];
+    int num_points;
+    // next bucket of the same leaf, -1 at the end of the chain
+    int next;
+} QBucket;
+
+typedef struct {
+    // the cell, queries use the loose bounds around it
     QRect boundary;
-    QPoint *points;
+    // points in the bucket chain, only leaves hold points
     int num_points;
+    int bucket;
+    // index of the first of the 4 contiguous children (tl, tr, bl, br), -1 for a leaf
+    int children;
+    int parent;
+    int depth;
+} QNode;
+
+typedef struct {
+    int node;
+    // squared distance from the query point to the node's loose bounds
+    float dist;
+} QNodeDist;
 
-    struct QTree_ *tl;
-    struct QTree_ *tr;
-    struct QTree_ *bl;
-    struct QTree_ *br;
+typedef struct {
+    QRect boundary;
+    // node pool, the root is always at index 0
+    QNode *nodes;
+    int num_nodes;
+    int capacity;
+    // head of the freed child blocks, chained through QNode.children
+    int free_block;
+    // bucket pool, freed buckets are chained through QBucket.next
+    QBucket *buckets;
+    int num_buckets;
+    int bucket_capacity;
+    int free_bucket;
+    // points a leaf takes before it splits, at most QBUCKET_POINTS
+    int leaf_capacity;
+    // node holding each point id, -1 when the id isn't in the tree
+    int *id_node;
+    int id_capacity;
+    // min heap of nodes for the nearest queries, grown with the node pool
+    QNodeDist *heap;
+    int heap_capacity;
 } QTree;
 
+// Scratch of the parallel qtree rebuild, kept for the next one
+typedef struct {
+    QTree *qtree;
+    QPoint *points;
+    int num_points;
+    int num_slices;
+    // top cell of each point, QTREE_BUILD_CELLS when it's outside the boundary
+    unsigned char *cells;
+    // points of each slice in each cell, then where the slice writes its points of the cell
+    int counts[MAX_JOB_THREADS][QTREE_BUILD_CELLS + 1];
+    // the points grouped by cell, cell c is at [cell_start[c], cell_start[c + 1])
+    QPoint *binned;
+    int cell_start[QTREE_BUILD_CELLS + 2];
+    int capacity;
+    // node of the tree each cell's subtree goes in
+    int cell_nodes[QTREE_BUILD_CELLS];
+    // subtrees are built in private trees, their nodes past the root and their buckets
+    // are then copied into the tree's pools from these offsets
+    QTree *subtrees[QTREE_BUILD_CELLS];
+    int node_offsets[QTREE_BUILD_CELLS];
+    int bucket_offsets[QTREE_BUILD_CELLS];
+    bool is_failed[QTREE_BUILD_CELLS];
+} QTreeBuild;
+
+typedef struct {
+    float cell_size;
+    float inv_cell_size;
+    // power of 2, cells are hashed into these
+    int num_buckets;
+    // counting sort layout, points of bucket b are at [start, start + count)
+    int *bucket_start;
+    int *bucket_count;
+    QPoint *points;
+    // inserted or moved since the last build
+    QPoint *staged;
+    int *point_bucket;
+    // bucket / staged slot of each point id, -1 when not there
+    int *id_bucket;
+    int *id_staged;
+    int num_points;
+    int num_staged;
+    int capacity;
+} SGrid;
+
+typedef struct {
+    QRect boundary;
+    // square the keys are quantized over
+    float min_x;
+    float min_y;
+    float size;
+    // live points, unordered
+    QPoint *points;
+    // slot of each point id in points, -1 when not there
+    int *id_slot;
+    int num_points;
+    int capacity;
+    // last build, points sorted by Morton key
+    unsigned int *keys;
+    QPoint *sorted;
+    int num_sorted;
+    // runs up to this long are scanned instead of split
+    int leaf_points;
+    // radix sort scratch
+    unsigned int *tmp_keys;
+    int *order;
+    int *tmp_order;
+    bool is_dirty;
+} LTree;
+
+// Enemies around the player, gathered once a tick and shared by the player centric systems
+typedef struct {
+    Vec2 pos;
+    // every enemy within this distance of pos at the gather is in here
+    float radius;
+    // nearest first
+    int *ids;
+    float *dist_sqrs;
+    int num_enemies;
+    // radix sort scratch, the keys are the distance bits
+    unsigned int *keys;
+    unsigned int *tmp_keys;
+    int *tmp_ids;
+    bool is_valid;
+} NeighbourCache;
+
+typedef struct {
+    int cx, cy;
+    // appended in drop order, removed points stay behind as tombstones (id -1) until compacted
+    QPoint *points;
+    // including the tombstones
+    int num_points;
+    int num_dead;
+    int capacity;
+    bool is_queued;
+    // emptied and handed back, out of the chains and waiting on the free list
+    bool is_free;
+    // next cell hashed into the same bucket, or the next free cell
+    int next;
+} SCell;
+
+typedef struct {
+    float cell_size;
+    float inv_cell_size;
+    // only the cells something was ever dropped in exist
+    SCell *cells;
+    int num_cells;
+    int cells_capacity;
+    // head of the freed cells, chained through SCell.next, reused before the array grows
+    int free_cell;
+    int num_free_cells;
+    // power of 2, heads of the cell chains, doubled once the cells outnumber them
+    int *buckets;
+    int num_buckets;
+    // cell and slot in the cell of each point id, -1 when not there
+    int *id_cell;
+    int *id_slot;
+    int capacity;
+    // cells past the tombstone threshold, waiting for static_grid_compact
+    int *compact_queue;
+    int num_queued;
+    int num_points;
+    int num_dead;
+} StaticGrid;
+
+// Called for every point a query finds, return false to stop the query early
+typedef bool (*QueryVisitor)(QPoint pt, void *ctx);
+
+// Caller owned result buffer for the copying queries
+typedef struct {
+    QPoint *points;
+    int num_points;
+    int capacity;
+} QueryBuffer;
+
+typedef struct {
+    // index of the range in the batch
+    int range;
+    QPoint pt;
+} QueryPair;
+
+typedef struct {
+    QueryPair *pairs;
+    int num_pairs;
+    int capacity;
+    // range the next collected points belong to
+    int range;
+    // pairs found once it was full, the walk goes on to count them
+    int num_dropped;
+} QueryPairBuffer;
+
+// Scratch of index_query_batch, for batches of up to capacity ranges
+typedef struct {
+    // sorted order, followed by the per depth range lists of the qtree walk
+    int *order;
+    // Morton codes, then the radix sort's spare keys
+    unsigned int *codes;
+    int *tmp_order;
+    int capacity;
+} QueryBatchScratch;
+
+// What an entity is to the broadphase, pairs only come out for layers that interact
+typedef enum {
+    LAYER_PLAYER = 1 << 0,
+    LAYER_ENEMY = 1 << 1,
+    LAYER_BULLET = 1 << 2,
+    LAYER_ENEMY_BULLET = 1 << 3,
+    LAYER_PICKUP = 1 << 4,
+} CollisionLayer;
+#define NUM_LAYERS 5
+
+typedef struct {
+    // the side whose range was tested, its array index (0 for the player)
+    CollisionLayer layer_a;
+    int a;
+    // the entity it touched, id is its array index / pickup slot
+    CollisionLayer layer_b;
+    QPoint b;
+} CollisionPair;
+
+// an entry of the bullet vs enemy sweep, sorted by min_x
+typedef struct {
+    float min_x, max_x;
+    float min_y, max_y;
+    // enemy id when >= 0, bullet i is -(i + 1)
+    int ref;
+    // spent bullets keep their place in the order but don't collide
+    bool is_live;
+} SapEntry;
+
+/**
+ * Candidate pairs for every collision of the tick, from one pass.
+ * Entities stay in the structure that suits how they move (enemy index, pickups grid, bullet
+ * arrays), the broadphase knows which layer each one is on and only generates pairs for
+ * the layer combinations in its masks.
+ */
+typedef struct {
+    // layers each layer collides with, indexed by the layer's bit
+    int masks[NUM_LAYERS];
+    CollisionPair *pairs;
+    int num_pairs;
+    // where the generator running now has to stop, so one can't eat the others' room
+    int limit;
+    // batched bullet vs enemy query, one range per live bullet and the bullet it came from
+    QRect *bullet_ranges;
+    int *bullet_range_ids;
+    QueryPair *bullet_hits;
+    QueryBatchScratch batch;
+    // sweep and prune, kept in the last sweep's order so the insertion sort has little to do
+    SapEntry *sap;
+    int num_sap;
+    // counts the order was made for, ids past them are new
+    int sap_num_enemies;
+    int sap_num_bullets;
+    // false when the last tick went through the index, the order is too stale to insertion sort
+    bool is_sap_coherent;
+    // the active lists are split in bands along y so an entry only meets the ones at its height.
+    // Singly linked through sap_next, -1 ends a list. Bands are as tall as the tallest bullet,
+    // which puts a bullet in two at most
+    float sap_band_height;
+    int sap_bullet_bands[SAP_NUM_BANDS];
+    int sap_enemy_bands[SAP_NUM_BANDS];
+    int *sap_next;
+    int *sap_node_entry;
+    // full sort fallback
+    unsigned int *sap_keys;
+    unsigned int *sap_tmp_keys;
+    int *sap_order;
+    int *sap_tmp_order;
+    SapEntry *sap_tmp;
+} Broadphase;
+
+// visitor context, turns every visited point into a pair with the same a side
+typedef struct {
+    Broadphase *bp;
+    CollisionLayer layer_a;
+    int a;
+    CollisionLayer layer_b;
+} PairCollector;
+
+typedef struct {
+    // queries made, for SITE_REBUILD the full rebuilds
+    long queries;
+    // nodes for the trees, cells for the grid
+    long nodes_visited;
+    long points_tested;
+    // seconds, includes the visitors since they run inside the query
+    double time;
+} IndexSiteStats;
+
+typedef struct {
+    // site the running queries are charged to
+    IndexSite site;
+    double site_start;
+    // set while queries run on the job pool, the counters aren't shared between threads
+    bool is_paused;
+    IndexSiteStats frame[NUM_INDEX_SITES];
+    IndexSiteStats last_frame[NUM_INDEX_SITES];
+    IndexSiteStats total[NUM_INDEX_SITES];
+    long num_frames;
+    // batch query pairs that didn't fit the caller's buffer, over the run
+    long num_dropped_pairs;
+} IndexStats;
+
+// Shape of an index right now, walked on demand
+typedef struct {
+    int num_points;
+    // in the coarse tier, not part of the rest
+    int num_far_points;
+    int num_nodes;
+    int num_leaves;
+    int max_depth;
+    // over the leaves
+    float avg_depth;
+    int leaf_histogram[INDEX_HISTOGRAM_BINS];
+} IndexTreeStats;
+
+typedef struct {
+    // mean index ms per enemy per frame of each candidate, -1 until measured
+    float cost[TUNER_MAX_CANDIDATES];
+    int best;
+} TunerBand;
+
+// Picks the index param (leaf capacity or cell size) per enemy count band by trying them out
+typedef struct {
+    float candidates[TUNER_MAX_CANDIDATES];
+    int num_candidates;
+    TunerBand bands[TUNER_BANDS];
+    // candidate in use and the band it's being measured in
+    int current;
+    int band;
+    // running epoch
+    double epoch_cost;
+    int epoch_frames;
+    int num_epochs;
+    // frames left to drop, the rebuild after a switch shouldn't count against the new setting
+    int skip_frames;
+} IndexTuner;
+
+typedef struct {
+    SpatialIndexType type;
+    QRect boundary;
+    QTree *qtree;
+    SGrid *grid;
+    LTree *linear;
+    // coarse tier for the points outside the boundary, the trees only cover the boundary
+    SGrid *far;
+    // made on the first rebuild big enough to go parallel
+    QTreeBuild *build;
+    // room for capacity points, for the caller to gather a rebuild's points in
+    QPoint *build_points;
+    int capacity;
+} SpatialIndex;
+
+// One task of a jobs_run batch, from 0 to num_tasks - 1
+typedef void (*JobFunc)(void *ctx, int task);
+
+// Worker threads parked between batches, the wasm build has none and runs batches on the caller
+typedef struct {
+#ifndef WASM
+    pthread_t threads[MAX_JOB_THREADS];
+    pthread_mutex_t lock;
+    // a new batch is up or the pool is shutting down
+    pthread_cond_t batch_ready;
+    pthread_cond_t batch_done;
+#endif
+    int num_workers;
+    JobFunc func;
+    void *ctx;
+    int num_tasks;
+    int next_task;
+    int num_done;
+    // bumped for every batch, workers sleep until it moves
+    int batch;
+    bool is_quit;
+} JobPool;
+
+// Boid separation for one enemy, accumulated over its neighbours
+typedef struct {
+    int id;
+    Vec2 pos;
+    float perception_radius;
+    Vec2 force;
+} SeparationQuery;
+
 // :bullet
 typedef struct {
     Vec2 pos;
@@ -267,18 +786,146 @@ typedef struct {
     int last_spawn_ts;
 } Enemy;
 
+// EnemyArrays.flags bits
+#define ENEMY_SHINY (1 << 0)
+#define ENEMY_FROZEN (1 << 1)
+#define ENEMY_DAMAGED (1 << 2)
+#define ENEMY_PLAYER_FOUND (1 << 3)
+// set by the behaviour pass when the enemy moves itself or stands still this frame
+#define ENEMY_HOLD (1 << 4)
+
+/**
+ * Milliseconds on the enemy clock, see enemy_clock.
+ * The clock is rebased before it runs out of 16 bits, the timers it drives are all
+ * shorter than ENEMY_CLOCK_KEEP_MS so a stamp clamped by the rebase still reads as expired
+ */
+typedef unsigned short EnemyTime;
+#define ENEMY_CLOCK_REBASE_MS 60000
+#define ENEMY_CLOCK_KEEP_MS 15000
+
+// Only RAM, MAGE and DEMON have one, in the table for their type
+typedef struct {
+    // RAM
+    Vec2 charge_dir;
+    EnemyTime player_found_ts;
+    // DEMON
+    EnemyTime last_spawn_ts;
+    // back into colds, so a swap remove can patch the moved entry
+    unsigned short owner;
+} EnemyCold;
+
+typedef enum {
+    COLD_RAM,
+    COLD_MAGE,
+    COLD_DEMON,
+    NUM_COLD_TABLES
+} EnemyColdTable;
+
+// Dense, one per type so each behaviour pass only walks its own enemies
+typedef struct {
+    EnemyCold *entries;
+    int count;
+    int capacity;
+} EnemyColds;
+
+#define NO_ENEMY_COLD 0xffff
+#define ENEMY_COLD_MIN_CAPACITY 256
+#if MAX_ENEMIES >= NO_ENEMY_COLD
+#error "EnemyCold.owner and EnemyArrays.colds hold enemy slots in 16 bits"
+#endif
+
+/**
+ * What a behaviour task leaves for the main thread, the bullets fired and the pups spawned.
+ * They're merged in task order once the batch is done, whichever thread ran which task.
+ * Each task gets its own run of the shared spawn buffers, as long as its type can use
+ */
+typedef struct {
+    Bullet *bullets;
+    int num_bullets;
+    Enemy *pups;
+    int num_pups;
+    // own random stream, seeded from GetRandomValue on the main thread
+    unsigned int rng;
+} EnemyTask;
+
+/**
+ * The live enemies, one array per field, slot i of each is the same enemy and its index id.
+ * A pass over every enemy only pulls in the fields it reads, x, y, health, speed, type and
+ * flags are what the per frame passes read, the timestamps only matter while a flag is set.
+ * The type specific state lives in dense side tables so BATs don't pay for it.
+ * Enemy is still the record for spawning one, enemy_add spreads it over the arrays.
+ */
+typedef struct {
+    float *xs;
+    float *ys;
+    float *healths;
+    float *speeds;
+    unsigned char *types;
+    unsigned char *flags;
+    EnemyTime *spawn_ts;
+    EnemyTime *frozen_ts;
+    EnemyTime *damage_ts;
+    // slot in the table for the enemy's type, NO_ENEMY_COLD for the types without one
+    unsigned short *colds;
+    // scratch, the separation force of this frame
+    float *sep_xs;
+    float *sep_ys;
+
+    EnemyColds cold[NUM_COLD_TABLES];
+
+    // scratch for update_enemies, the enemies doing separation this frame and the behaviour tasks
+    int *sep_ids;
+    EnemyTask *tasks;
+    int task_capacity;
+    // what the tasks spawn, split between them, see get_enemy_max_bullets and get_enemy_max_pups
+    Bullet *task_bullets;
+    int task_bullets_capacity;
+    Enemy *task_pups;
+    int task_pups_capacity;
+} EnemyArrays;
+
+// One frame of update_enemies, read only for its tasks
+typedef struct {
+    Vec2 player_pos;
+    // enemy clock
+    int now;
+    float dt;
+    // as of the start of the frame, the merge drops whatever doesn't fit anymore
+    bool has_bullet_room;
+    bool has_enemy_room;
+    int num_enemies;
+
+    float perception_radius;
+    int *sep_ids;
+    int num_sep;
+
+    // the tasks of cold table t are first_task[t] up to first_task[t + 1]
+    int first_task[NUM_COLD_TABLES + 1];
+    EnemyTask *tasks;
+} EnemyPass;
+
 typedef struct {
     Vec2 pos;
     int decoration_idx;
 } Decoration;
 
+// Stays valid while the pickup is alive, a stale one just doesn't resolve anymore
+typedef int PickupHandle;
+
 typedef struct {
     Vec2 pos;
     PickupType type;
     int spawn_ts;
-    bool is_collected;
+    // back into pickup_slots, so a swap remove can patch the moved pickup's slot
+    int slot;
 } Pickup;
 
+typedef struct {
+    // into pickups while alive, the next free slot while free
+    int index;
+    int generation;
+} PickupSlot;
+
 typedef struct {
     Vec2 pos;
     Vec2 dir;
@@ -318,11 +965,14 @@ typedef struct {
     int flame_ts;
     int frost_wave_ts;
     int orbs_ts;
+    int laser_ts;
 
     // Enemy
     int qtree_update_ts;
     int enemy_spawn_ts;
     int enemy_spawn_interval;
+    // epoch of the enemy clock
+    int enemy_clock_ts;
 
 } Timers;
 
@@ -370,6 +1020,11 @@ typedef struct {
     float orbs_count;
     float orbs_size;
 
+    float laser_interval;
+    float laser_range;
+    float laser_damage;
+    float laser_penetration;
+
     float player_speed;
     float shiny_chance;
 } Stats;
@@ -381,6 +1036,7 @@ typedef struct {
     int flame_level;
     int frost_wave_level;
     int orbs_level;
+    int laser_level;
     int speed_level;
     int shiny_level;
 } Upgrades;
@@ -425,6 +1081,8 @@ typedef struct {
     Stats stats;
     Upgrades upgrades;
     Upgrades available_upgrades;
+    // NULL when it couldn't start, jobs_run does everything on the main thread then
+    JobPool *jobs;
     Toast *toasts;
     int toasts_count;
     int wave_index;
@@ -453,19 +1111,28 @@ typedef struct {
     int flame_particles_count;
     Particle *frost_wave_particles;
     int frost_wave_particles_count;
+    // last fired beam, drawn for LASER_LIFETIME_MILLIS
+    Vec2 laser_start;
+    Vec2 laser_end;
+    Broadphase *broadphase;
 
     // Enemy
-    Enemy *enemies;
+    EnemyArrays enemies;
     int enemy_count;
-    QTree *enemy_qtree;
+    SpatialIndex *enemy_index;
+    IndexTuner enemy_index_tuner;
+    NeighbourCache player_neighbours;
     int num_enemies_per_tick;
 
     // World
     Rect world_dims;
     Decoration *decorations;
+    // kept dense, the index and handles go through pickup_slots
     Pickup *pickups;
     int pickups_count;
-    QTree *pickups_qtree;
+    PickupSlot *pickup_slots;
+    int pickup_free_slot;
+    StaticGrid *pickups_grid;
 
     // UI
     float master_volume;
@@ -473,10 +1140,6 @@ typedef struct {
     Enemy *main_menu_enemies;
     int main_menu_enemies_count;
 
-    // Others
-    QPoint *query_points;
-    int num_query_points;
-
     // Debug
     bool is_show_debug_gui;
     Temp temp;
@@ -499,10 +1162,12 @@ void draw_upgrade_menu();
 void draw_upgrade_option(UpgradeType type, int level, Vec2 *pos);
 void draw_player();
 void draw_enemies();
+bool visit_draw_enemy(QPoint pt, void *ctx);
 void draw_particles();
 void draw_bullets();
 void draw_decorations();
 void draw_pickups();
+bool visit_draw_pickup(QPoint pt, void *ctx);
 void draw_toasts();
 void draw_health_bar(Vec2 pos, float health, float max_health);
 void draw_sprite(Texture2D *sprite_sheet, Vec2 tile, Vec2 pos, float scale, float rotation, Color tint);
@@ -511,11 +1176,25 @@ void draw_spritev(Texture2D *sprite_sheet, Vec2 tile, Vec2 pos, float scale, flo
 // :update
 void update_game();
 void update_player();
+bool visit_player_hurt(QPoint pt, void *ctx);
 void update_enemies();
+void update_ram_enemies(EnemyPass *pass, int start, int end, EnemyTask *task);
+void update_mage_enemies(EnemyPass *pass, int start, int end, EnemyTask *task);
+void update_demon_enemies(EnemyPass *pass, int start, int end, EnemyTask *task);
+int _enemy_task_random(EnemyTask *task, int min, int max);
+void _enemies_separation_task(void *ctx, int task);
+void _enemies_behaviour_task(void *ctx, int task);
+void _enemies_move_task(void *ctx, int task);
+bool visit_bullet_hit(QPoint pt, void *ctx);
+bool visit_flame_hit(QPoint pt, void *ctx);
+bool visit_frost_hit(QPoint pt, void *ctx);
+bool visit_separation(QPoint pt, void *ctx);
 void update_particles();
 void update_bullets();
 void update_pickups();
 void update_toasts();
+void update_collisions();
+void collect_pickup(QPoint pt);
 
 // :sound :music
 void sounds_init();
@@ -527,6 +1206,30 @@ void play_sound_modulated(Sound *sound, float volume);
 void decorations_init();
 void update_decorations();
 
+// :enemies
+bool enemies_init(EnemyArrays *enemies, int capacity);
+void enemies_destroy(EnemyArrays *enemies);
+bool _enemies_reserve_tasks(EnemyArrays *enemies, int num_tasks, int num_bullets, int num_pups);
+int enemy_add(Enemy enemy);
+void enemy_remove(int i);
+EnemyCold *enemy_cold(int i);
+void enemies_chase(EnemyArrays *enemies, int start, int end, Vec2 target, float dt);
+int enemy_clock();
+EnemyTime enemy_stamp();
+void enemy_clock_rebase();
+Vec2 enemy_pos(int i);
+void enemy_set_pos(int i, Vec2 pos);
+bool enemy_has(int i, int flag);
+void enemy_set(int i, int flag, bool is_set);
+
+// :pickups
+void pickups_init();
+PickupHandle pickup_add(Pickup pickup);
+bool pickup_remove(PickupHandle handle);
+Pickup *pickup_get(PickupHandle handle);
+PickupHandle pickup_handle(int slot);
+Pickup *pickup_at_slot(int slot);
+
 // :input
 void handle_player_input();
 void handle_debug_inputs();
@@ -534,15 +1237,202 @@ void handle_extra_inputs();
 void handle_window_resize();
 void handle_virtual_joystick_input();
 
+// :index :spatial
+SpatialIndex *index_create(SpatialIndexType type, QRect boundary, int capacity);
+void index_destroy(SpatialIndex *index);
+void index_clear(SpatialIndex *index);
+void index_reset_boundary(SpatialIndex *index, QRect rect);
+bool index_insert(SpatialIndex *index, QPoint pt);
+bool index_update(SpatialIndex *index, QPoint pt);
+bool index_remove_id(SpatialIndex *index, int id);
+void index_sync(SpatialIndex *index);
+void index_build(SpatialIndex *index, QPoint *points, int num_points, JobPool *jobs);
+void index_visit(SpatialIndex *index, QRect range, QueryVisitor visit, void *ctx);
+void index_visit_shape(SpatialIndex *index, QShape *shape, QueryVisitor visit, void *ctx);
+int index_query(SpatialIndex *index, QRect range, QPoint *result, int max_points);
+int index_query_shape(SpatialIndex *index, QShape *shape, QPoint *result, int max_points);
+bool _index_collect(QPoint pt, void *ctx);
+QShape shape_circle(Vec2 center, float radius);
+QShape shape_cone(Vec2 origin, Vec2 dir, float range, float spread);
+QShape shape_segment(Vec2 start, Vec2 end, float radius);
+int index_query_segment(SpatialIndex *index, QShape *segment, QPoint *result, int max_points);
+bool _shape_segment_entry(QShape *segment, QRect rect, float *t_enter);
+bool is_shape_contains_point(QShape *shape, QPoint pt);
+bool is_shape_overlap_rect(QShape *shape, QRect rect);
+bool query_batch_scratch_init(QueryBatchScratch *scratch, int capacity);
+void query_batch_scratch_destroy(QueryBatchScratch *scratch);
+int index_query_batch(
+    SpatialIndex *index, QRect *ranges, int num_ranges, QueryPair *pairs, int max_pairs,
+    QueryBatchScratch *scratch
+);
+bool _index_collect_pair(QPoint pt, void *ctx);
+void _index_morton_order(QRect *ranges, int num_ranges, QueryBatchScratch *scratch);
+unsigned int _index_morton_code(unsigned int x, unsigned int y);
+void _index_radix_sort(unsigned int *keys, int *values, int n, unsigned int *tmp_keys, int *tmp_values);
+bool index_nearest(SpatialIndex *index, Vec2 pos, float max_dist, QPoint *result);
+int index_k_nearest(SpatialIndex *index, Vec2 pos, float max_dist, int k, QPoint *result);
+bool _index_is_far(SpatialIndex *index, QRect range);
+void _index_push_nearest(QPoint *result, float *dists, int *num_points, int k, QPoint pt, float dist);
+const char *index_type_name(SpatialIndexType type);
+void index_stats_begin(IndexSite site);
+void index_stats_end();
+void index_stats_count(int queries, int nodes, int points);
+void index_stats_next_frame();
+void index_stats_dump(SpatialIndex *index);
+void index_tree_stats(SpatialIndex *index, IndexTreeStats *stats);
+void _index_tree_stats_leaf(IndexTreeStats *stats, int depth, int num_points);
+const char *index_site_name(IndexSite site);
+void index_set_param(SpatialIndex *index, float value);
+float index_get_param(SpatialIndex *index);
+const char *index_param_name(SpatialIndexType type);
+void index_tuner_init(IndexTuner *tuner, SpatialIndex *index);
+bool index_tuner_update(IndexTuner *tuner, SpatialIndex *index, int num_points);
+void index_tuner_dump(IndexTuner *tuner, SpatialIndex *index);
+int _index_tuner_band(int num_points);
+int _index_tuner_pick(IndexTuner *tuner, TunerBand *band);
+
 // :quadtree :qtree
-QTree* qtree_create(QRect boundary);
+QTree* qtree_create(QRect boundary, int capacity);
 void qtree_destroy(QTree *qtree);
 void qtree_clear(QTree *qtree);
 void qtree_reset_boundary(QTree *qtree, QRect rect);
 bool qtree_insert(QTree *qtree, QPoint pt);
-bool qtree_remove(QTree *qtree, QPoint pt);
-void qtree_query(QTree *qtree, QRect range, QPoint *result, int *num_points);
-void _qtree_subdivide(QTree *qtree);
+bool qtree_update(QTree *qtree, QPoint pt);
+bool qtree_remove_id(QTree *qtree, int id);
+bool qtree_visit(QTree *qtree, QRect range, QueryVisitor visit, void *ctx);
+bool qtree_visit_batch(QTree *qtree, QRect *ranges, int *active, int num_active, QueryPairBuffer *buffer);
+bool _qtree_visit_batch(QTree *qtree, int node, QRect *ranges, int *active, int num_active, QueryPairBuffer *buffer);
+bool qtree_nearest(QTree *qtree, Vec2 pos, float max_dist, QPoint *result);
+int qtree_k_nearest(QTree *qtree, Vec2 pos, float max_dist, int k, QPoint *result);
+bool _qtree_insert(QTree *tree, int node, QPoint pt);
+bool _qtree_insert_down(QTree *tree, int node, QPoint pt);
+int qtree_build(QTree *qtree, QTreeBuild *build, QPoint *points, int num_points, JobPool *jobs, QPoint **outside);
+QTreeBuild *qtree_build_create();
+void qtree_build_destroy(QTreeBuild *build);
+bool _qtree_build_reserve(QTreeBuild *build, int num_points);
+void _qtree_build_bin(void *ctx, int slice);
+void _qtree_build_scatter(void *ctx, int slice);
+void _qtree_build_cell(void *ctx, int cell);
+void _qtree_build_link(void *ctx, int cell);
+void _qtree_reset(QTree *qtree, QRect rect, int depth);
+bool _qtree_reserve(QTree *qtree, int num_nodes, int num_buckets);
+bool _qtree_remove_from_node(QTree *qtree, int node, int id);
+void _qtree_collapse(QTree *qtree, int node);
+bool _qtree_visit(QTree *qtree, int node, QRect range, QueryVisitor visit, void *ctx);
+bool _qtree_visit_all(QTree *qtree, int node, QueryVisitor visit, void *ctx);
+bool qtree_visit_shape(QTree *qtree, QShape *shape, QueryVisitor visit, void *ctx);
+bool _qtree_visit_shape(QTree *qtree, int node, QShape *shape, QueryVisitor visit, void *ctx);
+bool qtree_visit_segment(QTree *qtree, QShape *segment, QueryVisitor visit, void *ctx);
+bool _qtree_visit_segment(QTree *qtree, int node, QShape *segment, QueryVisitor visit, void *ctx);
+void _qtree_reset_node_boundary(QTree *qtree, int node, QRect rect);
+bool _qtree_subdivide(QTree *qtree, int node);
+bool _qtree_push_point(QTree *qtree, int node, QPoint pt);
+void _qtree_remove_at(QTree *qtree, int node, int b, int i);
+int _qtree_quadrant(QRect boundary, QPoint pt);
+QRect _qtree_loose_bounds(QRect boundary);
+int _qtree_alloc_block(QTree *qtree);
+void _qtree_free_block(QTree *qtree, int block);
+int _qtree_alloc_bucket(QTree *qtree);
+void _qtree_free_bucket(QTree *qtree, int b);
+int _qtree_count_points(QTree *qtree, int node, int *subtree_points);
+void _qtree_heap_push(QTree *qtree, int *heap_size, QNodeDist item);
+QNodeDist _qtree_heap_pop(QTree *qtree, int *heap_size);
+float _qtree_node_dist(QTree *qtree, int node, Vec2 pos);
+void _qtree_tree_stats(QTree *qtree, int node, IndexTreeStats *stats);
+QPoint _qtree_bucket_point(QBucket *bucket, int i);
+int _qtree_scan_rect(QBucket *bucket, QRect range, int *hits);
+int _qtree_scan_shape(QBucket *bucket, QShape *shape, int *hits);
+
+// :grid
+SGrid *grid_create(float cell_size, int capacity);
+void grid_destroy(SGrid *grid);
+void grid_clear(SGrid *grid);
+bool grid_insert(SGrid *grid, QPoint pt);
+bool grid_update(SGrid *grid, QPoint pt);
+bool grid_remove_id(SGrid *grid, int id);
+bool grid_visit(SGrid *grid, QRect range, QueryVisitor visit, void *ctx);
+bool grid_visit_shape(SGrid *grid, QShape *shape, QueryVisitor visit, void *ctx);
+bool grid_visit_segment(SGrid *grid, QShape *segment, QueryVisitor visit, void *ctx);
+int grid_k_nearest(SGrid *grid, Vec2 pos, float max_dist, int k, QPoint *result);
+void grid_build(SGrid *grid);
+bool _grid_unstage(SGrid *grid, int staged);
+bool _grid_remove_at(SGrid *grid, int bucket, int i);
+int _grid_cell(SGrid *grid, float v);
+int _grid_bucket(SGrid *grid, int cx, int cy);
+
+// :linear :ltree
+LTree *ltree_create(QRect boundary, int capacity);
+void ltree_destroy(LTree *ltree);
+void ltree_clear(LTree *ltree);
+void ltree_reset_boundary(LTree *ltree, QRect rect);
+bool ltree_insert(LTree *ltree, QPoint pt);
+bool ltree_update(LTree *ltree, QPoint pt);
+bool ltree_remove_id(LTree *ltree, int id);
+void ltree_build(LTree *ltree);
+bool ltree_visit(LTree *ltree, QRect range, QueryVisitor visit, void *ctx);
+bool ltree_visit_shape(LTree *ltree, QShape *shape, QueryVisitor visit, void *ctx);
+bool ltree_visit_segment(LTree *ltree, QShape *segment, QueryVisitor visit, void *ctx);
+int ltree_k_nearest(LTree *ltree, Vec2 pos, float max_dist, int k, QPoint *result);
+bool _ltree_visit(LTree *ltree, unsigned int prefix, int level, QRect cell, int lo, int hi, QRect range, QueryVisitor visit, void *ctx);
+bool _ltree_visit_shape(LTree *ltree, unsigned int prefix, int level, QRect cell, int lo, int hi, QShape *shape, QueryVisitor visit, void *ctx);
+bool _ltree_visit_segment(LTree *ltree, unsigned int prefix, int level, QRect cell, int lo, int hi, QShape *segment, QueryVisitor visit, void *ctx);
+void _ltree_k_nearest(LTree *ltree, unsigned int prefix, int level, QRect cell, int lo, int hi, Vec2 pos, int k,
+        QPoint *result, float *dists, int *num_points, float *bound);
+unsigned int _ltree_key(LTree *ltree, float x, float y);
+unsigned int _ltree_prefix_start(unsigned int prefix, int level);
+void _ltree_split(LTree *ltree, unsigned int prefix, int level, int lo, int hi, int *bounds);
+int _ltree_lower_bound(LTree *ltree, int lo, int hi, unsigned int key);
+QRect _ltree_root(LTree *ltree);
+QRect _ltree_child_rect(QRect cell, int c);
+QRect _ltree_loose(LTree *ltree, QRect cell);
+void _ltree_tree_stats(LTree *ltree, unsigned int prefix, int level, int lo, int hi, IndexTreeStats *stats);
+
+// :neighbours
+bool neighbours_init(NeighbourCache *cache, int capacity);
+void neighbours_destroy(NeighbourCache *cache);
+void neighbours_gather(NeighbourCache *cache, SpatialIndex *index, Vec2 pos, float radius);
+bool _visit_neighbour(QPoint pt, void *ctx);
+int neighbours_prefix(NeighbourCache *cache, Vec2 pos, float radius);
+void neighbours_visit(NeighbourCache *cache, SpatialIndex *index, QRect range, QueryVisitor visit, void *ctx);
+void neighbours_visit_shape(NeighbourCache *cache, SpatialIndex *index, QShape *shape, QueryVisitor visit, void *ctx);
+int neighbours_k_nearest(NeighbourCache *cache, SpatialIndex *index, Vec2 pos, float max_dist, int k, QPoint *result);
+float get_player_neighbours_radius();
+
+// :broadphase
+Broadphase *broadphase_create();
+void broadphase_destroy(Broadphase *bp);
+void broadphase_interact(Broadphase *bp, CollisionLayer a, CollisionLayer b);
+bool broadphase_is_pair(Broadphase *bp, CollisionLayer a, CollisionLayer b);
+int broadphase_find_pairs(Broadphase *bp);
+bool _broadphase_push(Broadphase *bp, CollisionLayer layer_a, int a, CollisionLayer layer_b, QPoint b);
+void _broadphase_bullet_enemy(Broadphase *bp);
+QRect _broadphase_bullet_range(Bullet *bullet);
+bool _broadphase_use_sap(int num_bullets, int num_enemies);
+void _broadphase_sweep(Broadphase *bp);
+void _broadphase_sap_order(Broadphase *bp);
+void _broadphase_sap_sort(Broadphase *bp);
+int _broadphase_sap_band(Broadphase *bp, int *head, SapEntry *entry);
+void _broadphase_sap_test(Broadphase *bp, SapEntry *bullet, SapEntry *enemy);
+void _broadphase_player_enemy(Broadphase *bp);
+void _broadphase_player_enemy_bullet(Broadphase *bp);
+void _broadphase_player_pickup(Broadphase *bp);
+bool _visit_collect_pair(QPoint pt, void *ctx);
+
+// :static
+StaticGrid *static_grid_create(float cell_size, int capacity);
+void static_grid_destroy(StaticGrid *grid);
+void static_grid_clear(StaticGrid *grid);
+bool static_grid_insert(StaticGrid *grid, QPoint pt);
+bool static_grid_remove_id(StaticGrid *grid, int id);
+bool static_grid_visit(StaticGrid *grid, QRect range, QueryVisitor visit, void *ctx);
+int static_grid_query(StaticGrid *grid, QRect range, QPoint *result, int max_points);
+int static_grid_compact(StaticGrid *grid, int max_cells);
+bool _static_grid_visit_cell(StaticGrid *grid, SCell *cell, QRect range, QueryVisitor visit, void *ctx);
+void _static_grid_compact_cell(StaticGrid *grid, int c);
+void _static_grid_free_cell(StaticGrid *grid, int c);
+int _static_grid_find(StaticGrid *grid, int cx, int cy);
+int _static_grid_add_cell(StaticGrid *grid, int cx, int cy);
+int _static_grid_bucket(StaticGrid *grid, int cx, int cy);
 
 // :data
 Vec2 get_enemy_sprite_pos(EnemyType type, bool is_shiny);
@@ -550,6 +1440,9 @@ float get_enemy_scale(EnemyType type);
 float get_enemy_health(EnemyType type, bool is_shiny);
 float get_enemy_speed(EnemyType type);
 float get_enemy_damage(EnemyType type);
+int get_enemy_cold_table(EnemyType type);
+int get_enemy_max_bullets(EnemyColdTable table);
+int get_enemy_max_pups(EnemyColdTable table);
 Vec2 get_attack_sprite(AttackType type);
 int get_attack_range(AttackType type);
 int get_attack_speed(AttackType type);
@@ -585,6 +1478,7 @@ Vec2 rotate_vector(Vec2 vec, float angle);
 Vec2 get_line_center(Vec2 a, Vec2 b);
 Vec2 get_rand_unit_vec2();
 bool is_rect_contains_point(QRect rect, QPoint pt);
+bool is_rect_contains_rect(QRect outer, QRect inner);
 bool is_rect_overlap(QRect first, QRect second);
 bool are_colors_equal(Color a, Color b);
 Vec2 get_rand_pos_around_point(Vec2 pt, float minDist, float maxDist);
@@ -594,6 +1488,16 @@ float vec2_to_angle(Vec2 dir);
 void print(const char *text);
 void printe(const char *text);
 
+// :jobs
+JobPool *jobs_create(int num_threads);
+void jobs_destroy(JobPool *pool);
+void jobs_run(JobPool *pool, JobFunc func, void *ctx, int num_tasks);
+int jobs_num_threads(JobPool *pool);
+int jobs_num_cores();
+void jobs_slice(int n, int num_slices, int slice, int *start, int *end);
+void *_jobs_worker(void *arg);
+void _jobs_drain(JobPool *pool);
+
 // :ana
 void* post_analytics_thread(void* arg);
 void post_analytics_async(AnalyticsType type);